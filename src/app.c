@@ -86,6 +86,13 @@ void app_init()
 
 void app_shutdown()
 {
+    for (int32_t i = 0; i < _ctx.num_branches; i++) {
+        text_destroy(_ctx.branches[i]);
+    }
+    _ctx.num_branches = 0;
+
+    textfield_destroy(_ctx.tf);
+    _ctx.tf = NULL;
 }
 
 void app_keydown(int32_t key, uint32_t mods)
@@ -0,0 +1,143 @@
+#include "arena.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    uint8_t *data;
+} arena_chunk;
+
+typedef struct arena {
+    arena_chunk *first;
+    arena_chunk *current;
+    size_t chunk_size;
+
+    size_t used;
+    size_t high_water;
+    size_t capacity;
+    uint32_t chunks;
+} arena;
+
+static arena_chunk* create_chunk(size_t size);
+static void* chunk_alloc(arena_chunk *c, size_t size, size_t align);
+
+arena* arena_create(size_t chunk_size)
+{
+    assert(chunk_size > 0);
+
+    arena *a = calloc(1, sizeof(arena));
+    if (!a) {
+        return NULL;
+    }
+
+    a->chunk_size = chunk_size;
+    a->first = create_chunk(chunk_size);
+    if (!a->first) {
+        free(a);
+        return NULL;
+    }
+    a->current = a->first;
+    a->capacity = chunk_size;
+    a->chunks = 1;
+
+    return a;
+}
+
+void arena_destroy(arena *a)
+{
+    assert(a);
+
+    arena_chunk *c = a->first;
+    while (c) {
+        arena_chunk *next = c->next;
+        free(c);
+        c = next;
+    }
+    free(a);
+}
+
+void* arena_alloc(arena *a, size_t size, size_t align)
+{
+    assert(a);
+    assert(align > 0 && (align & (align - 1)) == 0);
+
+    // Move on to chunks left over from before the last reset first.
+    void *result = chunk_alloc(a->current, size, align);
+    while (!result && a->current->next) {
+        a->current = a->current->next;
+        result = chunk_alloc(a->current, size, align);
+    }
+
+    if (!result) {
+        size_t chunk_size = max(a->chunk_size, size + align);
+        arena_chunk *c = create_chunk(chunk_size);
+        if (!c) {
+            return NULL;
+        }
+        a->current->next = c;
+        a->current = c;
+        a->capacity += chunk_size;
+        a->chunks++;
+
+        result = chunk_alloc(c, size, align);
+        assert(result);
+    }
+
+    a->used += size;
+    a->high_water = max(a->high_water, a->used);
+    return result;
+}
+
+void arena_reset(arena *a)
+{
+    assert(a);
+
+    for (arena_chunk *c = a->first; c; c = c->next) {
+        c->used = 0;
+    }
+    a->current = a->first;
+    a->used = 0;
+}
+
+void arena_stats_get(const arena *a, arena_stats *dst)
+{
+    assert(a);
+    assert(dst);
+
+    dst->used = a->used;
+    dst->high_water = a->high_water;
+    dst->capacity = a->capacity;
+    dst->chunks = a->chunks;
+}
+
+static arena_chunk* create_chunk(size_t size)
+{
+    // The chunk header and its data share one allocation.
+    arena_chunk *c = malloc(sizeof(arena_chunk) + size);
+    if (!c) {
+        return NULL;
+    }
+
+    c->next = NULL;
+    c->size = size;
+    c->used = 0;
+    c->data = (uint8_t*)(c + 1);
+
+    return c;
+}
+
+static void* chunk_alloc(arena_chunk *c, size_t size, size_t align)
+{
+    uintptr_t base = (uintptr_t)c->data;
+    uintptr_t start = (base + c->used + align - 1) & ~(uintptr_t)(align - 1);
+    size_t end = (size_t)(start - base) + size;
+    if (end > c->size) {
+        return NULL;
+    }
+
+    c->used = end;
+    return (void*)start;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "common.h"
+
+// Bump allocator that grows in chunks. Resetting keeps the chunks around so
+// memory that is rebuilt every frame only hits malloc while it grows.
+typedef struct arena arena;
+
+typedef struct arena_stats {
+    size_t used;       // Bytes allocated since the last reset.
+    size_t high_water; // Most bytes allocated between two resets.
+    size_t capacity;   // Bytes held by all chunks.
+    uint32_t chunks;
+} arena_stats;
+
+arena* arena_create(size_t chunk_size);
+void arena_destroy(arena *a);
+
+// Returns size bytes aligned to align, which must be a power of 2. Returns
+// NULL if a new chunk can't be allocated.
+void* arena_alloc(arena *a, size_t size, size_t align);
+
+// Frees every allocation at once without giving the chunks back.
+void arena_reset(arena *a);
+
+void arena_stats_get(const arena *a, arena_stats *dst);
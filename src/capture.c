@@ -0,0 +1,522 @@
+#include "capture.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "console.h"
+#include "hash.h"
+#include "text.h"
+#include "ustr.h"
+
+#define CAPTURE_MAGIC "BGCP"
+
+// Texts are written ahead of the first command that draws them. A text
+// drawn on the last frame is not written again, both ends keep the texts
+// of the current and the last frame so the reader can drop the rest.
+#define CAPTURE_RECORD_TEXT_DEF 0x80
+
+// Guards against malformed files asking for huge allocations.
+#define CAPTURE_MAX_TEXT_LEN (1 << 24)
+#define CAPTURE_MAX_TEXT_ATTRS (1 << 16)
+
+// The writer finds a text by its hash and the text it was written for, the
+// reader by its id.
+typedef struct capture_text {
+    uint64_t key;
+    const text *src; // Only set by the writer.
+    uint32_t id;     // 0 marks a free slot.
+    text *t;         // Only set by the reader.
+} capture_text;
+
+// Open addressed by key, kept at most half full.
+typedef struct capture_text_set {
+    capture_text *entries;
+    uint32_t count;
+    uint32_t cap;
+} capture_text_set;
+
+typedef struct capture_ctx {
+    FILE *file;
+    capture_text_set texts[2]; // Of the current and the last frame.
+    uint32_t current;
+    uint32_t last_id;
+} capture_ctx;
+
+static capture_ctx _ctx;
+
+typedef struct capture_reader {
+    FILE *file;
+    bool failed;
+    capture_text_set texts[2];
+    uint32_t current;
+} capture_reader;
+
+static capture_text* find_text(capture_text_set *set, uint64_t key,
+                               const text *src);
+static capture_text* add_text(capture_text_set *set, uint64_t key,
+                              const text *src, uint32_t id);
+static void clear_texts(capture_text_set *set, bool release);
+static bool write_text_def(uint32_t id, const text *t);
+static void count_attr(int32_t start, int32_t len, font_family_id font_family,
+                       double font_size, const color *c, void *user_data);
+static void write_attr(int32_t start, int32_t len, font_family_id font_family,
+                       double font_size, const color *c, void *user_data);
+static bool write_bytes(const void *data, size_t size);
+static bool write_rect(const rect *r);
+static bool write_color(const color *c);
+static bool read_bytes(capture_reader *r, void *dst, size_t size);
+static bool read_rect(capture_reader *r, rect *dst);
+static bool read_color(capture_reader *r, color *dst);
+static bool read_text_def(capture_reader *r);
+
+bool capture_start(const char *path)
+{
+    assert(path);
+
+    capture_stop();
+
+    _ctx.file = fopen(path, "wb");
+    if (!_ctx.file) {
+        console_log("Failed to create capture %s", path);
+        return false;
+    }
+
+    uint32_t version = CAPTURE_VERSION;
+    if (!write_bytes(CAPTURE_MAGIC, 4) ||
+        !write_bytes(&version, sizeof(version))) {
+        capture_stop();
+        return false;
+    }
+    return true;
+}
+
+void capture_stop(void)
+{
+    if (_ctx.file) {
+        fclose(_ctx.file);
+    }
+    for (uint32_t i = 0; i < array_size(_ctx.texts); i++) {
+        free(_ctx.texts[i].entries);
+    }
+    memset(&_ctx, 0, sizeof(_ctx));
+}
+
+bool capture_active(void)
+{
+    return _ctx.file != NULL;
+}
+
+void capture_write(const capture_cmd *cmd)
+{
+    assert(cmd);
+    assert(cmd->op < CAPTURE_OP_COUNT);
+
+    if (!_ctx.file) {
+        return;
+    }
+
+    // Texts drawn on the frame before the last are forgotten.
+    if (cmd->op == CAPTURE_OP_FRAME) {
+        _ctx.current = !_ctx.current;
+        clear_texts(&_ctx.texts[_ctx.current], false);
+    }
+
+    // Every text gets an id of its own, and a new one once its content
+    // changes, so texts that hash the same are never taken for each other.
+    bool ok = true;
+    uint32_t id = 0;
+    if (cmd->op == CAPTURE_OP_TEXT) {
+        uint64_t key = HASH64_INITIAL;
+        text_hash(cmd->t, &key);
+        capture_text_set *current = &_ctx.texts[_ctx.current];
+        capture_text *entry = find_text(current, key, cmd->t);
+        if (entry) {
+            id = entry->id;
+        }
+        else {
+            capture_text *last = find_text(&_ctx.texts[!_ctx.current], key,
+                                           cmd->t);
+            if (last) {
+                id = last->id;
+            }
+            else {
+                _ctx.last_id = _ctx.last_id == UINT32_MAX ? 1
+                                                          : _ctx.last_id + 1;
+                id = _ctx.last_id;
+            }
+            ok = add_text(current, key, cmd->t, id) != NULL &&
+                 (last || write_text_def(id, cmd->t));
+        }
+    }
+
+    uint8_t op = (uint8_t)cmd->op;
+    ok = ok && write_bytes(&op, sizeof(op));
+    switch (cmd->op) {
+        case CAPTURE_OP_FRAME:
+            ok = ok && write_bytes(&cmd->w, sizeof(cmd->w)) &&
+                 write_bytes(&cmd->h, sizeof(cmd->h)) &&
+                 write_bytes(&cmd->scale, sizeof(cmd->scale));
+            break;
+        case CAPTURE_OP_RECT:
+            ok = ok && write_rect(&cmd->r) && write_color(&cmd->c);
+            break;
+        case CAPTURE_OP_TEXT:
+            ok = ok && write_bytes(&id, sizeof(id)) && write_rect(&cmd->r) &&
+                 write_rect(&cmd->clip);
+            break;
+        case CAPTURE_OP_BEGIN_SCROLL:
+            ok = ok && write_bytes(&cmd->region, sizeof(cmd->region)) &&
+                 write_bytes(&cmd->offset, sizeof(cmd->offset)) &&
+                 write_color(&cmd->c);
+            break;
+        case CAPTURE_OP_END_FRAME:
+        case CAPTURE_OP_END_SCROLL:
+        case CAPTURE_OP_BEGIN_LAYER:
+        case CAPTURE_OP_END_LAYER:
+        case CAPTURE_OP_COUNT:
+            break;
+    }
+
+    if (!ok) {
+        console_log("Failed to write the capture, stopping it");
+        capture_stop();
+    }
+}
+
+capture_reader* capture_open(const char *path)
+{
+    assert(path);
+
+    capture_reader *r = calloc(1, sizeof(capture_reader));
+    if (!r) {
+        return NULL;
+    }
+
+    r->file = fopen(path, "rb");
+    char magic[4];
+    uint32_t version;
+    if (!r->file || !read_bytes(r, magic, sizeof(magic)) ||
+        memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0 ||
+        !read_bytes(r, &version, sizeof(version)) ||
+        version != CAPTURE_VERSION) {
+        capture_close(r);
+        return NULL;
+    }
+    return r;
+}
+
+void capture_close(capture_reader *r)
+{
+    if (!r) {
+        return;
+    }
+
+    if (r->file) {
+        fclose(r->file);
+    }
+    for (uint32_t i = 0; i < array_size(r->texts); i++) {
+        clear_texts(&r->texts[i], true);
+        free(r->texts[i].entries);
+    }
+    free(r);
+}
+
+bool capture_read(capture_reader *r, capture_cmd *dst)
+{
+    assert(r);
+    assert(dst);
+
+    uint8_t op;
+    while (true) {
+        if (r->failed || fread(&op, 1, 1, r->file) != 1) {
+            return false;
+        }
+        if (op != CAPTURE_RECORD_TEXT_DEF) {
+            break;
+        }
+        if (!read_text_def(r)) {
+            r->failed = true;
+            return false;
+        }
+    }
+
+    if (op >= CAPTURE_OP_COUNT) {
+        r->failed = true;
+        return false;
+    }
+
+    memset(dst, 0, sizeof(*dst));
+    dst->op = (capture_op)op;
+    bool ok = true;
+    switch (dst->op) {
+        case CAPTURE_OP_FRAME:
+            ok = read_bytes(r, &dst->w, sizeof(dst->w)) &&
+                 read_bytes(r, &dst->h, sizeof(dst->h)) &&
+                 read_bytes(r, &dst->scale, sizeof(dst->scale));
+
+            // The texts the last frame didn't carry over aren't drawn again.
+            r->current = !r->current;
+            clear_texts(&r->texts[r->current], true);
+            break;
+        case CAPTURE_OP_RECT:
+            ok = read_rect(r, &dst->r) && read_color(r, &dst->c);
+            break;
+        case CAPTURE_OP_TEXT: {
+            uint32_t id;
+            ok = read_bytes(r, &id, sizeof(id)) && read_rect(r, &dst->r) &&
+                 read_rect(r, &dst->clip);
+            if (!ok) {
+                break;
+            }
+
+            capture_text_set *current = &r->texts[r->current];
+            capture_text *entry = find_text(current, id, NULL);
+            if (!entry) {
+                capture_text *last = find_text(&r->texts[!r->current], id,
+                                               NULL);
+                entry = last ? add_text(current, id, NULL, id) : NULL;
+                if (entry) {
+                    entry->t = last->t;
+                    last->t = NULL;
+                }
+            }
+            ok = entry && entry->t;
+            dst->t = ok ? entry->t : NULL;
+            break;
+        }
+        case CAPTURE_OP_BEGIN_SCROLL:
+            ok = read_bytes(r, &dst->region, sizeof(dst->region)) &&
+                 read_bytes(r, &dst->offset, sizeof(dst->offset)) &&
+                 read_color(r, &dst->c);
+            break;
+        case CAPTURE_OP_END_FRAME:
+        case CAPTURE_OP_END_SCROLL:
+        case CAPTURE_OP_BEGIN_LAYER:
+        case CAPTURE_OP_END_LAYER:
+        case CAPTURE_OP_COUNT:
+            break;
+    }
+
+    r->failed = !ok;
+    return ok;
+}
+
+bool capture_failed(const capture_reader *r)
+{
+    assert(r);
+    return r->failed;
+}
+
+static capture_text* find_text(capture_text_set *set, uint64_t key,
+                               const text *src)
+{
+    if (set->cap == 0) {
+        return NULL;
+    }
+
+    uint32_t mask = set->cap - 1;
+    uint32_t i = (uint32_t)key & mask;
+    for (; set->entries[i].id != 0; i = (i + 1) & mask) {
+        const capture_text *e = &set->entries[i];
+        if (e->key == key && e->src == src) {
+            return &set->entries[i];
+        }
+    }
+    return NULL;
+}
+
+static capture_text* add_text(capture_text_set *set, uint64_t key,
+                              const text *src, uint32_t id)
+{
+    assert(id != 0);
+
+    if ((set->count + 1) * 2 > set->cap) {
+        uint32_t cap = set->cap ? set->cap * 2 : 256;
+        capture_text *entries = calloc(cap, sizeof(capture_text));
+        if (!entries) {
+            return NULL;
+        }
+
+        for (uint32_t i = 0; i < set->cap; i++) {
+            const capture_text *e = &set->entries[i];
+            if (e->id == 0) {
+                continue;
+            }
+            uint32_t j = (uint32_t)e->key & (cap - 1);
+            while (entries[j].id != 0) {
+                j = (j + 1) & (cap - 1);
+            }
+            entries[j] = *e;
+        }
+        free(set->entries);
+        set->entries = entries;
+        set->cap = cap;
+    }
+
+    uint32_t mask = set->cap - 1;
+    uint32_t i = (uint32_t)key & mask;
+    while (set->entries[i].id != 0) {
+        i = (i + 1) & mask;
+    }
+    set->entries[i] = (capture_text){ .key = key, .src = src, .id = id };
+    set->count++;
+    return &set->entries[i];
+}
+
+static void clear_texts(capture_text_set *set, bool release)
+{
+    for (uint32_t i = 0; i < set->cap; i++) {
+        if (release && set->entries[i].t) {
+            text_destroy(set->entries[i].t);
+        }
+        set->entries[i] = (capture_text){0};
+    }
+    set->count = 0;
+}
+
+// id, the UTF-16 length and code units, the number of attribute runs and
+// the runs in order of start.
+static bool write_text_def(uint32_t id, const text *t)
+{
+    const ustr *str = text_ustr(t);
+    uint32_t len = (uint32_t)ustr_len(str);
+    uint32_t num_attrs = 0;
+    text_attrs(t, count_attr, &num_attrs);
+
+    uint8_t record = CAPTURE_RECORD_TEXT_DEF;
+    if (!write_bytes(&record, sizeof(record)) ||
+        !write_bytes(&id, sizeof(id)) ||
+        !write_bytes(&len, sizeof(len)) ||
+        !write_bytes(ustr_data(str), len * sizeof(uint16_t)) ||
+        !write_bytes(&num_attrs, sizeof(num_attrs))) {
+        return false;
+    }
+
+    bool ok = true;
+    text_attrs(t, write_attr, &ok);
+    return ok;
+}
+
+static void count_attr(int32_t start, int32_t len, font_family_id font_family,
+                       double font_size, const color *c, void *user_data)
+{
+    (void)start;
+    (void)len;
+    (void)font_family;
+    (void)font_size;
+    (void)c;
+
+    (*(uint32_t*)user_data)++;
+}
+
+static void write_attr(int32_t start, int32_t len, font_family_id font_family,
+                       double font_size, const color *c, void *user_data)
+{
+    bool *ok = user_data;
+    uint32_t family = (uint32_t)font_family;
+    *ok = *ok && write_bytes(&start, sizeof(start)) &&
+          write_bytes(&len, sizeof(len)) &&
+          write_bytes(&family, sizeof(family)) &&
+          write_bytes(&font_size, sizeof(font_size)) &&
+          write_color(c);
+}
+
+static bool write_bytes(const void *data, size_t size)
+{
+    return size == 0 || fwrite(data, size, 1, _ctx.file) == 1;
+}
+
+static bool write_rect(const rect *r)
+{
+    return write_bytes(&r->x, sizeof(r->x)) &&
+           write_bytes(&r->y, sizeof(r->y)) &&
+           write_bytes(&r->w, sizeof(r->w)) &&
+           write_bytes(&r->h, sizeof(r->h));
+}
+
+static bool write_color(const color *c)
+{
+    return write_bytes(&c->r, sizeof(c->r)) &&
+           write_bytes(&c->g, sizeof(c->g)) &&
+           write_bytes(&c->b, sizeof(c->b)) &&
+           write_bytes(&c->a, sizeof(c->a));
+}
+
+static bool read_bytes(capture_reader *r, void *dst, size_t size)
+{
+    return size == 0 || fread(dst, size, 1, r->file) == 1;
+}
+
+static bool read_rect(capture_reader *r, rect *dst)
+{
+    return read_bytes(r, &dst->x, sizeof(dst->x)) &&
+           read_bytes(r, &dst->y, sizeof(dst->y)) &&
+           read_bytes(r, &dst->w, sizeof(dst->w)) &&
+           read_bytes(r, &dst->h, sizeof(dst->h));
+}
+
+static bool read_color(capture_reader *r, color *dst)
+{
+    return read_bytes(r, &dst->r, sizeof(dst->r)) &&
+           read_bytes(r, &dst->g, sizeof(dst->g)) &&
+           read_bytes(r, &dst->b, sizeof(dst->b)) &&
+           read_bytes(r, &dst->a, sizeof(dst->a));
+}
+
+static bool read_text_def(capture_reader *r)
+{
+    uint32_t id, len;
+    if (!read_bytes(r, &id, sizeof(id)) || id == 0 ||
+        !read_bytes(r, &len, sizeof(len)) || len > CAPTURE_MAX_TEXT_LEN) {
+        return false;
+    }
+
+    uint16_t *data = malloc((len > 0 ? len : 1) * sizeof(uint16_t));
+    text *t = text_create();
+    if (!data || !t || !read_bytes(r, data, len * sizeof(uint16_t))) {
+        free(data);
+        if (t) {
+            text_destroy(t);
+        }
+        return false;
+    }
+    text_append(t, data, len);
+    free(data);
+
+    uint32_t num_attrs;
+    bool ok = read_bytes(r, &num_attrs, sizeof(num_attrs)) &&
+              num_attrs <= CAPTURE_MAX_TEXT_ATTRS;
+    for (uint32_t i = 0; ok && i < num_attrs; i++) {
+        int32_t start, attr_len;
+        uint32_t family;
+        double font_size;
+        color c;
+        // Runs may reach past the end of the text but never start before
+        // it, text_add_attr asserts on that.
+        ok = read_bytes(r, &start, sizeof(start)) && start >= 0 &&
+             read_bytes(r, &attr_len, sizeof(attr_len)) && attr_len >= 0 &&
+             read_bytes(r, &family, sizeof(family)) &&
+             family < FONT_FAMILY_COUNT &&
+             read_bytes(r, &font_size, sizeof(font_size)) &&
+             read_color(r, &c);
+        if (ok) {
+            text_add_attr(t, start, attr_len, (font_family_id)family,
+                          font_size, &c);
+        }
+    }
+
+    // Texts are only defined once per frame.
+    capture_text_set *current = &r->texts[r->current];
+    capture_text *entry = NULL;
+    if (ok && !find_text(current, id, NULL)) {
+        entry = add_text(current, id, NULL, id);
+    }
+    if (!entry) {
+        text_destroy(t);
+        return false;
+    }
+    entry->t = t;
+    return true;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "common.h"
+#include "color.h"
+#include "rect.h"
+#include "vec2.h"
+
+typedef struct text text;
+
+// Captures what the app asks the renderer to draw to a file, frame by frame,
+// so it can be replayed without the app, see tools/replay.c. Every call of
+// the render API that records commands is written along with the text it
+// draws, which is written once per text object and content. Texts are
+// told apart by object as well as by their hash, so two texts that hash
+// the same can't stand in for each other.
+//
+// The file starts with the magic "BGCP" and a u32 version, followed by one
+// record per command: a u8 op and its fields in host byte order. Text is
+// written as a text definition record ahead of the first command that
+// draws it.
+
+#define CAPTURE_VERSION 1
+
+typedef enum capture_op {
+    CAPTURE_OP_FRAME,        // A frame begins on a w x h framebuffer.
+    CAPTURE_OP_END_FRAME,
+    CAPTURE_OP_RECT,         // r filled with c.
+    CAPTURE_OP_TEXT,         // t drawn in the bbox r, clipped to clip.
+    CAPTURE_OP_BEGIN_SCROLL, // region, offset and the background c.
+    CAPTURE_OP_END_SCROLL,
+    CAPTURE_OP_BEGIN_LAYER,
+    CAPTURE_OP_END_LAYER,
+    CAPTURE_OP_COUNT
+} capture_op;
+
+typedef struct capture_cmd {
+    capture_op op;
+    uint32_t w;
+    uint32_t h;
+    float scale;
+    rect r;
+    rect clip;
+    recti region;
+    vec2i offset;
+    color c;
+    text *t; // Owned by the reader.
+} capture_cmd;
+
+// Starts writing the commands to path. Returns false if the file couldn't
+// be created.
+bool capture_start(const char *path);
+void capture_stop(void);
+bool capture_active(void);
+
+// Writes one command. A failed write stops the capture.
+void capture_write(const capture_cmd *cmd);
+
+typedef struct capture_reader capture_reader;
+
+// Returns NULL if the file can't be opened or isn't a capture of this
+// version.
+capture_reader* capture_open(const char *path);
+
+// Frees the reader and drops its references to the texts it created.
+void capture_close(capture_reader *r);
+
+// Reads the next command. Returns false at the end of the capture or if it
+// is malformed, capture_failed tells the two apart.
+bool capture_read(capture_reader *r, capture_cmd *dst);
+bool capture_failed(const capture_reader *r);
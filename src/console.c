@@ -10,6 +10,8 @@
 #include "eva/eva.h"
 
 #include "color.h"
+#include "font.h"
+#include "glyph_atlas.h"
 #include "profiler.h"
 #include "rect.h"
 #include "render.h"
@@ -19,18 +21,34 @@
 
 #define MAX_LOG_ENTRIES 1024
 
+// The stats overlay is refreshed at most this often. Drawing it damages
+// the frame, which would otherwise keep requesting frames of its own in
+// pipelined mode.
+#define STATS_LINES 9
+#define STATS_LINE_LEN 64
+#define STATS_INTERVAL_MS 250.0
+
 typedef struct log_entries {
     text *entries[MAX_LOG_ENTRIES];
     int32_t start;
     int32_t count;
 } log_entries;
 
+typedef struct stats_overlay {
+    bool visible;
+    uint64_t updated; // eva_time_now of the last refresh.
+    char lines[STATS_LINES][STATS_LINE_LEN];
+    text *texts[STATS_LINES];
+} stats_overlay;
+
 typedef struct console_ctx {
     bool visible;
     recti rect;
 
     log_entries logs;
     double font_size;
+
+    stats_overlay stats;
 } console_ctx;
 
 typedef struct scrollbar {
@@ -74,6 +92,24 @@ void console_init()
 //    _ctx.logs.count = 30;
 }
 
+// Destroys the logged texts and the stats overlay, which hold font faces
+// once drawn, so it comes before text_system_shutdown.
+void console_shutdown()
+{
+    for (int32_t i = 0; i < _ctx.logs.count; i++) {
+        text_destroy(_ctx.logs.entries[i]);
+    }
+    _ctx.logs.start = 0;
+    _ctx.logs.count = 0;
+
+    for (uint32_t i = 0; i < STATS_LINES; i++) {
+        if (_ctx.stats.texts[i]) {
+            text_destroy(_ctx.stats.texts[i]);
+            _ctx.stats.texts[i] = NULL;
+        }
+    }
+}
+
 static void write_entry(text *t)
 {
     if (_ctx.logs.count == MAX_LOG_ENTRIES) {
@@ -208,11 +244,125 @@ void console_keydown(int32_t key, uint32_t mods)
     eva_key k = (eva_key)key;
     eva_mod_flags f = (eva_mod_flags)mods;
 
-    // Ctrl+` opens/closes the console
+    // Ctrl+` opens/closes the console, Ctrl+Shift+` the renderer stats.
     if (k == EVA_KEY_GRAVE_ACCENT && f == EVA_MOD_CONTROL) {
         _ctx.visible = !_ctx.visible;
         eva_request_frame();
     }
+    else if (k == EVA_KEY_GRAVE_ACCENT &&
+             f == (EVA_MOD_CONTROL | EVA_MOD_SHIFT)) {
+        _ctx.stats.visible = !_ctx.stats.visible;
+        _ctx.stats.updated = 0;
+        eva_request_frame();
+    }
+}
+
+static void update_stats(void)
+{
+    stats_overlay *o = &_ctx.stats;
+    if (o->updated != 0 && eva_time_since_ms(o->updated) < STATS_INTERVAL_MS) {
+        return;
+    }
+    o->updated = eva_time_now();
+
+    render_frame_stats s;
+    render_frame_stats_get(&s);
+    font_cache_stats fonts;
+    font_cache_stats_get(&fonts);
+    glyph_atlas_stats atlas;
+    glyph_atlas_stats_get(&atlas);
+
+    char lines[STATS_LINES][STATS_LINE_LEN];
+    snprintf(lines[0], STATS_LINE_LEN, "frame %llu  %.2f ms",
+             (unsigned long long)s.frame, s.total_ms);
+    snprintf(lines[1], STATS_LINE_LEN, "cmds %u  text %u  culled %u",
+             s.num_cmds, s.text_cmds, s.culled_cmds);
+    snprintf(lines[2], STATS_LINE_LEN, "tiles %u of %upx  hashed %u",
+             s.num_tiles, s.tile_size, s.hashed_tiles);
+    snprintf(lines[3], STATS_LINE_LEN, "drawn %u  damaged %u  %llu px",
+             s.drawn_tiles, s.damaged_tiles,
+             (unsigned long long)s.raster_pixels);
+    snprintf(lines[4], STATS_LINE_LEN,
+             "shaped %llu  edited %llu  reused %llu  flushes %u",
+             (unsigned long long)s.shape_misses,
+             (unsigned long long)s.shape_edits,
+             (unsigned long long)s.shape_hits, s.sync_flushes);
+    snprintf(lines[5], STATS_LINE_LEN, "wait %.2f  hash %.2f  damage %.2f",
+             s.wait_ms, s.hash_ms, s.damage_ms);
+    snprintf(lines[6], STATS_LINE_LEN, "prep %.2f  raster %.2f  comp %.2f",
+             s.prepare_ms, s.raster_ms, s.composite_ms);
+    snprintf(lines[7], STATS_LINE_LEN,
+             "fonts %u of %u  hits %llu  misses %llu  evicted %llu",
+             fonts.count, fonts.capacity, (unsigned long long)fonts.hits,
+             (unsigned long long)fonts.misses,
+             (unsigned long long)fonts.evictions);
+
+    // Pages past the budget show as more pages than the max.
+    snprintf(lines[8], STATS_LINE_LEN,
+             "atlas %u glyphs  %u of %u pages  %.0f%% used  evicted %llu",
+             atlas.glyphs, atlas.pages, atlas.max_pages,
+             atlas.occupancy * 100.0, (unsigned long long)atlas.evictions);
+
+    // Lines that didn't change keep their shaped text.
+    for (uint32_t i = 0; i < STATS_LINES; i++) {
+        if (o->texts[i] && strcmp(lines[i], o->lines[i]) == 0) {
+            continue;
+        }
+        text *t = text_create_cstr(lines[i]);
+        if (!t) {
+            continue;
+        }
+        text_add_attr(t, 0, 0, FONT_FAMILY_COURIER_NEW, _ctx.font_size,
+                      &COLOR_WHITE);
+        if (o->texts[i]) {
+            text_destroy(o->texts[i]);
+        }
+        o->texts[i] = t;
+        memcpy(o->lines[i], lines[i], STATS_LINE_LEN);
+    }
+}
+
+// Shows what the renderer did on a recent frame in the top right corner,
+// below the console when it is open. It's drawn on a layer of its own so
+// refreshing it only redraws the overlay.
+static void draw_stats(const eva_framebuffer *fb)
+{
+    update_stats();
+
+    double padding = 6.0;
+    double width = 0.0;
+    double height = 0.0;
+    for (uint32_t i = 0; i < STATS_LINES; i++) {
+        if (_ctx.stats.texts[i]) {
+            vec2 extents;
+            text_extents(_ctx.stats.texts[i], &extents);
+            width = max(width, extents.x);
+            height += extents.y;
+        }
+    }
+
+    rect box = {
+        .x = fb->w - width - padding * 2.0,
+        .y = _ctx.visible ? floor(fb->h / 2.0) : 0.0,
+        .w = width + padding * 2.0,
+        .h = height + padding * 2.0,
+    };
+
+    render_begin_layer();
+    render_draw_rect(&box, &COLOR_GREY);
+
+    rect bbox = { box.x + padding, box.y + padding, 0, 0 };
+    for (uint32_t i = 0; i < STATS_LINES; i++) {
+        if (_ctx.stats.texts[i]) {
+            vec2 extents;
+            text_extents(_ctx.stats.texts[i], &extents);
+            bbox.w = extents.x;
+            bbox.h = extents.y;
+            render_draw_text(_ctx.stats.texts[i], &bbox, &box);
+            bbox.y += extents.y;
+        }
+    }
+    render_end_layer();
 }
 
 void console_draw(const eva_framebuffer *fb)
@@ -220,6 +370,10 @@ void console_draw(const eva_framebuffer *fb)
     if (_ctx.visible) {
         profiler_begin;
 
+        // The console is drawn on a layer of its own so logging doesn't
+        // redraw what lies beneath it.
+        render_begin_layer();
+
         rect r = {
             .x = 0,
             .y = 0,
@@ -256,9 +410,13 @@ void console_draw(const eva_framebuffer *fb)
         sb.track_scroll_area_size = sb.track_size - sb.grip_size;
         sb.grip_pos_on_track = sb.track_scroll_area_size * sb.window_pos_ratio;
 
+        // The log scrolls by whole pixels so the renderer can move the lines
+        // already drawn instead of drawing them again.
+        int32_t scroll_y = (int32_t)floor(sb.window_pos + 0.5);
+
         rect window_rect = {
             .x = r.x,
-            .y = sb.window_pos,
+            .y = scroll_y,
             .w = r.w,
             .h = r.h,
         };
@@ -283,6 +441,16 @@ void console_draw(const eva_framebuffer *fb)
         render_draw_rect(&track_rect, &COLOR_WHITE);
         render_draw_rect(&grip_rect, &COLOR_LIGHT_GREY);
 
+        recti log_region = {
+            .x = 0,
+            .y = 0,
+            .w = (int32_t)floor(grip_rect.x),
+            .h = (int32_t)floor(r.h),
+        };
+        vec2i log_offset = { 0, scroll_y };
+        rect log_clip = { 0, 0, log_region.w, log_region.h };
+        render_begin_scroll(&log_region, &log_offset, &COLOR_BLACK);
+
         rect text_box = { padding, padding, 0, 0 };
         double cursor_y = padding;
         for (int32_t i = start; i < end; i++) {
@@ -296,17 +464,22 @@ void console_draw(const eva_framebuffer *fb)
 
             if (rect_overlap(&text_box, &window_rect)) {
                 rect bbox = text_box;
-                bbox.y -= sb.window_pos;
-
-                rect clip = r;
+                bbox.y -= scroll_y;
 
-                render_draw_text(entry, &bbox, &clip); 
+                render_draw_text(entry, &bbox, &log_clip);
                 cursor_y += extents.y;
             }
 
             text_box.y += extents.y;
         }
 
+        render_end_scroll();
+        render_end_layer();
+
         profiler_end;
     }
+
+    if (_ctx.stats.visible) {
+        draw_stats(fb);
+    }
 }
@@ -6,6 +6,7 @@ typedef struct eva_framebuffer eva_framebuffer;
 typedef struct vec2 vec2;
 
 void console_init();
+void console_shutdown();
 void console_logn(char *text, size_t len);
 void console_log(const char *fmt, ...);
 void console_mouse_moved(const vec2 *mouse_pos);
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "common.h"
+
+// Checks for the instruction sets the SIMD kernels need, so they can be
+// picked at runtime. Always false on CPUs other than x86.
+bool cpu_has_sse2(void);
+bool cpu_has_avx2(void);
@@ -0,0 +1,109 @@
+#include "damage.h"
+
+#include <assert.h>
+
+static int64_t area(const recti *r);
+static int64_t merge_cost(const recti *a, const recti *b);
+static bool merge_cheapest(damage_list *d, int64_t max_cost);
+
+void damage_clear(damage_list *d)
+{
+    assert(d);
+    d->count = 0;
+}
+
+void damage_add(damage_list *d, const recti *r)
+{
+    assert(d);
+    assert(r);
+
+    if (r->w <= 0 || r->h <= 0) {
+        return;
+    }
+
+    // Grow a rect downwards when the span lines up with its bottom edge.
+    for (uint32_t i = 0; i < d->count; i++) {
+        recti *e = &d->rects[i];
+        if (e->x == r->x && e->w == r->w && e->y + e->h == r->y) {
+            e->h += r->h;
+            return;
+        }
+    }
+
+    if (d->count == DAMAGE_MAX_SPANS) {
+        merge_cheapest(d, INT64_MAX);
+    }
+    d->rects[d->count++] = *r;
+}
+
+void damage_finish(damage_list *d)
+{
+    assert(d);
+
+    while (d->count > DAMAGE_MAX_RECTS) {
+        merge_cheapest(d, INT64_MAX);
+    }
+
+    // Fewer rects are cheaper as long as the union doesn't repaint much.
+    while (d->count > 1 && merge_cheapest(d, DAMAGE_RECT_COST)) {
+    }
+}
+
+int64_t damage_area(const damage_list *d)
+{
+    assert(d);
+
+    int64_t result = 0;
+    for (uint32_t i = 0; i < d->count; i++) {
+        result += area(&d->rects[i]);
+    }
+    return result;
+}
+
+static int64_t area(const recti *r)
+{
+    return (int64_t)r->w * (int64_t)r->h;
+}
+
+// Pixels the union of a and b repaints that neither rect covers. Rects in
+// the list don't overlap when they are built from tile spans but merged
+// rects can, in which case this underestimates slightly.
+static int64_t merge_cost(const recti *a, const recti *b)
+{
+    recti u;
+    recti_union(a, b, &u);
+
+    int64_t cost = area(&u) - area(a) - area(b);
+    recti overlap;
+    if (recti_intersection(a, b, &overlap)) {
+        cost += area(&overlap);
+    }
+    return cost;
+}
+
+// Replaces the pair of rects with the lowest merge cost by their union.
+// Returns false if no pair costs max_cost or less.
+static bool merge_cheapest(damage_list *d, int64_t max_cost)
+{
+    uint32_t best_a = 0;
+    uint32_t best_b = 0;
+    int64_t best_cost = INT64_MAX;
+    for (uint32_t a = 0; a < d->count; a++) {
+        for (uint32_t b = a + 1; b < d->count; b++) {
+            int64_t cost = merge_cost(&d->rects[a], &d->rects[b]);
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_a = a;
+                best_b = b;
+            }
+        }
+    }
+
+    if (best_cost == INT64_MAX || best_cost > max_cost) {
+        return false;
+    }
+
+    recti_union(&d->rects[best_a], &d->rects[best_b], &d->rects[best_a]);
+    d->rects[best_b] = d->rects[--d->count];
+    return true;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "common.h"
+#include "rect.h"
+
+// The damaged regions of a frame as a short list of rectangles. Rects are
+// added as horizontal spans of dirty tiles, top to bottom, and spans that
+// line up with the rect above are merged into it.
+
+// Max rects left after damage_finish.
+#define DAMAGE_MAX_RECTS 8
+
+// Max rects held while spans are added.
+#define DAMAGE_MAX_SPANS 64
+
+// Estimated cost in pixels of replaying the command list for one more
+// rect. Rects are merged when the union repaints fewer extra pixels.
+#define DAMAGE_RECT_COST (64 * 64)
+
+typedef struct damage_list {
+    recti rects[DAMAGE_MAX_SPANS];
+    uint32_t count;
+} damage_list;
+
+void damage_clear(damage_list *d);
+void damage_add(damage_list *d, const recti *r);
+
+// Merges the rects down to at most DAMAGE_MAX_RECTS, picking the pairs
+// that repaint the fewest extra pixels first.
+void damage_finish(damage_list *d);
+
+// Returns the total area of the rects in pixels.
+int64_t damage_area(const damage_list *d);
@@ -0,0 +1,432 @@
+// Headless eva backend.
+//
+// Implements the eva platform API on top of a plain PRGB32 framebuffer held
+// in memory. Instead of pumping OS events the backend reads a script of
+// input events and feeds them to the registered callbacks, issuing a frame
+// whenever one has been requested. This makes it possible to run and
+// measure the app and renderer on machines without a display.
+//
+// Configuration is done through environment variables:
+//
+//   EVA_HEADLESS_SIZE    Framebuffer size as WxH (default 1280x800).
+//   EVA_HEADLESS_SCALE   Framebuffer scale (default 1).
+//   EVA_HEADLESS_SCRIPT  Path of the event script. When not set a single
+//                        frame is rendered and the backend quits.
+//   EVA_HEADLESS_DUMP    Directory that every rendered frame is written to
+//                        as frame_NNNNN.ppm.
+//
+// The script is line based. Blank lines and lines starting with '#' are
+// ignored. Supported commands:
+//
+//   frame [count]              Force count frames (default 1).
+//   resize <w> <h>             Resize the framebuffer.
+//   key <key> [mods]           Press and release a key (eva_key values).
+//   text <utf8>                Text input for the rest of the line.
+//   move <x> <y>               Mouse move.
+//   press <x> <y> [btn]        Mouse button press (default left).
+//   release <x> <y> [btn]      Mouse button release (default left).
+//   scroll <dx> <dy>           Scroll.
+//   dump <path>                Write the framebuffer to path.
+//   quit                       Stop processing the script.
+
+#include "eva/eva.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include <unicode/ustring.h>
+
+#include "common.h"
+#include "eva_headless.h"
+
+#define HEADLESS_DEFAULT_WIDTH 1280
+#define HEADLESS_DEFAULT_HEIGHT 800
+#define HEADLESS_MAX_LINE 4096
+
+typedef struct headless_ctx {
+    eva_framebuffer fb;
+
+    bool frame_requested;
+    bool quit;
+    uint64_t frame_count;
+    const char *dump_dir;
+
+    eva_frame_fn frame_fn;
+    eva_fail_fn fail_fn;
+    eva_init_fn init_fn;
+    eva_cleanup_fn cleanup_fn;
+    eva_cancel_quit_fn cancel_quit_fn;
+    eva_window_resize_fn window_resize_fn;
+    eva_mouse_moved_fn mouse_moved_fn;
+    eva_mouse_btn_fn mouse_btn_fn;
+    eva_scroll_fn scroll_fn;
+    eva_key_fn key_fn;
+    eva_text_input_fn text_input_fn;
+} headless_ctx;
+
+static headless_ctx _ctx;
+
+static void fail(int error_code, const char *error_message)
+{
+    if (_ctx.fail_fn) {
+        _ctx.fail_fn(error_code, error_message);
+    }
+    else {
+        fprintf(stderr, "eva_headless error %d: %s\n",
+                error_code, error_message);
+    }
+}
+
+static bool resize_framebuffer(uint32_t w, uint32_t h, float scale)
+{
+    assert(w > 0);
+    assert(h > 0);
+
+    eva_pixel *pixels = calloc((size_t)w * h, sizeof(eva_pixel));
+    if (!pixels) {
+        return false;
+    }
+
+    free(_ctx.fb.pixels);
+    _ctx.fb.pixels = pixels;
+    _ctx.fb.w = w;
+    _ctx.fb.h = h;
+    _ctx.fb.pitch = w;
+    _ctx.fb.scale_x = scale;
+    _ctx.fb.scale_y = scale;
+
+    return true;
+}
+
+void eva_headless_set_size(uint32_t w, uint32_t h, float scale)
+{
+    if (!resize_framebuffer(w, h, scale)) {
+        fail(1, "Failed to allocate headless framebuffer");
+    }
+}
+
+bool eva_headless_dump(const char *path)
+{
+    assert(path);
+
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        return false;
+    }
+
+    fprintf(f, "P6\n%u %u\n255\n", _ctx.fb.w, _ctx.fb.h);
+
+    uint8_t *row = malloc((size_t)_ctx.fb.w * 3);
+    if (!row) {
+        fclose(f);
+        return false;
+    }
+
+    bool ok = true;
+    for (uint32_t y = 0; y < _ctx.fb.h && ok; y++) {
+        const eva_pixel *src = _ctx.fb.pixels + (size_t)y * _ctx.fb.pitch;
+        for (uint32_t x = 0; x < _ctx.fb.w; x++) {
+            row[x * 3 + 0] = src[x].r;
+            row[x * 3 + 1] = src[x].g;
+            row[x * 3 + 2] = src[x].b;
+        }
+        ok = fwrite(row, 3, _ctx.fb.w, f) == _ctx.fb.w;
+    }
+
+    free(row);
+    fclose(f);
+    return ok;
+}
+
+uint64_t eva_headless_frame_count(void)
+{
+    return _ctx.frame_count;
+}
+
+static void run_frame(void)
+{
+    _ctx.frame_requested = false;
+    _ctx.frame_fn(&_ctx.fb);
+
+    if (_ctx.dump_dir) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/frame_%05llu.ppm",
+                 _ctx.dump_dir, (unsigned long long)_ctx.frame_count);
+        if (!eva_headless_dump(path)) {
+            fail(2, "Failed to dump headless frame");
+        }
+    }
+
+    _ctx.frame_count++;
+}
+
+static void handle_text(const char *utf8)
+{
+    int32_t len = 0;
+    UErrorCode status = U_ZERO_ERROR;
+    u_strFromUTF8(NULL, 0, &len, utf8, -1, &status);
+    if (len == 0 || (status != U_BUFFER_OVERFLOW_ERROR && U_FAILURE(status))) {
+        return;
+    }
+
+    uint16_t *utf16 = malloc((size_t)len * sizeof(uint16_t));
+    if (!utf16) {
+        return;
+    }
+
+    status = U_ZERO_ERROR;
+    u_strFromUTF8(utf16, len, NULL, utf8, -1, &status);
+    if (U_SUCCESS(status) && _ctx.text_input_fn) {
+        _ctx.text_input_fn(utf16, (uint32_t)len, (eva_mod_flags)0);
+    }
+
+    free(utf16);
+}
+
+static void handle_command(char *line)
+{
+    // Strip the trailing newline.
+    size_t len = strlen(line);
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+        line[--len] = '\0';
+    }
+
+    char cmd[32] = {0};
+    int consumed = 0;
+    if (sscanf(line, " %31s %n", cmd, &consumed) != 1 || cmd[0] == '#') {
+        return;
+    }
+    const char *args = line + consumed;
+
+    if (strcmp(cmd, "frame") == 0) {
+        int count = 1;
+        sscanf(args, "%d", &count);
+        for (int i = 0; i < count; i++) {
+            run_frame();
+        }
+    }
+    else if (strcmp(cmd, "resize") == 0) {
+        unsigned w = 0, h = 0;
+        if (sscanf(args, "%u %u", &w, &h) == 2 && w > 0 && h > 0) {
+            eva_headless_set_size(w, h, _ctx.fb.scale_x);
+            if (_ctx.window_resize_fn) {
+                _ctx.window_resize_fn(w, h);
+            }
+            _ctx.frame_requested = true;
+        }
+    }
+    else if (strcmp(cmd, "key") == 0) {
+        int key = 0;
+        unsigned mods = 0;
+        if (sscanf(args, "%d %u", &key, &mods) >= 1 && _ctx.key_fn) {
+            _ctx.key_fn((eva_key)key, EVA_INPUT_PRESSED, (eva_mod_flags)mods);
+            _ctx.key_fn((eva_key)key, EVA_INPUT_RELEASED, (eva_mod_flags)mods);
+        }
+    }
+    else if (strcmp(cmd, "text") == 0) {
+        handle_text(args);
+    }
+    else if (strcmp(cmd, "move") == 0) {
+        double x = 0, y = 0;
+        if (sscanf(args, "%lf %lf", &x, &y) == 2 && _ctx.mouse_moved_fn) {
+            _ctx.mouse_moved_fn(x, y);
+        }
+    }
+    else if (strcmp(cmd, "press") == 0 || strcmp(cmd, "release") == 0) {
+        double x = 0, y = 0;
+        int btn = EVA_MOUSE_BTN_LEFT;
+        eva_input_action action = cmd[0] == 'p' ? EVA_INPUT_PRESSED
+                                                : EVA_INPUT_RELEASED;
+        if (sscanf(args, "%lf %lf %d", &x, &y, &btn) >= 2 &&
+            _ctx.mouse_btn_fn) {
+            _ctx.mouse_btn_fn(x, y, (eva_mouse_btn)btn, action);
+        }
+    }
+    else if (strcmp(cmd, "scroll") == 0) {
+        double dx = 0, dy = 0;
+        if (sscanf(args, "%lf %lf", &dx, &dy) == 2 && _ctx.scroll_fn) {
+            _ctx.scroll_fn(dx, dy);
+        }
+    }
+    else if (strcmp(cmd, "dump") == 0) {
+        if (!eva_headless_dump(args)) {
+            fail(2, "Failed to dump headless frame");
+        }
+    }
+    else if (strcmp(cmd, "quit") == 0) {
+        _ctx.quit = !_ctx.cancel_quit_fn || !_ctx.cancel_quit_fn();
+    }
+    else {
+        fprintf(stderr, "eva_headless: unknown command '%s'\n", cmd);
+    }
+}
+
+void eva_run(const char *window_title,
+             eva_frame_fn frame_fn,
+             eva_fail_fn fail_fn)
+{
+    (void)window_title;
+    assert(frame_fn);
+
+    _ctx.frame_fn = frame_fn;
+    _ctx.fail_fn = fail_fn;
+    _ctx.dump_dir = getenv("EVA_HEADLESS_DUMP");
+
+    if (!_ctx.fb.pixels) {
+        unsigned w = HEADLESS_DEFAULT_WIDTH;
+        unsigned h = HEADLESS_DEFAULT_HEIGHT;
+        float scale = 1.0f;
+
+        const char *size = getenv("EVA_HEADLESS_SIZE");
+        if (size && (sscanf(size, "%ux%u", &w, &h) != 2 || w == 0 || h == 0)) {
+            fail(4, "EVA_HEADLESS_SIZE must be WIDTHxHEIGHT, both above 0");
+            return;
+        }
+        const char *scale_str = getenv("EVA_HEADLESS_SCALE");
+        if (scale_str) {
+            scale = strtof(scale_str, NULL);
+        }
+
+        if (!resize_framebuffer(w, h, scale > 0.0f ? scale : 1.0f)) {
+            fail(1, "Failed to allocate headless framebuffer");
+            return;
+        }
+    }
+
+    if (_ctx.init_fn) {
+        _ctx.init_fn();
+    }
+
+    const char *script_path = getenv("EVA_HEADLESS_SCRIPT");
+    if (script_path) {
+        FILE *script = fopen(script_path, "r");
+        if (!script) {
+            fail(3, "Failed to open headless script");
+        }
+        else {
+            char line[HEADLESS_MAX_LINE];
+            while (!_ctx.quit && fgets(line, sizeof(line), script)) {
+                handle_command(line);
+
+                // A real backend would service requests on the next vsync.
+                if (_ctx.frame_requested) {
+                    run_frame();
+                }
+            }
+            fclose(script);
+        }
+    }
+    else {
+        run_frame();
+    }
+
+    if (_ctx.cleanup_fn) {
+        _ctx.cleanup_fn();
+    }
+
+    free(_ctx.fb.pixels);
+    _ctx.fb.pixels = NULL;
+}
+
+void eva_request_frame(void)
+{
+    _ctx.frame_requested = true;
+}
+
+uint32_t eva_get_window_width(void)
+{
+    return (uint32_t)((double)_ctx.fb.w / _ctx.fb.scale_x);
+}
+
+uint32_t eva_get_window_height(void)
+{
+    return (uint32_t)((double)_ctx.fb.h / _ctx.fb.scale_y);
+}
+
+eva_framebuffer eva_get_framebuffer(void)
+{
+    return _ctx.fb;
+}
+
+void eva_set_init_fn(eva_init_fn init_fn)
+{
+    _ctx.init_fn = init_fn;
+}
+
+void eva_set_cleanup_fn(eva_cleanup_fn cleanup_fn)
+{
+    _ctx.cleanup_fn = cleanup_fn;
+}
+
+void eva_set_cancel_quit_fn(eva_cancel_quit_fn cancel_quit_fn)
+{
+    _ctx.cancel_quit_fn = cancel_quit_fn;
+}
+
+void eva_set_window_resize_fn(eva_window_resize_fn window_resize_fn)
+{
+    _ctx.window_resize_fn = window_resize_fn;
+}
+
+void eva_set_mouse_moved_fn(eva_mouse_moved_fn mouse_moved_fn)
+{
+    _ctx.mouse_moved_fn = mouse_moved_fn;
+}
+
+void eva_set_mouse_btn_fn(eva_mouse_btn_fn mouse_btn_fn)
+{
+    _ctx.mouse_btn_fn = mouse_btn_fn;
+}
+
+void eva_set_scroll_fn(eva_scroll_fn scroll_fn)
+{
+    _ctx.scroll_fn = scroll_fn;
+}
+
+void eva_set_key_fn(eva_key_fn key_fn)
+{
+    _ctx.key_fn = key_fn;
+}
+
+void eva_set_text_input_fn(eva_text_input_fn text_input_fn)
+{
+    _ctx.text_input_fn = text_input_fn;
+}
+
+uint64_t eva_time_now(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)counter.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+double eva_time_elapsed_ms(uint64_t start, uint64_t end)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    return (double)(end - start) * 1000.0 / (double)freq.QuadPart;
+#else
+    return (double)(end - start) / 1000000.0;
+#endif
+}
+
+double eva_time_since_ms(uint64_t start)
+{
+    return eva_time_elapsed_ms(start, eva_time_now());
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "common.h"
+
+// Extensions provided by the headless eva backend (eva_headless.c). The
+// regular eva.h API is implemented on top of an in-memory framebuffer so
+// the app and renderer can run without a window, e.g. in CI or from tools.
+
+// Resizes the in-memory framebuffer. Safe to call before eva_run.
+void eva_headless_set_size(uint32_t w, uint32_t h, float scale);
+
+// Writes the current framebuffer contents to a binary PPM file.
+// Returns false if the file could not be written.
+bool eva_headless_dump(const char *path);
+
+// Returns the number of frame callbacks issued so far.
+uint64_t eva_headless_frame_count(void);
@@ -0,0 +1,322 @@
+#include "fill.h"
+
+#include <assert.h>
+
+#include "cpu.h"
+#include "rect.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define FILL_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#define FILL_TARGET_SSE2
+#define FILL_TARGET_AVX2
+#else
+#define FILL_TARGET_SSE2 __attribute__((target("sse2")))
+#define FILL_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+typedef void (*fill_row_fn)(uint32_t *dst, uint32_t count, uint32_t color);
+typedef void (*fill_over_fn)(uint32_t *dst, const uint32_t *src,
+                             uint32_t count);
+
+typedef struct fill_ctx {
+    fill_kernel kernel;
+    fill_row_fn store;
+    fill_row_fn blend;
+    fill_over_fn over;
+    bool supported[FILL_KERNEL_COUNT];
+} fill_ctx;
+
+static fill_ctx _ctx;
+
+// dst * inv / 255 + src on every channel at once, rounded like blend2d.
+static uint32_t blend_pixel(uint32_t dst, uint32_t src, uint32_t inv)
+{
+    uint32_t rb = (dst & 0x00ff00ff) * inv + 0x00800080;
+    rb = ((rb + ((rb >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+    uint32_t ag = ((dst >> 8) & 0x00ff00ff) * inv + 0x00800080;
+    ag = (ag + ((ag >> 8) & 0x00ff00ff)) & 0xff00ff00;
+    return src + (rb | ag);
+}
+
+static void store_row_scalar(uint32_t *dst, uint32_t count, uint32_t color)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        dst[i] = color;
+    }
+}
+
+static void blend_row_scalar(uint32_t *dst, uint32_t count, uint32_t color)
+{
+    uint32_t inv = 255 - (color >> 24);
+    for (uint32_t i = 0; i < count; i++) {
+        dst[i] = blend_pixel(dst[i], color, inv);
+    }
+}
+
+static void over_row_scalar(uint32_t *dst, const uint32_t *src,
+                            uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t alpha = src[i] >> 24;
+        if (alpha == 0xff) {
+            dst[i] = src[i];
+        }
+        else if (alpha != 0) {
+            dst[i] = blend_pixel(dst[i], src[i], 255 - alpha);
+        }
+    }
+}
+
+#ifdef FILL_X86
+
+FILL_TARGET_SSE2
+static void store_row_sse2(uint32_t *dst, uint32_t count, uint32_t color)
+{
+    __m128i src = _mm_set1_epi32((int32_t)color);
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_si128((__m128i*)(dst + i), src);
+    }
+    store_row_scalar(dst + i, count - i, color);
+}
+
+// Blends 8 16-bit channels with the same rounding as blend_pixel.
+FILL_TARGET_SSE2
+static __m128i blend_epi16_sse2(__m128i d, __m128i inv)
+{
+    __m128i bias = _mm_set1_epi16(0x80);
+    d = _mm_add_epi16(_mm_mullo_epi16(d, inv), bias);
+    return _mm_srli_epi16(_mm_add_epi16(d, _mm_srli_epi16(d, 8)), 8);
+}
+
+FILL_TARGET_SSE2
+static void blend_row_sse2(uint32_t *dst, uint32_t count, uint32_t color)
+{
+    __m128i src = _mm_set1_epi32((int32_t)color);
+    __m128i inv = _mm_set1_epi16((int16_t)(255 - (color >> 24)));
+    __m128i zero = _mm_setzero_si128();
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i lo = blend_epi16_sse2(_mm_unpacklo_epi8(d, zero), inv);
+        __m128i hi = blend_epi16_sse2(_mm_unpackhi_epi8(d, zero), inv);
+        d = _mm_add_epi8(_mm_packus_epi16(lo, hi), src);
+        _mm_storeu_si128((__m128i*)(dst + i), d);
+    }
+    blend_row_scalar(dst + i, count - i, color);
+}
+
+// Layers are mostly fully transparent or fully opaque, so whole groups of
+// those are skipped or copied without blending.
+FILL_TARGET_SSE2
+static void over_row_sse2(uint32_t *dst, const uint32_t *src, uint32_t count)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i max = _mm_set1_epi16(0xff);
+    __m128i alpha_mask = _mm_set1_epi32((int32_t)0xff000000);
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i alpha = _mm_and_si128(s, alpha_mask);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(alpha, zero)) == 0xffff) {
+            continue;
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(alpha, alpha_mask)) == 0xffff) {
+            _mm_storeu_si128((__m128i*)(dst + i), s);
+            continue;
+        }
+
+        // Broadcast the alpha of every pixel to its channels.
+        __m128i s_lo = _mm_unpacklo_epi8(s, zero);
+        __m128i s_hi = _mm_unpackhi_epi8(s, zero);
+        __m128i inv_lo = _mm_sub_epi16(max,
+            _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_lo, 0xff), 0xff));
+        __m128i inv_hi = _mm_sub_epi16(max,
+            _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_hi, 0xff), 0xff));
+
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i lo = blend_epi16_sse2(_mm_unpacklo_epi8(d, zero), inv_lo);
+        __m128i hi = blend_epi16_sse2(_mm_unpackhi_epi8(d, zero), inv_hi);
+        d = _mm_add_epi8(_mm_packus_epi16(lo, hi), s);
+        _mm_storeu_si128((__m128i*)(dst + i), d);
+    }
+    over_row_scalar(dst + i, src + i, count - i);
+}
+
+FILL_TARGET_AVX2
+static void store_row_avx2(uint32_t *dst, uint32_t count, uint32_t color)
+{
+    __m256i src = _mm256_set1_epi32((int32_t)color);
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_si256((__m256i*)(dst + i), src);
+    }
+    store_row_scalar(dst + i, count - i, color);
+}
+
+FILL_TARGET_AVX2
+static __m256i blend_epi16_avx2(__m256i d, __m256i inv)
+{
+    __m256i bias = _mm256_set1_epi16(0x80);
+    d = _mm256_add_epi16(_mm256_mullo_epi16(d, inv), bias);
+    return _mm256_srli_epi16(_mm256_add_epi16(d, _mm256_srli_epi16(d, 8)), 8);
+}
+
+// Unpacking and packing both work within 128-bit lanes so the pixels come
+// back out in order.
+FILL_TARGET_AVX2
+static void blend_row_avx2(uint32_t *dst, uint32_t count, uint32_t color)
+{
+    __m256i src = _mm256_set1_epi32((int32_t)color);
+    __m256i inv = _mm256_set1_epi16((int16_t)(255 - (color >> 24)));
+    __m256i zero = _mm256_setzero_si256();
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+        __m256i lo = blend_epi16_avx2(_mm256_unpacklo_epi8(d, zero), inv);
+        __m256i hi = blend_epi16_avx2(_mm256_unpackhi_epi8(d, zero), inv);
+        d = _mm256_add_epi8(_mm256_packus_epi16(lo, hi), src);
+        _mm256_storeu_si256((__m256i*)(dst + i), d);
+    }
+    blend_row_sse2(dst + i, count - i, color);
+}
+
+FILL_TARGET_AVX2
+static void over_row_avx2(uint32_t *dst, const uint32_t *src, uint32_t count)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i max = _mm256_set1_epi16(0xff);
+    __m256i alpha_mask = _mm256_set1_epi32((int32_t)0xff000000);
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i alpha = _mm256_and_si256(s, alpha_mask);
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(alpha, zero)) == -1) {
+            continue;
+        }
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(alpha, alpha_mask)) == -1) {
+            _mm256_storeu_si256((__m256i*)(dst + i), s);
+            continue;
+        }
+
+        __m256i s_lo = _mm256_unpacklo_epi8(s, zero);
+        __m256i s_hi = _mm256_unpackhi_epi8(s, zero);
+        __m256i inv_lo = _mm256_sub_epi16(max,
+            _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s_lo, 0xff), 0xff));
+        __m256i inv_hi = _mm256_sub_epi16(max,
+            _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s_hi, 0xff), 0xff));
+
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+        __m256i lo = blend_epi16_avx2(_mm256_unpacklo_epi8(d, zero), inv_lo);
+        __m256i hi = blend_epi16_avx2(_mm256_unpackhi_epi8(d, zero), inv_hi);
+        d = _mm256_add_epi8(_mm256_packus_epi16(lo, hi), s);
+        _mm256_storeu_si256((__m256i*)(dst + i), d);
+    }
+    over_row_sse2(dst + i, src + i, count - i);
+}
+
+#endif
+
+void fill_init(void)
+{
+    _ctx.supported[FILL_KERNEL_SCALAR] = true;
+#ifdef FILL_X86
+    _ctx.supported[FILL_KERNEL_SSE2] = cpu_has_sse2();
+    _ctx.supported[FILL_KERNEL_AVX2] = _ctx.supported[FILL_KERNEL_SSE2] &&
+                                       cpu_has_avx2();
+#endif
+
+    for (int32_t k = FILL_KERNEL_COUNT - 1; k >= 0; k--) {
+        if (fill_set_kernel((fill_kernel)k)) {
+            break;
+        }
+    }
+}
+
+bool fill_set_kernel(fill_kernel kernel)
+{
+    assert(kernel < FILL_KERNEL_COUNT);
+
+    if (!_ctx.supported[kernel]) {
+        return false;
+    }
+
+    switch (kernel) {
+#ifdef FILL_X86
+        case FILL_KERNEL_AVX2:
+            _ctx.store = store_row_avx2;
+            _ctx.blend = blend_row_avx2;
+            _ctx.over = over_row_avx2;
+            break;
+        case FILL_KERNEL_SSE2:
+            _ctx.store = store_row_sse2;
+            _ctx.blend = blend_row_sse2;
+            _ctx.over = over_row_sse2;
+            break;
+#endif
+        default:
+            _ctx.store = store_row_scalar;
+            _ctx.blend = blend_row_scalar;
+            _ctx.over = over_row_scalar;
+            break;
+    }
+    _ctx.kernel = kernel;
+
+    return true;
+}
+
+fill_kernel fill_get_kernel(void)
+{
+    return _ctx.kernel;
+}
+
+const char* fill_kernel_name(fill_kernel kernel)
+{
+    switch (kernel) {
+        case FILL_KERNEL_SCALAR: return "scalar";
+        case FILL_KERNEL_SSE2: return "sse2";
+        case FILL_KERNEL_AVX2: return "avx2";
+        default: return "unknown";
+    }
+}
+
+void fill_rect(uint32_t *pixels, uint32_t pitch, const recti *r,
+               uint32_t color)
+{
+    assert(_ctx.store);
+    assert(r->x >= 0 && r->y >= 0);
+
+    uint32_t alpha = color >> 24;
+    if (alpha == 0 || r->w <= 0 || r->h <= 0) {
+        return;
+    }
+
+    fill_row_fn fill_row = alpha == 0xff ? _ctx.store : _ctx.blend;
+    uint32_t *row = pixels + (uint32_t)r->y * pitch + (uint32_t)r->x;
+    for (int32_t y = 0; y < r->h; y++) {
+        fill_row(row, (uint32_t)r->w, color);
+        row += pitch;
+    }
+}
+
+void fill_composite(uint32_t *dst, uint32_t dst_pitch, const uint32_t *src,
+                    uint32_t src_pitch, const recti *r)
+{
+    assert(_ctx.over);
+    assert(r->x >= 0 && r->y >= 0);
+
+    if (r->w <= 0 || r->h <= 0) {
+        return;
+    }
+
+    uint32_t *dst_row = dst + (uint32_t)r->y * dst_pitch + (uint32_t)r->x;
+    const uint32_t *src_row = src + (uint32_t)r->y * src_pitch + (uint32_t)r->x;
+    for (int32_t y = 0; y < r->h; y++) {
+        _ctx.over(dst_row, src_row, (uint32_t)r->w);
+        dst_row += dst_pitch;
+        src_row += src_pitch;
+    }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "common.h"
+
+typedef struct recti recti;
+
+// Solid fills of pixel aligned rects straight into a PRGB32 surface, which
+// skip blend2d's general rasterizer. Colors are premultiplied 0xAARRGGBB.
+// Opaque colors are stored, anything else is blended with src-over. Also
+// composites one such surface over another.
+
+typedef enum fill_kernel {
+    FILL_KERNEL_SCALAR,
+    FILL_KERNEL_SSE2,
+    FILL_KERNEL_AVX2,
+    FILL_KERNEL_COUNT
+} fill_kernel;
+
+// Picks the fastest kernel the CPU supports. Must be called before the
+// first fill.
+void fill_init(void);
+
+// Returns false if the CPU doesn't support the kernel.
+bool fill_set_kernel(fill_kernel kernel);
+fill_kernel fill_get_kernel(void);
+const char* fill_kernel_name(fill_kernel kernel);
+
+// r must lie within the surface. pitch is in pixels.
+void fill_rect(uint32_t *pixels, uint32_t pitch, const recti *r,
+               uint32_t color);
+
+// Blends the pixels of src over dst with src-over within r, which is in
+// the coordinates of both surfaces.
+void fill_composite(uint32_t *dst, uint32_t dst_pitch, const uint32_t *src,
+                    uint32_t src_pitch, const recti *r);
@@ -0,0 +1,572 @@
+#include "font.h"
+#include "font_native.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef BG_MACOS
+#include <harfbuzz/hb-ft.h>
+#endif
+
+#include "console.h"
+#include "profiler.h"
+
+#define FONT_CACHE_SIZE 32
+
+typedef struct font_face {
+    font_family_id family;
+    double font_size; // Requested size in points.
+    double scale;     // Framebuffer scale the face was created for.
+    double pixel_size;
+    uint32_t id;
+    int32_t ref;
+
+    double ascent;
+    double descent;
+    double leading;
+
+#ifdef BG_MACOS
+    CTFontRef font;
+#else
+    FT_Face face;
+    hb_font_t *hb;
+#endif
+} font_face;
+
+typedef struct font_cache_entry {
+    font_face *face;
+    uint64_t last_used;
+} font_cache_entry;
+
+typedef struct font_ctx {
+    // Small enough that a linear scan beats hashing the key.
+    font_cache_entry entries[FONT_CACHE_SIZE];
+    uint32_t count;
+    uint64_t tick;
+    uint32_t next_id;
+    uint32_t num_faces; // Created and not released yet, cached or not.
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+
+#ifdef BG_MACOS
+    // Scratch coverage buffer for font_face_rasterize.
+    uint8_t *coverage;
+    size_t coverage_size;
+#else
+    FT_Library ft;
+
+    // Font files are read once and every face is created from memory.
+    uint8_t *files[FONT_FAMILY_COUNT];
+    size_t file_sizes[FONT_FAMILY_COUNT];
+#endif
+
+    bool initialized;
+} font_ctx;
+
+static font_ctx _ctx;
+
+static font_face* create_face(font_family_id family,
+                              double font_size, double scale);
+static void destroy_face(font_face *f);
+
+#ifdef BG_MACOS
+static const char * get_font_family(font_family_id f);
+#else
+static const char * get_font_file(font_family_id f);
+static bool read_file(const char *path, uint8_t **data, size_t *size);
+#endif
+
+bool font_system_init(void)
+{
+#ifndef BG_MACOS
+    if (FT_Init_FreeType(&_ctx.ft)) {
+        console_log("Failed to init FreeType");
+        return false;
+    }
+
+    for (int32_t i = 0; i < FONT_FAMILY_COUNT; i++) {
+        const char *file = get_font_file((font_family_id)i);
+        if (!read_file(file, &_ctx.files[i], &_ctx.file_sizes[i])) {
+            console_log("Failed to load font %s", file);
+            return false;
+        }
+    }
+#endif
+
+    _ctx.initialized = true;
+    return true;
+}
+
+void font_system_shutdown(void)
+{
+    for (uint32_t i = 0; i < _ctx.count; i++) {
+        font_face_release(_ctx.entries[i].face);
+    }
+    _ctx.count = 0;
+
+    // Faces are created from the library and the font files, so both have
+    // to outlive them. Every text has to be destroyed first as layouts hold
+    // on to the faces of their runs. Leak the library rather than free it
+    // under faces that are still alive.
+    assert(_ctx.num_faces == 0);
+    if (_ctx.num_faces > 0) {
+        return;
+    }
+
+#ifndef BG_MACOS
+    for (int32_t i = 0; i < FONT_FAMILY_COUNT; i++) {
+        free(_ctx.files[i]);
+        _ctx.files[i] = NULL;
+    }
+    FT_Done_FreeType(_ctx.ft);
+#else
+    free(_ctx.coverage);
+    _ctx.coverage = NULL;
+    _ctx.coverage_size = 0;
+#endif
+
+    _ctx.initialized = false;
+}
+
+font_face* font_get(font_family_id family, double font_size, double scale)
+{
+    assert(_ctx.initialized);
+    assert(family >= 0 && family < FONT_FAMILY_COUNT);
+
+    _ctx.tick++;
+
+    for (uint32_t i = 0; i < _ctx.count; i++) {
+        font_cache_entry *e = &_ctx.entries[i];
+        if (e->face->family == family &&
+            e->face->font_size == font_size &&
+            e->face->scale == scale) {
+            e->last_used = _ctx.tick;
+            _ctx.hits++;
+            return font_face_ref(e->face);
+        }
+    }
+
+    _ctx.misses++;
+
+    profiler_begin_name("font_create_face");
+    font_face *f = create_face(family, font_size, scale);
+    profiler_end;
+    if (!f) {
+        return NULL;
+    }
+
+    uint32_t slot = 0;
+    if (_ctx.count < FONT_CACHE_SIZE) {
+        slot = _ctx.count++;
+    }
+    else {
+        for (uint32_t i = 1; i < _ctx.count; i++) {
+            if (_ctx.entries[i].last_used < _ctx.entries[slot].last_used) {
+                slot = i;
+            }
+        }
+
+        // Text that still uses the evicted face keeps it alive.
+        font_face_release(_ctx.entries[slot].face);
+        _ctx.evictions++;
+    }
+
+    // The cache owns the reference returned by create_face.
+    _ctx.entries[slot].face = f;
+    _ctx.entries[slot].last_used = _ctx.tick;
+
+    return font_face_ref(f);
+}
+
+font_face* font_face_ref(font_face *f)
+{
+    assert(f);
+    assert(f->ref > 0);
+
+    f->ref++;
+    return f;
+}
+
+void font_face_release(font_face *f)
+{
+    assert(f);
+    assert(f->ref > 0);
+
+    f->ref--;
+    if (f->ref == 0) {
+        destroy_face(f);
+        _ctx.num_faces--;
+    }
+}
+
+uint32_t font_face_id(const font_face *f)
+{
+    assert(f);
+    return f->id;
+}
+
+double font_face_size(const font_face *f)
+{
+    assert(f);
+    return f->pixel_size;
+}
+
+void font_face_metrics(const font_face *f,
+                       double *ascent, double *descent, double *leading)
+{
+    assert(f);
+    assert(ascent);
+    assert(descent);
+    assert(leading);
+
+    *ascent = f->ascent;
+    *descent = f->descent;
+    *leading = f->leading;
+}
+
+uint32_t font_face_glyph(const font_face *f, uint32_t codepoint)
+{
+    assert(f);
+
+#ifdef BG_MACOS
+    UniChar chars[2];
+    CGGlyph glyphs[2] = {0};
+    CFIndex count = 1;
+    if (codepoint > 0xFFFF) {
+        codepoint -= 0x10000;
+        chars[0] = (UniChar)(0xD800 + (codepoint >> 10));
+        chars[1] = (UniChar)(0xDC00 + (codepoint & 0x3FF));
+        count = 2;
+    }
+    else {
+        chars[0] = (UniChar)codepoint;
+    }
+
+    if (!CTFontGetGlyphsForCharacters(f->font, chars, glyphs, count)) {
+        return 0;
+    }
+    return glyphs[0];
+#else
+    return FT_Get_Char_Index(f->face, codepoint);
+#endif
+}
+
+double font_face_glyph_advance(const font_face *f, uint32_t glyph)
+{
+    assert(f);
+
+#ifdef BG_MACOS
+    CGGlyph g = (CGGlyph)glyph;
+    return CTFontGetAdvancesForGlyphs(f->font, kCTFontOrientationHorizontal,
+                                      &g, NULL, 1);
+#else
+    return hb_font_get_glyph_h_advance(f->hb, glyph) / 64.0;
+#endif
+}
+
+bool font_face_rasterize(const font_face *f, uint32_t glyph, double offset_x,
+                         font_glyph_bitmap *dst)
+{
+    assert(f);
+    assert(dst);
+    assert(offset_x >= 0.0 && offset_x < 1.0);
+
+#ifdef BG_MACOS
+    CGGlyph g = (CGGlyph)glyph;
+    CGRect bounds;
+    CTFontGetBoundingRectsForGlyphs(f->font, kCTFontOrientationHorizontal,
+                                    &g, &bounds, 1);
+
+    memset(dst, 0, sizeof(*dst));
+    if (CGRectIsEmpty(bounds)) {
+        return true;
+    }
+
+    // Pad by a pixel on each side for antialiasing.
+    int32_t left = (int32_t)floor(bounds.origin.x + offset_x) - 1;
+    int32_t right = (int32_t)ceil(CGRectGetMaxX(bounds) + offset_x) + 1;
+    int32_t bottom = (int32_t)floor(bounds.origin.y) - 1;
+    int32_t top = (int32_t)ceil(CGRectGetMaxY(bounds)) + 1;
+    uint32_t w = (uint32_t)(right - left);
+    uint32_t h = (uint32_t)(top - bottom);
+
+    size_t size = (size_t)w * h;
+    if (size > _ctx.coverage_size) {
+        uint8_t *coverage = realloc(_ctx.coverage, size);
+        if (!coverage) {
+            return false;
+        }
+        _ctx.coverage = coverage;
+        _ctx.coverage_size = size;
+    }
+    memset(_ctx.coverage, 0, size);
+
+    CGContextRef context = CGBitmapContextCreate(_ctx.coverage, w, h, 8, w,
+                                                 NULL, kCGImageAlphaOnly);
+    if (!context) {
+        return false;
+    }
+    CGContextSetAllowsFontSmoothing(context, false);
+    CGContextSetFillColorWithColor(context,
+                                   CGColorGetConstantColor(kCGColorBlack));
+
+    CGPoint pos = CGPointMake(offset_x - left, -bottom);
+    CTFontDrawGlyphs(f->font, &g, &pos, 1, context);
+    CGContextRelease(context);
+
+    dst->left = left;
+    dst->top = top;
+    dst->w = w;
+    dst->h = h;
+    dst->pitch = (int32_t)w;
+    dst->coverage = _ctx.coverage;
+
+    return true;
+#else
+    FT_Vector delta = { (FT_Pos)(offset_x * 64.0), 0 };
+    FT_Set_Transform(f->face, NULL, &delta);
+    FT_Error err = FT_Load_Glyph(f->face, glyph, FT_LOAD_RENDER);
+    FT_Set_Transform(f->face, NULL, NULL);
+    if (err) {
+        return false;
+    }
+
+    FT_GlyphSlot slot = f->face->glyph;
+    dst->left = slot->bitmap_left;
+    dst->top = slot->bitmap_top;
+    dst->w = slot->bitmap.width;
+    dst->h = slot->bitmap.rows;
+    dst->pitch = slot->bitmap.pitch;
+    dst->coverage = slot->bitmap.buffer;
+
+    return true;
+#endif
+}
+
+void font_cache_stats_get(font_cache_stats *dst)
+{
+    assert(dst);
+
+    dst->hits = _ctx.hits;
+    dst->misses = _ctx.misses;
+    dst->evictions = _ctx.evictions;
+    dst->count = _ctx.count;
+    dst->capacity = FONT_CACHE_SIZE;
+}
+
+#ifdef BG_MACOS
+
+font_face* font_face_create_ct(CTFontRef font)
+{
+    assert(font);
+
+    font_face *f = calloc(1, sizeof(font_face));
+    if (!f) {
+        return NULL;
+    }
+
+    f->family = FONT_FAMILY_COUNT;
+    f->id = ++_ctx.next_id;
+    f->ref = 1;
+    _ctx.num_faces++;
+    f->font = (CTFontRef)CFRetain(font);
+    f->pixel_size = CTFontGetSize(font);
+    f->ascent = CTFontGetAscent(font);
+    f->descent = CTFontGetDescent(font);
+    f->leading = CTFontGetLeading(font);
+
+    return f;
+}
+
+CTFontRef font_face_ct(const font_face *f)
+{
+    assert(f);
+    return f->font;
+}
+
+static font_face* create_face(font_family_id family,
+                              double font_size, double scale)
+{
+    const char *font_family = get_font_family(family);
+    const void *keys[] = {kCTFontFamilyNameAttribute, kCTFontSizeAttribute};
+    CFStringRef font_family_value = CFStringCreateWithBytesNoCopy(
+            NULL,
+            (uint8_t*)font_family, (long)strlen(font_family),
+            kCFStringEncodingUTF8,
+            false,
+            kCFAllocatorNull);
+    double scaled_font_size = font_size * scale;
+    CFNumberRef font_size_value = CFNumberCreate(
+            NULL,
+            kCFNumberFloat64Type,
+            &scaled_font_size);
+    const void *values[] = { font_family_value, font_size_value };
+    CFDictionaryRef font_attrs = CFDictionaryCreate(
+            kCFAllocatorDefault,
+            keys,
+            values,
+            2,
+            &kCFTypeDictionaryKeyCallBacks,
+            &kCFTypeDictionaryValueCallBacks);
+
+    CTFontDescriptorRef font_desc =
+        CTFontDescriptorCreateWithAttributes(font_attrs);
+    CTFontRef font = CTFontCreateWithFontDescriptor(
+            font_desc,
+            scaled_font_size,
+            NULL);
+
+    CFRelease(font_desc);
+    CFRelease(font_attrs);
+    CFRelease(font_size_value);
+    CFRelease(font_family_value);
+
+    if (!font) {
+        return NULL;
+    }
+
+    font_face *f = font_face_create_ct(font);
+    CFRelease(font);
+    if (!f) {
+        return NULL;
+    }
+
+    f->family = family;
+    f->font_size = font_size;
+    f->scale = scale;
+
+    return f;
+}
+
+static void destroy_face(font_face *f)
+{
+    CFRelease(f->font);
+    free(f);
+}
+
+static const char * get_font_family(font_family_id f)
+{
+    switch (f) {
+        case FONT_FAMILY_MENLO:
+            return "Menlo";
+        case FONT_FAMILY_MONACO:
+            return "Monaco";
+        case FONT_FAMILY_COURIER_NEW:
+            return "Courier New";
+        default:
+            return "Menlo";
+    };
+}
+
+#else
+
+#ifndef BG_DATA_DIR
+#define BG_DATA_DIR "data"
+#endif
+
+FT_Face font_face_ft(const font_face *f)
+{
+    assert(f);
+    return f->face;
+}
+
+hb_font_t* font_face_hb(const font_face *f)
+{
+    assert(f);
+    return f->hb;
+}
+
+static font_face* create_face(font_family_id family,
+                              double font_size, double scale)
+{
+    font_face *f = calloc(1, sizeof(font_face));
+    if (!f) {
+        return NULL;
+    }
+
+    FT_Error err = FT_New_Memory_Face(_ctx.ft,
+                                      _ctx.files[family],
+                                      (FT_Long)_ctx.file_sizes[family],
+                                      0, &f->face);
+    if (err) {
+        free(f);
+        return NULL;
+    }
+
+    f->family = family;
+    f->font_size = font_size;
+    f->scale = scale;
+    f->pixel_size = font_size * scale;
+    f->id = ++_ctx.next_id;
+    f->ref = 1;
+    _ctx.num_faces++;
+
+    // Sizes are in pixels so use a 72 dpi resolution.
+    FT_Set_Char_Size(f->face, 0, (FT_F26Dot6)(f->pixel_size * 64.0), 72, 72);
+    FT_Size_Metrics *m = &f->face->size->metrics;
+    f->ascent = (double)m->ascender / 64.0;
+    f->descent = (double)-m->descender / 64.0;
+    f->leading = (double)m->height / 64.0 - f->ascent - f->descent;
+
+    f->hb = hb_ft_font_create_referenced(f->face);
+
+    return f;
+}
+
+static void destroy_face(font_face *f)
+{
+    // The HarfBuzz font holds its own reference to the FreeType face.
+    hb_font_destroy(f->hb);
+    FT_Done_Face(f->face);
+    free(f);
+}
+
+// The fonts shipped in data/ that stand in for the system fonts CoreText
+// uses on macOS.
+static const char * get_font_file(font_family_id f)
+{
+    switch (f) {
+        case FONT_FAMILY_MENLO:
+            return BG_DATA_DIR "/MenloPowerline.ttf";
+        case FONT_FAMILY_MONACO:
+            return BG_DATA_DIR "/NotoMono-Regular.ttf";
+        case FONT_FAMILY_COURIER_NEW:
+            return BG_DATA_DIR "/SourceCodePro-Regular.ttf";
+        default:
+            return BG_DATA_DIR "/NotoMono-Regular.ttf";
+    };
+}
+
+static bool read_file(const char *path, uint8_t **data, size_t *size)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return false;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (len <= 0) {
+        fclose(f);
+        return false;
+    }
+
+    *data = malloc((size_t)len);
+    if (!*data) {
+        fclose(f);
+        return false;
+    }
+
+    *size = fread(*data, 1, (size_t)len, f);
+    fclose(f);
+
+    return *size == (size_t)len;
+}
+
+#endif
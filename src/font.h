@@ -0,0 +1,71 @@
+#pragma once
+
+#include "common.h"
+
+typedef struct font_face font_face;
+
+typedef enum font_family_id {
+    FONT_FAMILY_MENLO,
+    FONT_FAMILY_MONACO,
+    FONT_FAMILY_COURIER_NEW,
+    FONT_FAMILY_COUNT,
+    FONT_FAMILY_DEFAULT = FONT_FAMILY_MENLO,
+} font_family_id;
+
+typedef struct font_glyph_bitmap {
+    int32_t left; // Offset from the pen position to the left edge.
+    int32_t top;  // Offset from the baseline up to the top edge.
+    uint32_t w;
+    uint32_t h;
+    int32_t pitch;
+    const uint8_t *coverage; // Valid until the next rasterize call.
+} font_glyph_bitmap;
+
+typedef struct font_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint32_t count;    // Faces currently held by the cache.
+    uint32_t capacity; // Max faces held before the LRU face is evicted.
+} font_cache_stats;
+
+bool font_system_init(void);
+
+// Every face has to be released before, including those held by the
+// layouts of texts.
+void font_system_shutdown(void);
+
+// Returns the face for the family at font_size points on a framebuffer with
+// the given scale. Faces are shared process wide and the returned reference
+// must be released with font_face_release.
+font_face* font_get(font_family_id family, double font_size, double scale);
+
+font_face* font_face_ref(font_face *f);
+
+// Decrements the ref count and if the ref count == 0 then frees the face.
+// Faces evicted from the cache stay alive until every reference is gone.
+void font_face_release(font_face *f);
+
+// Unlike the face pointer the id is never reused, so it can key caches that
+// outlive the face.
+uint32_t font_face_id(const font_face *f);
+
+// Returns the size of the face in framebuffer pixels.
+double font_face_size(const font_face *f);
+
+void font_face_metrics(const font_face *f,
+                       double *ascent, double *descent, double *leading);
+
+// Returns the glyph for the codepoint or 0 if the face doesn't have one.
+uint32_t font_face_glyph(const font_face *f, uint32_t codepoint);
+
+// Returns the horizontal advance of the glyph in framebuffer pixels.
+double font_face_glyph_advance(const font_face *f, uint32_t glyph);
+
+// Renders the 8-bit coverage mask of the glyph with the pen moved right by
+// offset_x pixels, 0 <= offset_x < 1. Returns false if the glyph can't be
+// rendered. Empty glyphs such as spaces succeed with a 0x0 bitmap.
+bool font_face_rasterize(const font_face *f, uint32_t glyph, double offset_x,
+                         font_glyph_bitmap *dst);
+
+void font_cache_stats_get(font_cache_stats *dst);
@@ -0,0 +1,24 @@
+#pragma once
+
+// Access to the platform font objects behind a font_face. Only the text
+// backends need these so they are kept out of font.h.
+
+#include "font.h"
+
+#ifdef BG_MACOS
+#include <CoreText/CoreText.h>
+#else
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include <harfbuzz/hb.h>
+#endif
+
+#ifdef BG_MACOS
+// Wraps a font CoreText picked itself, e.g. during font fallback. The face
+// is not part of the cache.
+font_face* font_face_create_ct(CTFontRef font);
+CTFontRef font_face_ct(const font_face *f);
+#else
+FT_Face font_face_ft(const font_face *f);
+hb_font_t* font_face_hb(const font_face *f);
+#endif
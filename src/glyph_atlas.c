@@ -0,0 +1,413 @@
+#include "glyph_atlas.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BL_STATIC
+#include <blend2d.h>
+
+#include "font.h"
+#include "hash.h"
+#include "profiler.h"
+
+#define MAX_ATLAS_PAGES 64
+#define ATLAS_PAGE_BYTES (GLYPH_ATLAS_PAGE_SIZE * GLYPH_ATLAS_PAGE_SIZE)
+#define ATLAS_PADDING 1
+#define INITIAL_GLYPHS_CAP 1024
+
+typedef struct atlas_glyph {
+    uint32_t face_id; // 0 marks an empty slot.
+    uint32_t glyph;
+    uint32_t bucket;
+    glyph_atlas_entry entry;
+} atlas_glyph;
+
+typedef struct atlas_page {
+    uint8_t *pixels;
+    BLImageCore img;
+
+    // Shelf packer. Glyphs are placed left to right on the current shelf
+    // and a new shelf is started below it once the shelf is full.
+    int32_t shelf_x;
+    int32_t shelf_y;
+    int32_t shelf_h;
+
+    uint64_t used_area;
+    uint64_t last_used; // Frame the page was last drawn from.
+} atlas_page;
+
+typedef struct glyph_atlas_ctx {
+    atlas_page pages[MAX_ATLAS_PAGES];
+    uint32_t num_pages;
+    uint32_t max_pages;
+    uint32_t current; // Page new glyphs are packed into.
+    size_t budget;
+
+    // Open addressing hash table. The capacity is a power of 2.
+    atlas_glyph *glyphs;
+    uint32_t glyphs_cap;
+    uint32_t num_glyphs;
+
+    uint64_t frame;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+
+    bool initialized;
+} glyph_atlas_ctx;
+
+static glyph_atlas_ctx _ctx;
+
+static uint32_t get_bucket(double x);
+static atlas_glyph* find_slot(uint32_t face_id, uint32_t glyph,
+                              uint32_t bucket);
+static bool rebuild_glyphs(uint32_t cap, uint32_t drop_page);
+static void drop_page_glyphs(uint32_t page);
+static bool add_page(void);
+static void free_page(uint32_t page);
+static void clear_page(uint32_t page);
+static bool pack(atlas_page *p, int32_t w, int32_t h, int32_t *x, int32_t *y);
+static bool alloc_glyph(int32_t w, int32_t h,
+                        uint32_t *page, int32_t *x, int32_t *y);
+
+bool glyph_atlas_init(size_t budget)
+{
+    _ctx.glyphs = calloc(INITIAL_GLYPHS_CAP, sizeof(atlas_glyph));
+    if (!_ctx.glyphs) {
+        return false;
+    }
+    _ctx.glyphs_cap = INITIAL_GLYPHS_CAP;
+    _ctx.frame = 1;
+
+    glyph_atlas_set_budget(budget);
+
+    _ctx.initialized = true;
+    return true;
+}
+
+void glyph_atlas_shutdown(void)
+{
+    while (_ctx.num_pages > 0) {
+        free_page(_ctx.num_pages - 1);
+    }
+
+    free(_ctx.glyphs);
+    _ctx.glyphs = NULL;
+    _ctx.glyphs_cap = 0;
+    _ctx.num_glyphs = 0;
+
+    _ctx.initialized = false;
+}
+
+void glyph_atlas_set_budget(size_t budget)
+{
+    _ctx.budget = budget;
+    _ctx.max_pages = (uint32_t)min(budget / ATLAS_PAGE_BYTES,
+                                   MAX_ATLAS_PAGES);
+    _ctx.max_pages = max(_ctx.max_pages, 1);
+}
+
+void glyph_atlas_begin_frame(void)
+{
+    assert(_ctx.initialized);
+
+    _ctx.frame++;
+
+    // Drop the pages over a lowered budget now that nothing draws from them.
+    while (_ctx.num_pages > _ctx.max_pages) {
+        free_page(_ctx.num_pages - 1);
+        _ctx.evictions++;
+    }
+    if (_ctx.current >= _ctx.num_pages) {
+        _ctx.current = _ctx.num_pages > 0 ? _ctx.num_pages - 1 : 0;
+    }
+}
+
+bool glyph_atlas_get(const font_face *face, uint32_t glyph, double x,
+                     glyph_atlas_entry *dst)
+{
+    assert(_ctx.initialized);
+    assert(face);
+    assert(dst);
+
+    uint32_t face_id = font_face_id(face);
+    uint32_t bucket = get_bucket(x);
+
+    atlas_glyph *slot = find_slot(face_id, glyph, bucket);
+    if (slot->face_id != 0) {
+        if (slot->entry.w > 0) {
+            _ctx.pages[slot->entry.page].last_used = _ctx.frame;
+        }
+        _ctx.hits++;
+        *dst = slot->entry;
+        return true;
+    }
+
+    // Keep the load factor under 1/2 so probes stay short.
+    if ((_ctx.num_glyphs + 1) * 2 > _ctx.glyphs_cap &&
+        !rebuild_glyphs(_ctx.glyphs_cap * 2, UINT32_MAX)) {
+        return false;
+    }
+
+    profiler_begin_name("glyph_atlas_rasterize");
+
+    // Glyphs that fail to rasterize are cached as empty so they aren't
+    // retried every frame.
+    glyph_atlas_entry e = {0};
+    font_glyph_bitmap bitmap;
+    double offset_x = (double)bucket / GLYPH_ATLAS_SUBPIXEL_BUCKETS;
+    if (font_face_rasterize(face, glyph, offset_x, &bitmap) &&
+        bitmap.w > 0 && bitmap.h > 0 &&
+        bitmap.w < GLYPH_ATLAS_PAGE_SIZE && bitmap.h < GLYPH_ATLAS_PAGE_SIZE) {
+        e.w = (int32_t)bitmap.w;
+        e.h = (int32_t)bitmap.h;
+        e.left = bitmap.left;
+        e.top = bitmap.top;
+        if (!alloc_glyph(e.w, e.h, &e.page, &e.x, &e.y)) {
+            profiler_end;
+            return false;
+        }
+
+        atlas_page *p = &_ctx.pages[e.page];
+        for (int32_t y = 0; y < e.h; y++) {
+            memcpy(p->pixels + (size_t)(e.y + y) * GLYPH_ATLAS_PAGE_SIZE + e.x,
+                   bitmap.coverage + (ptrdiff_t)y * bitmap.pitch,
+                   bitmap.w);
+        }
+        p->last_used = _ctx.frame;
+    }
+
+    profiler_end;
+
+    // Evicting a page rebuilds the table so look the slot up again.
+    slot = find_slot(face_id, glyph, bucket);
+    slot->face_id = face_id;
+    slot->glyph = glyph;
+    slot->bucket = bucket;
+    slot->entry = e;
+    _ctx.num_glyphs++;
+    _ctx.misses++;
+
+    *dst = e;
+    return true;
+}
+
+const BLImageCore* glyph_atlas_page(uint32_t page)
+{
+    assert(page < _ctx.num_pages);
+    return &_ctx.pages[page].img;
+}
+
+void glyph_atlas_stats_get(glyph_atlas_stats *dst)
+{
+    assert(dst);
+
+    uint64_t used_area = 0;
+    for (uint32_t i = 0; i < _ctx.num_pages; i++) {
+        used_area += _ctx.pages[i].used_area;
+    }
+    size_t bytes = (size_t)_ctx.num_pages * ATLAS_PAGE_BYTES;
+
+    dst->hits = _ctx.hits;
+    dst->misses = _ctx.misses;
+    dst->evictions = _ctx.evictions;
+    dst->glyphs = _ctx.num_glyphs;
+    dst->pages = _ctx.num_pages;
+    dst->max_pages = _ctx.max_pages;
+    dst->bytes = bytes;
+    dst->budget = _ctx.budget;
+    dst->occupancy = bytes > 0 ? (double)used_area / (double)bytes : 0.0;
+}
+
+static uint32_t get_bucket(double x)
+{
+    double frac = x - floor(x);
+    uint32_t bucket = (uint32_t)(frac * GLYPH_ATLAS_SUBPIXEL_BUCKETS);
+    return min(bucket, GLYPH_ATLAS_SUBPIXEL_BUCKETS - 1);
+}
+
+static atlas_glyph* find_slot(uint32_t face_id, uint32_t glyph,
+                              uint32_t bucket)
+{
+    uint32_t key[3] = { face_id, glyph, bucket };
+    uint32_t h = HASH_INITIAL;
+    hash(&h, (uint8_t*)key, sizeof(key));
+
+    uint32_t mask = _ctx.glyphs_cap - 1;
+    uint32_t i = h & mask;
+    for (;;) {
+        atlas_glyph *slot = &_ctx.glyphs[i];
+        if (slot->face_id == 0 ||
+            (slot->face_id == face_id &&
+             slot->glyph == glyph &&
+             slot->bucket == bucket)) {
+            return slot;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+// Rehashes every glyph into a table of cap slots, leaving out the glyphs
+// packed into drop_page.
+static bool rebuild_glyphs(uint32_t cap, uint32_t drop_page)
+{
+    atlas_glyph *old = _ctx.glyphs;
+    uint32_t old_cap = _ctx.glyphs_cap;
+
+    atlas_glyph *glyphs = calloc(cap, sizeof(atlas_glyph));
+    if (!glyphs) {
+        return false;
+    }
+
+    _ctx.glyphs = glyphs;
+    _ctx.glyphs_cap = cap;
+    _ctx.num_glyphs = 0;
+    for (uint32_t i = 0; i < old_cap; i++) {
+        const atlas_glyph *g = &old[i];
+        if (g->face_id == 0 ||
+            (g->entry.w > 0 && g->entry.page == drop_page)) {
+            continue;
+        }
+        *find_slot(g->face_id, g->glyph, g->bucket) = *g;
+        _ctx.num_glyphs++;
+    }
+
+    free(old);
+    return true;
+}
+
+static void drop_page_glyphs(uint32_t page)
+{
+    if (!rebuild_glyphs(_ctx.glyphs_cap, page)) {
+        // Forgetting every glyph is always safe, they get rasterized again.
+        memset(_ctx.glyphs, 0, _ctx.glyphs_cap * sizeof(atlas_glyph));
+        _ctx.num_glyphs = 0;
+    }
+}
+
+static bool add_page(void)
+{
+    assert(_ctx.num_pages < MAX_ATLAS_PAGES);
+
+    atlas_page *p = &_ctx.pages[_ctx.num_pages];
+    memset(p, 0, sizeof(*p));
+    p->pixels = calloc(1, ATLAS_PAGE_BYTES);
+    if (!p->pixels) {
+        return false;
+    }
+
+    blImageInit(&p->img);
+    BLResult r = blImageCreateFromData(&p->img,
+                                       GLYPH_ATLAS_PAGE_SIZE,
+                                       GLYPH_ATLAS_PAGE_SIZE,
+                                       BL_FORMAT_A8, p->pixels,
+                                       GLYPH_ATLAS_PAGE_SIZE,
+                                       BL_DATA_ACCESS_RW, NULL, NULL);
+    if (r != BL_SUCCESS) {
+        blImageDestroy(&p->img);
+        free(p->pixels);
+        return false;
+    }
+
+    _ctx.num_pages++;
+    return true;
+}
+
+static void free_page(uint32_t page)
+{
+    assert(page == _ctx.num_pages - 1);
+
+    drop_page_glyphs(page);
+
+    atlas_page *p = &_ctx.pages[page];
+    blImageDestroy(&p->img);
+    free(p->pixels);
+    memset(p, 0, sizeof(*p));
+
+    _ctx.num_pages--;
+}
+
+static void clear_page(uint32_t page)
+{
+    drop_page_glyphs(page);
+
+    atlas_page *p = &_ctx.pages[page];
+    memset(p->pixels, 0, ATLAS_PAGE_BYTES);
+    p->shelf_x = 0;
+    p->shelf_y = 0;
+    p->shelf_h = 0;
+    p->used_area = 0;
+}
+
+static bool pack(atlas_page *p, int32_t w, int32_t h, int32_t *x, int32_t *y)
+{
+    int32_t padded_w = w + ATLAS_PADDING;
+    int32_t padded_h = h + ATLAS_PADDING;
+    if (padded_w > GLYPH_ATLAS_PAGE_SIZE) {
+        return false;
+    }
+
+    if (p->shelf_x + padded_w > GLYPH_ATLAS_PAGE_SIZE) {
+        p->shelf_y += p->shelf_h;
+        p->shelf_x = 0;
+        p->shelf_h = 0;
+    }
+    if (p->shelf_y + padded_h > GLYPH_ATLAS_PAGE_SIZE) {
+        return false;
+    }
+
+    *x = p->shelf_x;
+    *y = p->shelf_y;
+    p->shelf_x += padded_w;
+    p->shelf_h = max(p->shelf_h, padded_h);
+    p->used_area += (uint64_t)w * (uint64_t)h;
+
+    return true;
+}
+
+static bool alloc_glyph(int32_t w, int32_t h,
+                        uint32_t *page, int32_t *x, int32_t *y)
+{
+    if (_ctx.num_pages > 0 && pack(&_ctx.pages[_ctx.current], w, h, x, y)) {
+        *page = _ctx.current;
+        return true;
+    }
+
+    if (_ctx.num_pages < _ctx.max_pages) {
+        if (!add_page()) {
+            return false;
+        }
+        _ctx.current = _ctx.num_pages - 1;
+    }
+    else {
+        // Reuse the least recently drawn page that the current frame
+        // hasn't touched.
+        uint32_t lru = UINT32_MAX;
+        for (uint32_t i = 0; i < _ctx.num_pages; i++) {
+            const atlas_page *p = &_ctx.pages[i];
+            if (p->last_used < _ctx.frame &&
+                (lru == UINT32_MAX || p->last_used < _ctx.pages[lru].last_used)) {
+                lru = i;
+            }
+        }
+        if (lru == UINT32_MAX) {
+            // Every page is drawn from by this frame. Go over the budget
+            // until the next frame trims the extra pages.
+            if (_ctx.num_pages == MAX_ATLAS_PAGES || !add_page()) {
+                return false;
+            }
+            _ctx.current = _ctx.num_pages - 1;
+            *page = _ctx.current;
+            return pack(&_ctx.pages[_ctx.current], w, h, x, y);
+        }
+
+        clear_page(lru);
+        _ctx.evictions++;
+        _ctx.current = lru;
+    }
+
+    *page = _ctx.current;
+    return pack(&_ctx.pages[_ctx.current], w, h, x, y);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "common.h"
+
+typedef struct BLImageCore BLImageCore;
+typedef struct font_face font_face;
+
+// Rasterized glyph coverage masks packed into A8 pages so text can be drawn
+// as mask fills by the renderer. Glyphs are keyed on face, glyph id and the
+// subpixel bucket of the pen position.
+
+#define GLYPH_ATLAS_PAGE_SIZE 512
+#define GLYPH_ATLAS_SUBPIXEL_BUCKETS 4
+
+// Soft budget for the pages, which a single frame can overrun as described
+// at glyph_atlas_set_budget.
+#define GLYPH_ATLAS_DEFAULT_BUDGET (4 * 1024 * 1024)
+
+typedef struct glyph_atlas_entry {
+    uint32_t page;
+    int32_t x; // Position of the mask in the page.
+    int32_t y;
+    int32_t w; // 0 for glyphs with nothing to draw.
+    int32_t h;
+    int32_t left; // Offset from the pen position to the left edge.
+    int32_t top;  // Offset from the baseline up to the top edge.
+} glyph_atlas_entry;
+
+typedef struct glyph_atlas_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions; // Pages evicted to stay under the budget.
+    uint32_t glyphs;
+    uint32_t pages;
+    uint32_t max_pages;
+    size_t bytes;
+    size_t budget;
+    double occupancy; // Fraction of the allocated page area used by glyphs.
+} glyph_atlas_stats;
+
+bool glyph_atlas_init(size_t budget);
+void glyph_atlas_shutdown(void);
+
+// Sets the memory budget in bytes for the atlas pages. At least one page is
+// always kept. A frame that needs more glyphs than fit in the budget grows
+// the atlas past it and the extra pages are freed at the next frame.
+void glyph_atlas_set_budget(size_t budget);
+
+// Marks the start of a frame. Pages used during the current frame are never
+// evicted since pending draws may still read from them.
+void glyph_atlas_begin_frame(void);
+
+// Looks up the glyph drawn with the pen at x, rasterizing and packing it on
+// a miss. Returns false if the glyph can't be packed.
+bool glyph_atlas_get(const font_face *face, uint32_t glyph, double x,
+                     glyph_atlas_entry *dst);
+
+// The A8 image of a page, valid until the page is evicted.
+const BLImageCore* glyph_atlas_page(uint32_t page);
+
+void glyph_atlas_stats_get(glyph_atlas_stats *dst);
@@ -1,5 +1,69 @@
 #include "hash.h"
 
+#include <assert.h>
+#include <string.h>
+
+#include "cpu.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define HASH_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#define HASH_TARGET_SSE2
+#define HASH_TARGET_AVX2
+#else
+#define HASH_TARGET_SSE2 __attribute__((target("sse2")))
+#define HASH_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+#define HASH64_SCRAMBLE_STRIPES 16
+
+#define PRIME32_1 0x9e3779b1u
+#define PRIME64_1 0x9e3779b185ebca87ull
+#define PRIME64_2 0xc2b2ae3d27d4eb4full
+#define PRIME64_3 0x165667b19e3779f9ull
+
+// Xored into the data of the lanes before they are multiplied. The keys of
+// a stripe start one key further than those of the stripe before, so the
+// same stripes in another order hash differently.
+static const uint64_t STRIPE_KEYS[HASH64_SCRAMBLE_STRIPES + 3] = {
+    0xc0e16b163a85a4dcull, 0x890acd8dd443c47cull,
+    0xb3889d8a6dc47761ull, 0x6a0398e528f0ae6aull,
+    0x048344ece48a855eull, 0xf175cfea21871330ull,
+    0x391ceef02702c2fdull, 0x4baf8cac4784cb12ull,
+    0x3547744583a3f88eull, 0xd9cf2b15c6b6c90eull,
+    0x961facc76d5fe21cull, 0x0094ab49d50f11f9ull,
+    0xe3211e37bdbeb6dcull, 0x62fe6c274ff3511aull,
+    0x5ac30b329fdf0574ull, 0x1450582c6b65b406ull,
+    0x7a30fcc7888eb791ull, 0x5540f5ba6a15576eull,
+    0x16cef0559096d3e9ull,
+};
+
+// Xored into the lanes when they are scrambled and taken down to the digest.
+static const uint64_t SCRAMBLE_KEYS[4] = {
+    0x78e5c0cc4ee679cbull, 0x2172ffcc7dd05a82ull,
+    0x8e2443f7744608b8ull, 0x4c263a81e69035e0ull,
+};
+
+// keys are those of the first stripe.
+typedef void (*hash_accumulate_fn)(uint64_t *acc, const uint8_t *data,
+                                   size_t num_stripes, const uint64_t *keys);
+
+static void accumulate_scalar(uint64_t *acc, const uint8_t *data,
+                              size_t num_stripes, const uint64_t *keys);
+
+typedef struct hash_ctx {
+    hash_kernel kernel;
+    hash_accumulate_fn accumulate;
+    bool supported[HASH_KERNEL_COUNT];
+} hash_ctx;
+
+static hash_ctx _ctx = {
+    .kernel = HASH_KERNEL_SCALAR,
+    .accumulate = accumulate_scalar,
+};
+
 void hash(uint32_t *v, uint8_t *buf, size_t len)
 {
     for (size_t i = 0; i < len; i++)
@@ -8,3 +72,268 @@ void hash(uint32_t *v, uint8_t *buf, size_t len)
         *v *= 16777619;
     }
 }
+
+// Every lane adds the product of the low and high half of its data xored
+// with its key, and the data of the other lane of its pair as is so no
+// input bits are lost to the multiply.
+static void accumulate_scalar(uint64_t *acc, const uint8_t *data,
+                              size_t num_stripes, const uint64_t *keys)
+{
+    for (size_t s = 0; s < num_stripes; s++) {
+        const uint8_t *stripe = data + s * HASH64_STRIPE_SIZE;
+        for (uint32_t i = 0; i < 4; i++) {
+            uint64_t d;
+            memcpy(&d, stripe + i * sizeof(uint64_t), sizeof(d));
+            uint64_t k = d ^ keys[s + i];
+            acc[i ^ 1] += d;
+            acc[i] += (k & 0xffffffff) * (k >> 32);
+        }
+    }
+}
+
+#ifdef HASH_X86
+
+HASH_TARGET_SSE2
+static void accumulate_sse2(uint64_t *acc, const uint8_t *data,
+                            size_t num_stripes, const uint64_t *keys)
+{
+    __m128i acc_lo = _mm_loadu_si128((const __m128i*)acc);
+    __m128i acc_hi = _mm_loadu_si128((const __m128i*)(acc + 2));
+    for (size_t s = 0; s < num_stripes; s++) {
+        const uint8_t *stripe = data + s * HASH64_STRIPE_SIZE;
+        __m128i key_lo = _mm_loadu_si128((const __m128i*)(keys + s));
+        __m128i key_hi = _mm_loadu_si128((const __m128i*)(keys + s + 2));
+        __m128i d_lo = _mm_loadu_si128((const __m128i*)stripe);
+        __m128i d_hi = _mm_loadu_si128((const __m128i*)(stripe + 16));
+        __m128i k_lo = _mm_xor_si128(d_lo, key_lo);
+        __m128i k_hi = _mm_xor_si128(d_hi, key_hi);
+        __m128i p_lo = _mm_mul_epu32(k_lo, _mm_srli_epi64(k_lo, 32));
+        __m128i p_hi = _mm_mul_epu32(k_hi, _mm_srli_epi64(k_hi, 32));
+        __m128i swap_lo = _mm_shuffle_epi32(d_lo, _MM_SHUFFLE(1, 0, 3, 2));
+        __m128i swap_hi = _mm_shuffle_epi32(d_hi, _MM_SHUFFLE(1, 0, 3, 2));
+        acc_lo = _mm_add_epi64(acc_lo, _mm_add_epi64(p_lo, swap_lo));
+        acc_hi = _mm_add_epi64(acc_hi, _mm_add_epi64(p_hi, swap_hi));
+    }
+    _mm_storeu_si128((__m128i*)acc, acc_lo);
+    _mm_storeu_si128((__m128i*)(acc + 2), acc_hi);
+}
+
+// The shuffle swaps the lanes within each 128-bit half, which pairs them up
+// like the scalar kernel.
+HASH_TARGET_AVX2
+static void accumulate_avx2(uint64_t *acc, const uint8_t *data,
+                            size_t num_stripes, const uint64_t *keys)
+{
+    __m256i a = _mm256_loadu_si256((const __m256i*)acc);
+    for (size_t s = 0; s < num_stripes; s++) {
+        const uint8_t *stripe = data + s * HASH64_STRIPE_SIZE;
+        __m256i key = _mm256_loadu_si256((const __m256i*)(keys + s));
+        __m256i d = _mm256_loadu_si256((const __m256i*)stripe);
+        __m256i k = _mm256_xor_si256(d, key);
+        __m256i p = _mm256_mul_epu32(k, _mm256_srli_epi64(k, 32));
+        __m256i swap = _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+        a = _mm256_add_epi64(a, _mm256_add_epi64(p, swap));
+    }
+    _mm256_storeu_si256((__m256i*)acc, a);
+}
+
+#endif
+
+// Spreads the high bits of the lanes back down so they keep mixing.
+static void scramble(uint64_t *acc)
+{
+    for (uint32_t i = 0; i < 4; i++) {
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= SCRAMBLE_KEYS[i];
+        acc[i] = a * PRIME32_1;
+    }
+}
+
+static uint64_t avalanche(uint64_t v)
+{
+    v ^= v >> 33;
+    v *= PRIME64_2;
+    v ^= v >> 29;
+    v *= PRIME64_3;
+    v ^= v >> 32;
+    return v;
+}
+
+static void init_lanes(uint64_t *acc)
+{
+    acc[0] = PRIME64_1;
+    acc[1] = PRIME64_2;
+    acc[2] = PRIME64_3;
+    acc[3] = PRIME32_1;
+}
+
+// Accumulates the last partial stripe of len bytes, zero padded, as the
+// stripe at index since the lanes were scrambled and mixes the lanes down
+// to the digest along with the total length.
+static uint64_t finish(uint64_t *acc, const uint8_t *last, uint32_t len,
+                       uint32_t index, uint64_t total_len)
+{
+    if (len > 0) {
+        uint8_t stripe[HASH64_STRIPE_SIZE] = {0};
+        memcpy(stripe, last, len);
+        accumulate_scalar(acc, stripe, 1, STRIPE_KEYS + index);
+    }
+
+    uint64_t v = total_len * PRIME64_1;
+    for (uint32_t i = 0; i < 4; i++) {
+        v = (v ^ acc[i] ^ SCRAMBLE_KEYS[i]) * PRIME64_2;
+        v ^= v >> 29;
+    }
+    return avalanche(v);
+}
+
+// Feeds whole stripes to the kernel, scrambling whenever enough of them
+// went in since the last time.
+static void accumulate(hash64_state *s, const uint8_t *data,
+                       size_t num_stripes)
+{
+    while (num_stripes > 0) {
+        size_t count = min(num_stripes,
+                           (size_t)(HASH64_SCRAMBLE_STRIPES - s->stripes));
+        _ctx.accumulate(s->acc, data, count, STRIPE_KEYS + s->stripes);
+        data += count * HASH64_STRIPE_SIZE;
+        num_stripes -= count;
+        s->stripes += (uint32_t)count;
+        if (s->stripes == HASH64_SCRAMBLE_STRIPES) {
+            scramble(s->acc);
+            s->stripes = 0;
+        }
+    }
+}
+
+void hash_init(void)
+{
+    _ctx.supported[HASH_KERNEL_SCALAR] = true;
+#ifdef HASH_X86
+    _ctx.supported[HASH_KERNEL_SSE2] = cpu_has_sse2();
+    _ctx.supported[HASH_KERNEL_AVX2] = _ctx.supported[HASH_KERNEL_SSE2] &&
+                                       cpu_has_avx2();
+#endif
+
+    for (int32_t k = HASH_KERNEL_COUNT - 1; k >= 0; k--) {
+        if (hash_set_kernel((hash_kernel)k)) {
+            break;
+        }
+    }
+}
+
+bool hash_set_kernel(hash_kernel kernel)
+{
+    assert(kernel < HASH_KERNEL_COUNT);
+
+    if (!_ctx.supported[kernel]) {
+        return false;
+    }
+
+    switch (kernel) {
+#ifdef HASH_X86
+        case HASH_KERNEL_AVX2:
+            _ctx.accumulate = accumulate_avx2;
+            break;
+        case HASH_KERNEL_SSE2:
+            _ctx.accumulate = accumulate_sse2;
+            break;
+#endif
+        default:
+            _ctx.accumulate = accumulate_scalar;
+            break;
+    }
+    _ctx.kernel = kernel;
+
+    return true;
+}
+
+hash_kernel hash_get_kernel(void)
+{
+    return _ctx.kernel;
+}
+
+const char* hash_kernel_name(hash_kernel kernel)
+{
+    switch (kernel) {
+        case HASH_KERNEL_SCALAR: return "scalar";
+        case HASH_KERNEL_SSE2: return "sse2";
+        case HASH_KERNEL_AVX2: return "avx2";
+        default: return "unknown";
+    }
+}
+
+void hash64_begin(hash64_state *s)
+{
+    assert(s);
+
+    init_lanes(s->acc);
+    s->buf_len = 0;
+    s->stripes = 0;
+    s->len = 0;
+}
+
+void hash64_update(hash64_state *s, const void *data, size_t len)
+{
+    assert(s);
+    assert(data || len == 0);
+
+    if (len == 0) {
+        return;
+    }
+
+    const uint8_t *bytes = data;
+    s->len += len;
+
+    // Top up a partial stripe first.
+    if (s->buf_len > 0) {
+        size_t count = min(len, (size_t)(HASH64_STRIPE_SIZE - s->buf_len));
+        memcpy(s->buf + s->buf_len, bytes, count);
+        s->buf_len += (uint32_t)count;
+        bytes += count;
+        len -= count;
+        if (s->buf_len < HASH64_STRIPE_SIZE) {
+            return;
+        }
+        accumulate(s, s->buf, 1);
+        s->buf_len = 0;
+    }
+
+    size_t num_stripes = len / HASH64_STRIPE_SIZE;
+    accumulate(s, bytes, num_stripes);
+    bytes += num_stripes * HASH64_STRIPE_SIZE;
+    len -= num_stripes * HASH64_STRIPE_SIZE;
+
+    memcpy(s->buf, bytes, len);
+    s->buf_len = (uint32_t)len;
+}
+
+uint64_t hash64_digest(const hash64_state *s)
+{
+    assert(s);
+
+    uint64_t acc[4];
+    memcpy(acc, s->acc, sizeof(acc));
+    return finish(acc, s->buf, s->buf_len, s->stripes, s->len);
+}
+
+// Short inputs, like command records, are common enough to skip the state.
+uint64_t hash64(const void *data, size_t len)
+{
+    if (len > HASH64_STRIPE_SIZE) {
+        hash64_state s;
+        hash64_begin(&s);
+        hash64_update(&s, data, len);
+        return hash64_digest(&s);
+    }
+
+    uint64_t acc[4];
+    init_lanes(acc);
+    return finish(acc, data, (uint32_t)len, 0, len);
+}
+
+uint64_t hash64_combine(uint64_t v, uint64_t digest)
+{
+    return avalanche((v * PRIME64_1) ^ digest);
+}
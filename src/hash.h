@@ -6,3 +6,50 @@
 
 // See https://en.wikipedia.org/wiki/Fowler–Noll–Vo_hash_function#FNV-1a_hash
 void hash(uint32_t *v, uint8_t *buf, size_t len);
+
+// A 64-bit content hash for data where collisions would go unnoticed, like
+// the tile cache of the renderer. Data is consumed in 32 byte stripes of
+// four 64-bit lanes. Each lane is keyed by its position in the stripe and
+// by the stripe's position since the last scramble. Lanes are mixed with a
+// 32x32 bit multiply so they fit in SIMD registers, and scrambled every 16
+// stripes. A partial last stripe is zero padded and the length is mixed in
+// when the digest is taken. Every kernel produces the same digests, and so
+// does hashing the same bytes in any number of updates.
+
+#define HASH64_INITIAL 0x27d4eb2f165667c5ull
+#define HASH64_STRIPE_SIZE 32
+
+typedef enum hash_kernel {
+    HASH_KERNEL_SCALAR,
+    HASH_KERNEL_SSE2,
+    HASH_KERNEL_AVX2,
+    HASH_KERNEL_COUNT
+} hash_kernel;
+
+typedef struct hash64_state {
+    uint64_t acc[4];
+    uint8_t buf[HASH64_STRIPE_SIZE];
+    uint32_t buf_len;
+    uint32_t stripes; // Since the lanes were last scrambled.
+    uint64_t len;
+} hash64_state;
+
+// Picks the fastest kernel the CPU supports. Hashing works before it is
+// called, with the scalar kernel.
+void hash_init(void);
+
+// Returns false if the CPU doesn't support the kernel.
+bool hash_set_kernel(hash_kernel kernel);
+hash_kernel hash_get_kernel(void);
+const char* hash_kernel_name(hash_kernel kernel);
+
+void hash64_begin(hash64_state *s);
+void hash64_update(hash64_state *s, const void *data, size_t len);
+uint64_t hash64_digest(const hash64_state *s);
+
+// The digest of len bytes of data in one go.
+uint64_t hash64(const void *data, size_t len);
+
+// Folds a digest into v, starting from HASH64_INITIAL, so that a sequence
+// of digests hashes differently in any other order.
+uint64_t hash64_combine(uint64_t v, uint64_t digest);
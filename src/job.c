@@ -0,0 +1,230 @@
+#include "job.h"
+
+#include <assert.h>
+
+#include "console.h"
+#include "thread.h"
+
+#define JOB_QUEUE_SIZE 1024
+
+typedef struct job {
+    job_fn fn;
+    void *data;
+} job;
+
+// The owner pops from the tail and thieves take from the head.
+typedef struct job_queue {
+    mutex lock;
+    job jobs[JOB_QUEUE_SIZE];
+    uint32_t head;
+    uint32_t tail;
+} job_queue;
+
+typedef struct job_ctx {
+    thread threads[MAX_JOB_WORKERS];
+    job_queue queues[MAX_JOB_WORKERS];
+    uint32_t num_workers;
+    uint32_t next_queue;
+
+    volatile int32_t queued;  // Jobs waiting in a queue.
+    volatile int32_t pending; // Jobs submitted but not finished.
+
+    mutex wake_lock;
+    cond_var wake; // Signalled when jobs are queued or on shutdown.
+    cond_var done; // Signalled when the last pending job finishes.
+    bool quit;
+
+    bool initialized;
+} job_ctx;
+
+static job_ctx _ctx;
+
+static bool push_job(uint32_t queue, const job *j);
+static bool take_job(uint32_t worker, job *dst);
+static void run_job(const job *j, uint32_t worker);
+static void worker_main(void *data);
+
+bool job_system_init(uint32_t num_threads)
+{
+    if (num_threads == 0) {
+        num_threads = get_core_count() - 1;
+    }
+    num_threads = min(num_threads, MAX_JOB_WORKERS - 1);
+
+    for (uint32_t i = 0; i < MAX_JOB_WORKERS; i++) {
+        mutex_init(&_ctx.queues[i].lock);
+    }
+    mutex_init(&_ctx.wake_lock);
+    cond_init(&_ctx.wake);
+    cond_init(&_ctx.done);
+    _ctx.quit = false;
+
+    _ctx.num_workers = num_threads + 1;
+    for (uint32_t i = 1; i <= num_threads; i++) {
+        void *worker = (void*)(uintptr_t)i;
+        if (!thread_start(&_ctx.threads[i], worker_main, worker)) {
+            console_log("Failed to start job worker %u", i);
+            _ctx.num_workers = i;
+            break;
+        }
+    }
+
+    _ctx.initialized = true;
+    return true;
+}
+
+void job_system_shutdown(void)
+{
+    assert(_ctx.initialized);
+
+    job_wait_all();
+
+    mutex_lock(&_ctx.wake_lock);
+    _ctx.quit = true;
+    cond_broadcast(&_ctx.wake);
+    mutex_unlock(&_ctx.wake_lock);
+
+    for (uint32_t i = 1; i < _ctx.num_workers; i++) {
+        thread_join(_ctx.threads[i]);
+    }
+
+    for (uint32_t i = 0; i < MAX_JOB_WORKERS; i++) {
+        mutex_destroy(&_ctx.queues[i].lock);
+    }
+    cond_destroy(&_ctx.done);
+    cond_destroy(&_ctx.wake);
+    mutex_destroy(&_ctx.wake_lock);
+
+    _ctx.num_workers = 0;
+    _ctx.initialized = false;
+}
+
+uint32_t job_worker_count(void)
+{
+    assert(_ctx.initialized);
+    return _ctx.num_workers;
+}
+
+void job_submit(job_fn fn, void *data)
+{
+    assert(_ctx.initialized);
+    assert(fn);
+
+    job j = { fn, data };
+
+    // Spread the jobs over the queues so every worker starts with some
+    // work before it has to steal.
+    atomic_add(&_ctx.pending, 1);
+    atomic_add(&_ctx.queued, 1);
+    for (uint32_t i = 0; i < _ctx.num_workers; i++) {
+        uint32_t queue = _ctx.next_queue++ % _ctx.num_workers;
+        if (push_job(queue, &j)) {
+            mutex_lock(&_ctx.wake_lock);
+            cond_signal(&_ctx.wake);
+            mutex_unlock(&_ctx.wake_lock);
+            return;
+        }
+    }
+
+    // Every queue is full.
+    atomic_add(&_ctx.queued, -1);
+    run_job(&j, 0);
+}
+
+void job_wait_all(void)
+{
+    assert(_ctx.initialized);
+
+    while (atomic_get(&_ctx.pending) > 0) {
+        job j;
+        if (take_job(0, &j)) {
+            run_job(&j, 0);
+            continue;
+        }
+
+        // Nothing left to steal, wait for the workers to finish up.
+        mutex_lock(&_ctx.wake_lock);
+        while (atomic_get(&_ctx.pending) > 0 &&
+               atomic_get(&_ctx.queued) == 0) {
+            cond_wait(&_ctx.done, &_ctx.wake_lock);
+        }
+        mutex_unlock(&_ctx.wake_lock);
+    }
+}
+
+static bool push_job(uint32_t queue, const job *j)
+{
+    job_queue *q = &_ctx.queues[queue];
+
+    mutex_lock(&q->lock);
+    bool result = q->tail - q->head < JOB_QUEUE_SIZE;
+    if (result) {
+        q->jobs[q->tail++ % JOB_QUEUE_SIZE] = *j;
+    }
+    mutex_unlock(&q->lock);
+
+    return result;
+}
+
+static bool take_job(uint32_t worker, job *dst)
+{
+    // Newest job first from our own queue.
+    job_queue *own = &_ctx.queues[worker];
+    mutex_lock(&own->lock);
+    bool result = own->tail != own->head;
+    if (result) {
+        *dst = own->jobs[--own->tail % JOB_QUEUE_SIZE];
+    }
+    mutex_unlock(&own->lock);
+
+    // Oldest job first from everyone else.
+    for (uint32_t i = 1; !result && i < _ctx.num_workers; i++) {
+        job_queue *q = &_ctx.queues[(worker + i) % _ctx.num_workers];
+        mutex_lock(&q->lock);
+        result = q->tail != q->head;
+        if (result) {
+            *dst = q->jobs[q->head++ % JOB_QUEUE_SIZE];
+        }
+        mutex_unlock(&q->lock);
+    }
+
+    if (result) {
+        atomic_add(&_ctx.queued, -1);
+    }
+    return result;
+}
+
+static void run_job(const job *j, uint32_t worker)
+{
+    j->fn(j->data, worker);
+
+    if (atomic_add(&_ctx.pending, -1) == 0) {
+        mutex_lock(&_ctx.wake_lock);
+        cond_broadcast(&_ctx.done);
+        mutex_unlock(&_ctx.wake_lock);
+    }
+}
+
+static void worker_main(void *data)
+{
+    uint32_t worker = (uint32_t)(uintptr_t)data;
+
+    for (;;) {
+        job j;
+        if (take_job(worker, &j)) {
+            run_job(&j, worker);
+            continue;
+        }
+
+        mutex_lock(&_ctx.wake_lock);
+        while (!_ctx.quit && atomic_get(&_ctx.queued) == 0) {
+            cond_wait(&_ctx.wake, &_ctx.wake_lock);
+        }
+        bool quit = _ctx.quit;
+        mutex_unlock(&_ctx.wake_lock);
+
+        if (quit) {
+            return;
+        }
+    }
+}
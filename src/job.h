@@ -0,0 +1,27 @@
+#pragma once
+
+#include "common.h"
+
+// A pool of worker threads that run small independent jobs. Each worker has
+// its own queue and steals from the other queues once it runs dry. The
+// thread that calls job_wait_all runs jobs as well and is worker 0.
+
+#define MAX_JOB_WORKERS 64
+
+// Called on a worker thread. worker is in [0, job_worker_count()) and is
+// unique among the jobs running at the same time.
+typedef void (*job_fn)(void *data, uint32_t worker);
+
+// Starts num_threads worker threads, or one per core besides the calling
+// thread when num_threads is 0.
+bool job_system_init(uint32_t num_threads);
+void job_system_shutdown(void);
+
+// Returns the number of workers including the thread calling job_wait_all.
+uint32_t job_worker_count(void);
+
+// Jobs are submitted from a single thread, the one that calls job_wait_all.
+void job_submit(job_fn fn, void *data);
+
+// Runs jobs until every submitted job has finished.
+void job_wait_all(void);
@@ -2,10 +2,12 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "eva/eva.h"
 
 #include "app.h"
+#include "capture.h"
 #include "console.h"
 #include "profiler.h"
 #include "render.h"
@@ -17,7 +19,21 @@ void init(void)
     profiler_init;
 
     render_init();
+#ifndef BG_LINUX
+    render_set_pipelined(true);
+#endif
     app_init();
+
+    // Records what is drawn for tools/replay.c.
+    const char *capture_path = getenv("BRISKGIT_CAPTURE");
+    if (capture_path) {
+        capture_start(capture_path);
+    }
+
+    // Checks every frame against a full redraw, see render_set_verify.
+    if (getenv("BRISKGIT_VERIFY")) {
+        render_set_verify(true, NULL, NULL);
+    }
 }
 
 static void handle_key(eva_key key, eva_input_action action,
@@ -40,8 +56,11 @@ static void handle_text(const uint16_t *utf16_text, uint32_t len,
 static void cleanup(void)
 {
     console_log("Cleaning up");
+    capture_stop();
     app_shutdown();
     render_shutdown();
+    console_shutdown();
+    text_system_shutdown();
 }
 
 static void fail(int error_code, const char *error_message)
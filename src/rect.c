@@ -98,6 +98,26 @@ bool rect_intersection(const rect *a, const rect *b, rect *dst)
     return false;
 }
 
+bool recti_contains(const recti *outer, const recti *inner)
+{
+    assert(outer);
+    assert(inner);
+
+    return inner->x >= outer->x && inner->y >= outer->y &&
+           inner->x + inner->w <= outer->x + outer->w &&
+           inner->y + inner->h <= outer->y + outer->h;
+}
+
+bool rect_contains(const rect *outer, const rect *inner)
+{
+    assert(outer);
+    assert(inner);
+
+    return inner->x >= outer->x && inner->y >= outer->y &&
+           inner->x + inner->w <= outer->x + outer->w &&
+           inner->y + inner->h <= outer->y + outer->h;
+}
+
 bool recti_point_intersect(const recti *r, const vec2i *v)
 {
     assert(r);
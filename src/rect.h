@@ -22,6 +22,10 @@ bool rect_overlap(const rect *a, const rect *b);
 bool recti_intersection(const recti *a, const recti *b, recti *dst);
 bool rect_intersection(const rect *a, const rect *b, rect *dst);
 
+// True if inner lies entirely within outer.
+bool recti_contains(const recti *outer, const recti *inner);
+bool rect_contains(const rect *outer, const rect *inner);
+
 bool recti_point_intersect(const recti *r, const vec2i *v);
 bool rect_point_intersect(const rect *r, const vec2 *v);
 
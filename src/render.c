@@ -3,6 +3,9 @@
 #include <assert.h>
 #include <blend2d/api.h>
 #include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define BL_STATIC
@@ -15,12 +18,21 @@
 
 #include "eva/eva.h"
 
+#include "arena.h"
+#include "capture.h"
 #include "color.h"
 #include "common.h"
+#include "console.h"
+#include "damage.h"
+#include "fill.h"
+#include "glyph_atlas.h"
 #include "hash.h"
+#include "job.h"
 #include "profiler.h"
 #include "rect.h"
 #include "text.h"
+#include "thread.h"
+#include "ustr.h"
 #include "vec2.h"
 
 typedef enum render_cmd_type {
@@ -28,312 +40,2444 @@ typedef enum render_cmd_type {
     RENDER_COMMAND_TEXT
 } render_cmd_type;
 
+// Commands are variable length records packed back to back. Coordinates
+// are 24.8 fixed point and colors are premultiplied RGBA8 in the PRGB32
+// layout of the framebuffer, which keeps the records small to copy and hash.
+#define RENDER_FIXED_SHIFT 8
+#define RENDER_FIXED_ONE (1 << RENDER_FIXED_SHIFT)
+#define RENDER_CMD_ALIGN 8
+
+typedef struct render_cmd {
+    uint16_t type;
+    uint16_t size; // Of the whole record including padding.
+} render_cmd;
+
 typedef struct render_cmd_rect {
-    rect rect;
-    color color;
+    render_cmd header;
+    recti rect; // Fixed point.
+    uint32_t color;
 } render_cmd_rect;
 
-#define MAX_TEXT_LEN 1000
 typedef struct render_cmd_text {
-    rect clip;
-    rect bbox;
-    text *t;
+    render_cmd header;
+    recti clip; // Fixed point.
+    recti bbox; // Fixed point.
+    text *t;    // Not hashed with the record, text_hash covers it.
 } render_cmd_text;
 
-typedef struct render_cmd {
-    render_cmd_type type;
-    union {
-        render_cmd_rect rect_cmd;
-        render_cmd_text text_cmd;
-    };
-} render_cmd;
+// Records are packed into pages allocated from a per frame arena, so
+// recording stops calling malloc once the arena has grown to fit the UI.
+#define RENDER_CMD_PAGE_SIZE (16 * 1024)
+#define RENDER_ARENA_CHUNK_SIZE (256 * 1024)
+typedef struct render_cmd_page {
+    struct render_cmd_page *next;
+    uint32_t used;
+} render_cmd_page;
+
+typedef struct render_cmd_list {
+    arena *arena;
+    render_cmd_page *first;
+    render_cmd_page *last;
+    uint32_t count;
+    size_t bytes;
+} render_cmd_list;
+
+typedef struct render_cmd_iter {
+    const render_cmd_page *page;
+    uint32_t offset;
+} render_cmd_iter;
 
-#define RENDER_COMMAND_QUEUE_SIZE 1000
 typedef struct render_cmd_ctx {
-    render_cmd cmds1[RENDER_COMMAND_QUEUE_SIZE];
-    render_cmd cmds2[RENDER_COMMAND_QUEUE_SIZE];
-    int32_t cmds_index1;
-    int32_t cmds_index2;
-
-    render_cmd *current;
-    render_cmd *previous;
-    int32_t *curr_index;
-    int32_t *prev_index;
+    render_cmd_list lists[2];
+    render_cmd_list *current;
+    render_cmd_list *previous;
+
+    uint32_t last_cmds;
+    uint32_t max_cmds;
+    size_t last_bytes;
+    uint32_t culled_draws;
+    uint64_t culled_pixels;
 } render_cmd_ctx;
 static render_cmd_ctx _render_cmd_ctx;
 
-static BLContextCore _bl_ctx;
-static BLImageCore _bl_img;
+typedef struct render_stats_ctx {
+    render_frame_stats last;
+    text_cache_stats text; // When the last frame ended.
+} render_stats_ctx;
+static render_stats_ctx _stats;
+
+#define TILE_SIZE_DEFAULT 96
+#define TILE_SIZE_MIN 32
+#define TILE_SIZE_MAX 256
+
+// Frames with damage observed before the adaptive tile size is reconsidered
+// and the average dirty tiles per frame below which tiles are made smaller.
+#define TILE_ADAPT_FRAMES 120
+#define TILE_ADAPT_SHRINK_TILES 8
+
+// The tile grid is sized from the framebuffer and rebuilt whenever the
+// framebuffer or the tile size changes, which redraws every tile once.
+typedef struct render_tiles {
+    uint32_t size; // Tile size for the next frame.
+    bool adaptive;
+
+    // What the current grid was built for.
+    uint32_t grid_size;
+    uint32_t fb_w;
+    uint32_t fb_h;
+    bool valid; // False until the framebuffer matches the hashes.
+
+    uint32_t capacity;
+    uint64_t *hashes;
+    uint64_t *prev_hashes;
+
+    // Damage seen since the tile size was last adapted.
+    uint32_t adapt_frames;
+    uint64_t adapt_dirty_tiles;
+} render_tiles;
+static render_tiles _tiles;
+
+// Layers are drawn into pixel buffers of their own and composited over the
+// rest of the frame, so a layer and what lies beneath it are only redrawn
+// when their own commands change. Tiles are drawn into targets: target 0
+// holds everything outside of layers and target i + 1 layer i. Each target
+// has its own hashes, bins and dirty flags in the tile grid, stored one
+// grid after the other.
+#define RENDER_MAX_LAYERS 4
+#define RENDER_MAX_TARGETS (RENDER_MAX_LAYERS + 1)
+
+typedef struct render_layer_ctx {
+    // The buffers are framebuffer sized so their tiles line up with the
+    // framebuffer. Pages a layer never draws to are never touched. The
+    // first one holds the base while layers are composited.
+    eva_framebuffer buffers[RENDER_MAX_TARGETS];
+    uint32_t num_targets; // Of the last frame.
+
+    // The commands of the layers recorded for the current frame.
+    uint32_t first_cmd[RENDER_MAX_LAYERS];
+    uint32_t end_cmd[RENDER_MAX_LAYERS];
+    uint32_t count;
+    bool active;    // Between render_begin_layer and render_end_layer.
+    bool recording; // False once out of layers.
+} render_layer_ctx;
+static render_layer_ctx _layers;
+
+// A scroll region moves the pixels it drew on the last frame by the change
+// in its scroll offset and only redraws what that exposes. Its commands are
+// hashed into tiles of its content instead of the tile grid, so they keep
+// their hashes while they scroll. See render_begin_scroll.
+#define RENDER_MAX_SCROLLS 8
+#define SCROLL_TILE_SIZE 32
+
+typedef struct render_blit {
+    uint32_t target;
+    recti dst;
+    vec2i delta; // The source is dst moved by delta.
+} render_blit;
+
+typedef struct render_scroll {
+    uint32_t target;
+    recti region; // Clipped to the framebuffer.
+    vec2i offset; // Content pixel shown at the top left of the region.
+    uint32_t first_cmd;
+    uint32_t end_cmd;
+    bool covered; // Commands after the region draw over it.
+    bool valid;   // The content hashes were taken.
+
+    // Hashes of the content tiles the region shows, in content tiles.
+    recti tiles;
+    uint64_t *hashes;
+    uint32_t capacity;
+} render_scroll;
+
+typedef struct render_scroll_ctx {
+    render_scroll frames[2][RENDER_MAX_SCROLLS];
+    uint32_t counts[2];
+    uint32_t current; // The frame being recorded, the other one is the last.
+
+    // Between render_begin_scroll and render_end_scroll everything is
+    // clipped to the region, recording is NULL when it isn't tracked.
+    bool active;
+    recti clip;
+    render_scroll *recording;
+
+    uint64_t blit_pixels;
+} render_scroll_ctx;
+static render_scroll_ctx _scroll;
+
+// A glyph mask fill resolved from the atlas before the tiles are rendered,
+// since neither text layout nor the atlas can be used from the workers.
+typedef struct render_glyph {
+    const BLImageCore *page;
+    BLRectI area;
+    BLPointI origin;
+    uint32_t color; // Premultiplied like the commands.
+} render_glyph;
+
+typedef struct render_glyph_range {
+    uint32_t first;
+    uint32_t count;
+    bool prepared;
+} render_glyph_range;
+
+// Per frame state shared with the tile jobs. It is only written before the
+// jobs are submitted.
+typedef struct render_frame {
+    eva_framebuffer fb;
+    uint32_t tile_size;
+    uint32_t tiles_x;
+    uint32_t tiles_y;
+
+    // What the targets are drawn to. Without layers the only target is the
+    // framebuffer itself, with them the damaged tiles are composited from
+    // the target buffers into the framebuffer.
+    eva_framebuffer targets[RENDER_MAX_TARGETS];
+    uint32_t num_targets;
+    bool composite;
+
+    // The records in submission order, the area they draw to, the tiles
+    // they overlap, in tile coordinates, and the target they belong to.
+    // Allocated from the arena of the commands.
+    const render_cmd **cmds;
+    rect *cmd_bounds;
+    recti *cmd_tiles;
+    uint8_t *cmd_targets;
+
+    // Commands binned into the tiles they overlap, in submission order.
+    // The bin of tile i is bins[bin_offsets[i]] to bins[bin_offsets[i + 1]],
+    // where tile t * tiles of target t onwards are the tiles of target t.
+    // Culling moves the commands left to draw to the end of the bin and
+    // bin_starts[i] to the first of them. The per tile arrays are sized
+    // along with the tile grid.
+    uint32_t *bin_offsets;
+    uint32_t *bin_starts;
+    uint32_t *bins;
+    size_t bins_cap;
 
-#define MAX_TILE_CACHE_X 80
-#define MAX_TILE_CACHE_Y 50
-#define TILE_SIZE 96
-static uint32_t _tile_cache1[MAX_TILE_CACHE_X * MAX_TILE_CACHE_Y];
-static uint32_t _tile_cache2[MAX_TILE_CACHE_X * MAX_TILE_CACHE_Y];
-static uint32_t *_tile_cache;
-static uint32_t *_prev_tile_cache;
+    bool *dirty;   // Tiles of each target that are drawn.
+    bool *damaged; // Tiles of the grid that are composited and presented.
+
+    render_glyph_range *text_glyphs; // Allocated like cmd_tiles.
+    render_glyph *glyphs;
+    size_t num_glyphs;
+    size_t glyphs_cap;
+
+    // Pixels moved by the scroll regions before the dirty tiles are drawn.
+    render_blit blits[RENDER_MAX_SCROLLS];
+    uint32_t num_blits;
+
+    // Written by draw_tiles, which may run on the render thread.
+    double raster_ms;
+    double composite_ms;
+    uint32_t sync_flushes;
+} render_frame;
+static render_frame _frame;
+
+// Consecutive rects of the same color are filled with a single call. The
+// clip and comp op are set once per tile so they are shared by all of them.
+// Batches of rects that lie on whole pixels skip blend2d and are filled
+// straight into the framebuffer by fill.c, clipped to the tile by hand.
+#define RENDER_RECT_BATCH_SIZE 128
+typedef struct render_rect_batch {
+    BLRect rects[RENDER_RECT_BATCH_SIZE];
+    uint32_t count;
+    uint32_t color;
+    rect bounds;
+    bool aligned;
+    recti clip;
+    const eva_framebuffer *target;
+} render_rect_batch;
+
+// Every worker renders its tiles through its own synchronous context on an
+// image that wraps the target buffer, one per target. They are kept across
+// frames and only recreated when the buffer changes, see update_workers.
+typedef struct render_worker_target {
+    BLImageCore img;
+    BLContextCore ctx;
+    bool created;
+    bool used; // Rendered to during the current frame.
+} render_worker_target;
+
+typedef struct render_worker {
+    render_worker_target targets[RENDER_MAX_TARGETS];
+    render_rect_batch batch;
+} render_worker;
+static render_worker _workers[MAX_JOB_WORKERS];
+static eva_framebuffer _worker_targets[RENDER_MAX_TARGETS];
+
+// In verify mode every frame is also drawn from scratch into buffers of its
+// own, on the main thread, and compared with what the incremental redraw
+// left in the framebuffer. See render_set_verify.
+#define RENDER_VERIFY_MAX_TILES 8 // Tiles reported per frame.
+#define RENDER_VERIFY_MAX_CMDS 32 // Commands reported per tile and target.
+
+typedef struct render_verify_ctx {
+    bool enabled;
+    render_verify_fn fn;
+    void *user_data;
+
+    // The targets drawn from scratch and the frame they composite to when
+    // there are layers.
+    eva_framebuffer targets[RENDER_MAX_TARGETS];
+    eva_framebuffer composite;
+    render_worker_target contexts[RENDER_MAX_TARGETS];
+    render_rect_batch batch;
+} render_verify_ctx;
+static render_verify_ctx _verify;
+
+// In pipelined mode the tiles of a frame are rendered on the render thread
+// while the main thread records the next one. Everything the tile jobs read
+// is resolved before the frame is handed over, so text can be released and
+// edited right away, and the main thread only touches the frame state again
+// after waiting for the render thread to finish it.
+typedef struct render_pipeline {
+    bool enabled;
+    thread thread;
+    mutex lock;
+    cond_var wake; // Signalled when a frame is handed over or on shutdown.
+    cond_var done; // Signalled when the render thread finishes a frame.
+    bool busy;
+    bool quit;
+
+    // The render thread draws into its own surface since eva presents its
+    // framebuffer while the next frame is rendered. The damage of a frame is
+    // copied over once it is finished.
+    eva_framebuffer surface;
+    damage_list damage;
+    bool present;
+} render_pipeline;
+static render_pipeline _pipeline;
 
 static void clip_to_framebuffer(rect *r);
+static bool clip_to_scroll(rect *r);
+static uint64_t hash_cmd(const render_cmd *cmd);
+static bool reset_scroll_hashes(render_scroll *s);
+static void hash_scrolled_cmd(render_scroll *s, const render_cmd *cmd,
+                              const rect *bounds);
+static void update_scroll_damage(uint32_t num_cmds);
+static void mark_dirty_rect(uint32_t target, const recti *r);
+static void mark_damaged_rect(const recti *r);
+static void blit_scrolls(void);
+static bool get_tile_rect(uint32_t tile, rect *dst);
+static double stage_ms(uint64_t *stage);
+static void cull_tile(uint32_t key);
+static bool update_tile_grid(const eva_framebuffer *fb);
+static void adapt_tile_size(uint32_t num_dirty, uint32_t num_tiles);
+static bool update_layers(void);
+static bool update_target(eva_framebuffer *buffer, const eva_framebuffer *fb);
+static void update_workers(void);
+static void destroy_workers(uint32_t target);
+static void destroy_worker_target(render_worker_target *wt);
+static void draw_tiles(void);
+static uint32_t verify_frame(uint64_t frame, uint32_t num_cmds,
+                             bool glyphs_reset);
+static void free_verify_buffers(void);
+static bool start_render_thread(void);
+static void stop_render_thread(void);
+static void wait_for_render_thread(void);
+static void render_thread_main(void *data);
+static bool update_surface(const eva_framebuffer *fb);
+static void present_damage(const eva_framebuffer *fb);
+static int32_t to_fixed(double v);
+static recti to_fixed_rect(const rect *r);
+static rect from_fixed_rect(const recti *r);
+static uint32_t to_prgb32(const color *c);
+static BLRgba from_prgb32(uint32_t c);
+static void* push_cmd(render_cmd_list *list, render_cmd_type type,
+                      size_t size);
+static void reset_cmds(render_cmd_list *list);
+static void cmd_iter_init(const render_cmd_list *list, render_cmd_iter *it);
+static const render_cmd* cmd_iter_next(render_cmd_iter *it);
+static void push_rect(const rect *r, const color *c);
 
-void draw_rect(const render_cmd_rect *cmd, const rect *clip_rect)
+// Called from the workers so these don't use the profiler, which is single
+// threaded.
+static void flush_rects(BLContextCore *ctx, render_rect_batch *batch)
 {
-    profiler_begin;
+    if (batch->count == 0) {
+        return;
+    }
 
-    blContextClipToRectD(&_bl_ctx, (BLRect*)clip_rect);
-    blContextSetCompOp(&_bl_ctx, BL_COMP_OP_SRC_OVER);
-    blContextSetFillStyleRgba(&_bl_ctx, (BLRgba*)&cmd->color);
-    blContextFillRectD(&_bl_ctx, (BLRect*)&cmd->rect);
-    blContextRestoreClipping(&_bl_ctx);
+    // The contexts are synchronous so everything drawn through them before
+    // has already landed in the framebuffer.
+    if (batch->aligned) {
+        for (uint32_t i = 0; i < batch->count; i++) {
+            const BLRect *b = &batch->rects[i];
+            recti r = { (int32_t)b->x, (int32_t)b->y,
+                        (int32_t)b->w, (int32_t)b->h };
+            if (recti_intersection(&batch->clip, &r, &r)) {
+                fill_rect((uint32_t*)batch->target->pixels,
+                          batch->target->pitch, &r, batch->color);
+            }
+        }
+        batch->count = 0;
+        return;
+    }
 
-    profiler_end;
+    BLRgba fill_color = from_prgb32(batch->color);
+    BLArrayView rects = { batch->rects, batch->count };
+    blContextSetFillStyleRgba(ctx, &fill_color);
+    blContextFillGeometry(ctx, BL_GEOMETRY_TYPE_ARRAY_VIEW_RECTD, &rects);
+    batch->count = 0;
 }
 
-void draw_text(render_cmd_text *cmd, const rect *clip_rect)
+// The rects of a batch are filled as one shape, so overlapping areas are
+// only blended once. That makes no difference for opaque rects but a
+// translucent rect overlapping the batch has to start a new one.
+static void draw_rect(BLContextCore *ctx, render_rect_batch *batch,
+                      const render_cmd_rect *cmd)
 {
-    profiler_begin;
-#ifdef BG_MACOS
-    text_draw(cmd->t, &cmd->bbox, clip_rect);
-#elif BG_WINDOWS
-#endif
-    profiler_end;
+    rect r = from_fixed_rect(&cmd->rect);
+    if (batch->count > 0) {
+        rect overlap;
+        bool translucent = cmd->color >> 24 != 0xff;
+        if (cmd->color != batch->color ||
+            batch->count == RENDER_RECT_BATCH_SIZE ||
+            (translucent && rect_intersection(&batch->bounds, &r, &overlap))) {
+            flush_rects(ctx, batch);
+        }
+    }
+
+    const recti *f = &cmd->rect;
+    bool aligned = ((f->x | f->y | f->w | f->h) & (RENDER_FIXED_ONE - 1)) == 0;
+    if (batch->count == 0) {
+        batch->color = cmd->color;
+        batch->bounds = r;
+        batch->aligned = aligned;
+    }
+    else {
+        rect_union(&batch->bounds, &r, &batch->bounds);
+        batch->aligned = batch->aligned && aligned;
+    }
+    batch->rects[batch->count++] = (BLRect){ r.x, r.y, r.w, r.h };
 }
 
-bool render_init(void)
+// Clips to the text on top of the tile clip.
+static void draw_text(BLContextCore *ctx, const render_glyph_range *range,
+                      const rect *clip_rect)
 {
-    _render_cmd_ctx.current = _render_cmd_ctx.cmds1;
-    _render_cmd_ctx.previous = _render_cmd_ctx.cmds2;
-    _render_cmd_ctx.curr_index = &_render_cmd_ctx.cmds_index1;
-    _render_cmd_ctx.prev_index = &_render_cmd_ctx.cmds_index2;
+    blContextSave(ctx, NULL);
+    blContextClipToRectD(ctx, (BLRect*)clip_rect);
 
-    _tile_cache = _tile_cache1;
-    _prev_tile_cache = _tile_cache2;
+    for (uint32_t i = 0; i < range->count; i++) {
+        const render_glyph *g = &_frame.glyphs[range->first + i];
+        if (i == 0 || g->color != g[-1].color) {
+            BLRgba fill_color = from_prgb32(g->color);
+            blContextSetFillStyleRgba(ctx, &fill_color);
+        }
+        blContextFillMaskI(ctx, &g->origin, g->page, &g->area);
+    }
 
-    // Initialize the tile caches.
-    for (uint32_t y = 0; y < MAX_TILE_CACHE_Y; y++)
-    {
-        for (uint32_t x = 0; x < MAX_TILE_CACHE_X; x++)
-        {
-            uint32_t tile_index = x + y * MAX_TILE_CACHE_X;
-            _tile_cache[tile_index] = HASH_INITIAL;
-            _prev_tile_cache[tile_index] = HASH_INITIAL;
+    blContextRestore(ctx, NULL);
+}
+
+static void add_glyph(const font_face *face, const color *c,
+                      uint32_t glyph, double x, double y, void *user_data)
+{
+    (void)user_data;
+
+    glyph_atlas_entry e;
+    if (!glyph_atlas_get(face, glyph, x, &e) || e.w == 0) {
+        return;
+    }
+
+    if (_frame.num_glyphs == _frame.glyphs_cap) {
+        size_t cap = max(_frame.glyphs_cap * 2, 1024);
+        render_glyph *glyphs = realloc(_frame.glyphs,
+                                       cap * sizeof(render_glyph));
+        if (!glyphs) {
+            return;
         }
+        _frame.glyphs = glyphs;
+        _frame.glyphs_cap = cap;
     }
 
-    return true;
+    render_glyph *g = &_frame.glyphs[_frame.num_glyphs++];
+    g->page = glyph_atlas_page(e.page);
+    g->area = (BLRectI){ e.x, e.y, e.w, e.h };
+    g->origin = (BLPointI){
+        (int32_t)floor(x) + e.left,
+        (int32_t)floor(y + 0.5) - e.top,
+    };
+    g->color = to_prgb32(c);
 }
 
-void render_shutdown(void)
+static void prepare_text(uint32_t index, const render_cmd_text *cmd)
 {
+    render_glyph_range *range = &_frame.text_glyphs[index];
+    if (range->prepared) {
+        return;
+    }
+
+    rect bbox = from_fixed_rect(&cmd->bbox);
+    range->first = (uint32_t)_frame.num_glyphs;
+    text_glyphs(cmd->t, &bbox, add_glyph, NULL);
+    range->count = (uint32_t)_frame.num_glyphs - range->first;
+    range->prepared = true;
 }
 
-void render_begin_frame(void)
+// Returns the milliseconds since stage and moves it to now.
+static double stage_ms(uint64_t *stage)
 {
+    uint64_t now = eva_time_now();
+    double ms = eva_time_elapsed_ms(*stage, now);
+    *stage = now;
+    return ms;
 }
 
-static void update_tile_cache(const rect *r, uint32_t hash_value)
+// The framebuffer area covered by a tile.
+static bool get_tile_rect(uint32_t tile, rect *dst)
 {
-    recti rounded_rect = rect_round(r);
-    int32_t x1 = rounded_rect.x / TILE_SIZE;
-    int32_t y1 = rounded_rect.y / TILE_SIZE;
-    int32_t x2 = (rounded_rect.x + rounded_rect.w) / TILE_SIZE;
-    int32_t y2 = (rounded_rect.y + rounded_rect.h) / TILE_SIZE;
-    for (int32_t y = y1; y <= y2; y++) {
-        for (int32_t x = x1; x <= x2; x++) {
-            uint32_t *v = &_tile_cache[x + y * MAX_TILE_CACHE_X];
-            hash(v, (uint8_t*)&hash_value, sizeof(hash_value));
-        }
-    }
+    rect tile_rect = {
+        .x = (tile % _frame.tiles_x) * _frame.tile_size,
+        .y = (tile / _frame.tiles_x) * _frame.tile_size,
+        .w = _frame.tile_size,
+        .h = _frame.tile_size,
+    };
+    rect fb_rect = { 0, 0, _frame.fb.w, _frame.fb.h };
+    return rect_intersection(&tile_rect, &fb_rect, dst);
 }
 
-void render_end_frame(void)
+// Draws the commands of a bin from first on into its tile of target
+// through wt, which wraps the target once created. Layer tiles are cleared
+// to transparent first.
+static void draw_tile(const eva_framebuffer *target, render_worker_target *wt,
+                      render_rect_batch *batch, uint32_t key, uint32_t first)
 {
-    profiler_begin;
+    uint32_t num_tiles = _frame.tiles_x * _frame.tiles_y;
+    uint32_t tile = key % num_tiles;
 
-    eva_framebuffer fb = eva_get_framebuffer();
+    if (!wt->created) {
+        blImageInit(&wt->img);
+        blImageCreateFromData(&wt->img,
+                              (int32_t)target->w, (int32_t)target->h,
+                              BL_FORMAT_PRGB32, target->pixels,
+                              target->pitch * sizeof(eva_pixel),
+                              BL_DATA_ACCESS_RW, NULL, NULL);
+
+        BLContextCreateInfo create_info = {0};
+        create_info.threadCount = 0;
+        blContextInitAs(&wt->ctx, &wt->img, &create_info);
+        wt->created = true;
+    }
+    wt->used = true;
 
-    rect dirty_rect = {0};
+    rect tile_rect;
+    if (!get_tile_rect(tile, &tile_rect)) {
+        return;
+    }
 
-    // Process current queue.
-    int32_t num_cmds = *_render_cmd_ctx.curr_index;
-    for (int32_t i = 0; i < num_cmds; i++)
-    {
-        uint32_t cmd_hash = HASH_INITIAL;
-        render_cmd *cmd = &_render_cmd_ctx.current[i];
-        hash(&cmd_hash, (uint8_t*)cmd, sizeof(*cmd));
-        if (cmd->type == RENDER_COMMAND_RECT) {
-            update_tile_cache(&cmd->rect_cmd.rect, cmd_hash);
-        }
-        else if (cmd->type == RENDER_COMMAND_TEXT) {
-            text_hash(cmd->text_cmd.t, &cmd_hash);
-            update_tile_cache(&cmd->text_cmd.bbox, cmd_hash);
-        }
-    }
-
-    // Merge all the dirty rects into 1 rect.
-    // This can be dangerous if we have pixels
-    // that are frequently changing on opposite
-    // corners of the screen.
-    // TODO: Consider only merging adjacent rects.
-    uint32_t max_x = fb.w / TILE_SIZE + 1;
-    uint32_t max_y = fb.h / TILE_SIZE + 1;
-    bool first_difference = true;
-    for (uint32_t y = 0; y < max_y; y++)
-    {
-        for (uint32_t x = 0; x < max_x; x++)
-        {
-            uint32_t tile_index = x + y * MAX_TILE_CACHE_X;
-            uint32_t curr = _tile_cache[tile_index];
-            uint32_t prev = _prev_tile_cache[tile_index];
-            if (curr != prev)
-            {
-                rect region = {
-                    .x = x * TILE_SIZE,
-                    .y = y * TILE_SIZE,
-                    .w = TILE_SIZE,
-                    .h = TILE_SIZE,
-                };
+    batch->count = 0;
+    batch->clip = rect_round(&tile_rect);
+    batch->target = target;
 
-                if (first_difference)
-                {
-                    first_difference = false;
-                    dirty_rect = region;
-                }
-                else
-                {
-                    rect_union(&dirty_rect, &region, &dirty_rect); 
+    if (key >= num_tiles) {
+        const recti *r = &batch->clip;
+        for (int32_t y = r->y; y < r->y + r->h; y++) {
+            memset(&target->pixels[(uint32_t)y * target->pitch + (uint32_t)r->x],
+                   0, (size_t)r->w * sizeof(eva_pixel));
+        }
+    }
+
+    BLContextCore *ctx = &wt->ctx;
+    blContextSetCompOp(ctx, BL_COMP_OP_SRC_OVER);
+    blContextClipToRectD(ctx, (BLRect*)&tile_rect);
+
+    for (uint32_t i = first; i < _frame.bin_offsets[key + 1]; i++) {
+        uint32_t index = _frame.bins[i];
+        const render_cmd *cmd = _frame.cmds[index];
+        switch (cmd->type) {
+            case RENDER_COMMAND_RECT:
+                draw_rect(ctx, batch, (const render_cmd_rect*)cmd);
+                break;
+            case RENDER_COMMAND_TEXT: {
+                const render_cmd_text *text_cmd = (const render_cmd_text*)cmd;
+                rect clip = from_fixed_rect(&text_cmd->clip);
+                if (rect_intersection(&tile_rect, &clip, &clip)) {
+                    flush_rects(ctx, batch);
+                    draw_text(ctx, &_frame.text_glyphs[index], &clip);
                 }
+                break;
             }
+        }
+    }
+
+    flush_rects(ctx, batch);
+    blContextRestoreClipping(ctx);
+}
+
+// Draws one tile of a target, given as its index in the tiles of all
+// targets.
+static void render_tile(void *data, uint32_t worker)
+{
+    uint32_t key = (uint32_t)(uintptr_t)data;
+    uint32_t target = key / (_frame.tiles_x * _frame.tiles_y);
+    render_worker *w = &_workers[worker];
+    draw_tile(&_frame.targets[target], &w->targets[target], &w->batch, key,
+              _frame.bin_starts[key]);
+}
+
+// Copies the base of a tile from the targets to dst and blends the layers
+// over it.
+static void composite_to(const eva_framebuffer *dst,
+                         const eva_framebuffer *targets, uint32_t tile)
+{
+    rect tile_rect;
+    if (!get_tile_rect(tile, &tile_rect)) {
+        return;
+    }
+
+    recti r = rect_round(&tile_rect);
+    const eva_framebuffer *base = &targets[0];
+    for (int32_t y = r.y; y < r.y + r.h; y++) {
+        memcpy(&dst->pixels[(uint32_t)y * dst->pitch + (uint32_t)r.x],
+               &base->pixels[(uint32_t)y * base->pitch + (uint32_t)r.x],
+               (size_t)r.w * sizeof(eva_pixel));
+    }
 
-            _prev_tile_cache[tile_index] = HASH_INITIAL;
+    // Layers with nothing in the tile were left transparent.
+    uint32_t num_tiles = _frame.tiles_x * _frame.tiles_y;
+    for (uint32_t t = 1; t < _frame.num_targets; t++) {
+        uint32_t key = t * num_tiles + tile;
+        if (_frame.bin_offsets[key] == _frame.bin_offsets[key + 1]) {
+            continue;
         }
+        const eva_framebuffer *layer = &targets[t];
+        fill_composite((uint32_t*)dst->pixels, dst->pitch,
+                       (const uint32_t*)layer->pixels, layer->pitch, &r);
     }
+}
 
-    if (!rect_is_empty(&dirty_rect))
-    {
-        blImageInit(&_bl_img);
-        blImageCreateFromData(&_bl_img, (int32_t)fb.w, (int32_t)fb.h, 
-                BL_FORMAT_PRGB32, fb.pixels,
-                fb.pitch * sizeof(eva_pixel),
-                0, 0);
+// Composites a damaged tile into the framebuffer.
+static void composite_tile(void *data, uint32_t worker)
+{
+    (void)worker;
+    composite_to(&_frame.fb, _frame.targets, (uint32_t)(uintptr_t)data);
+}
 
-        BLContextCreateInfo create_info = {0};
-        create_info.threadCount = 2;
-        blContextInitAs(&_bl_ctx, &_bl_img, &create_info);
+bool render_init(void)
+{
+    for (uint32_t i = 0; i < array_size(_render_cmd_ctx.lists); i++) {
+        render_cmd_list *list = &_render_cmd_ctx.lists[i];
+        list->arena = arena_create(RENDER_ARENA_CHUNK_SIZE);
+        if (!list->arena) {
+            return false;
+        }
+    }
+    _render_cmd_ctx.current = &_render_cmd_ctx.lists[0];
+    _render_cmd_ctx.previous = &_render_cmd_ctx.lists[1];
+
+    _tiles.size = TILE_SIZE_DEFAULT;
+    _tiles.adaptive = true;
+
+    if (!glyph_atlas_init(GLYPH_ATLAS_DEFAULT_BUDGET)) {
+        return false;
+    }
+
+    fill_init();
+    hash_init();
+
+    // One worker per core.
+    if (!job_system_init(0)) {
+        return false;
+    }
+
+    return true;
+}
+
+void render_shutdown(void)
+{
+    if (_pipeline.enabled) {
+        stop_render_thread();
+    }
+    free(_pipeline.surface.pixels);
+    memset(&_pipeline, 0, sizeof(_pipeline));
+
+    for (uint32_t t = 0; t < RENDER_MAX_TARGETS; t++) {
+        destroy_workers(t);
+        free(_layers.buffers[t].pixels);
+    }
+    memset(_worker_targets, 0, sizeof(_worker_targets));
+    memset(&_layers, 0, sizeof(_layers));
+    free_verify_buffers();
+    memset(&_verify, 0, sizeof(_verify));
+    job_system_shutdown();
+    glyph_atlas_shutdown();
+
+    free(_frame.bin_offsets);
+    free(_frame.bin_starts);
+    free(_frame.bins);
+    free(_frame.dirty);
+    free(_frame.damaged);
+    free(_frame.glyphs);
+    memset(&_frame, 0, sizeof(_frame));
+
+    free(_tiles.hashes);
+    free(_tiles.prev_hashes);
+    memset(&_tiles, 0, sizeof(_tiles));
+
+    for (uint32_t f = 0; f < array_size(_scroll.frames); f++) {
+        for (uint32_t i = 0; i < RENDER_MAX_SCROLLS; i++) {
+            free(_scroll.frames[f][i].hashes);
+        }
+    }
+    memset(&_scroll, 0, sizeof(_scroll));
 
-        for (int32_t i = 0; i < num_cmds; i++)
+    // A frame that was begun but never ended still holds its texts.
+    if (_render_cmd_ctx.current) {
+        render_cmd_iter it;
+        cmd_iter_init(_render_cmd_ctx.current, &it);
+        for (const render_cmd *cmd = cmd_iter_next(&it); cmd;
+             cmd = cmd_iter_next(&it))
         {
-            render_cmd *cmd = &_render_cmd_ctx.current[i];
-            switch (cmd->type)
-            {
-                case RENDER_COMMAND_RECT:
-                    draw_rect(&cmd->rect_cmd, &dirty_rect);
-                    break;
-                case RENDER_COMMAND_TEXT:
-                    blContextFlush(&_bl_ctx, BL_CONTEXT_FLUSH_SYNC);
-                    rect clip;
-                    rect_intersection(&dirty_rect, &cmd->text_cmd.clip, &clip);
-                    draw_text(&cmd->text_cmd, &clip);
-                    break;
+            if (cmd->type == RENDER_COMMAND_TEXT) {
+                text_destroy(((const render_cmd_text*)cmd)->t);
             }
         }
+    }
 
-        blContextEnd(&_bl_ctx);
-        blContextDestroy(&_bl_ctx);
-        blImageDestroy(&_bl_img);
+    for (uint32_t i = 0; i < array_size(_render_cmd_ctx.lists); i++) {
+        render_cmd_list *list = &_render_cmd_ctx.lists[i];
+        if (list->arena) {
+            arena_destroy(list->arena);
+        }
     }
+    memset(&_render_cmd_ctx, 0, sizeof(_render_cmd_ctx));
+}
 
+void render_cmd_stats_get(render_cmd_stats *dst)
+{
+    assert(dst);
 
-    // Release the reference we took when adding the render text commands.
-    for (int32_t i = 0; i < num_cmds; i++)
-    {
-        render_cmd *cmd = &_render_cmd_ctx.current[i];
-        if (cmd->type == RENDER_COMMAND_TEXT) {
-            text_destroy(cmd->text_cmd.t);
+    arena_stats current, previous;
+    arena_stats_get(_render_cmd_ctx.current->arena, &current);
+    arena_stats_get(_render_cmd_ctx.previous->arena, &previous);
+
+    dst->num_cmds = _render_cmd_ctx.last_cmds;
+    dst->max_cmds = _render_cmd_ctx.max_cmds;
+    dst->cmd_bytes = _render_cmd_ctx.last_bytes;
+    dst->culled_draws = _render_cmd_ctx.culled_draws;
+    dst->culled_pixels = _render_cmd_ctx.culled_pixels;
+    dst->scrolled_pixels = _scroll.blit_pixels;
+    dst->arena_high_water = max(current.high_water, previous.high_water);
+    dst->arena_capacity = current.capacity + previous.capacity;
+}
+
+void render_frame_stats_get(render_frame_stats *dst)
+{
+    assert(dst);
+    *dst = _stats.last;
+}
+
+void render_begin_frame(void)
+{
+    if (capture_active()) {
+        eva_framebuffer fb = eva_get_framebuffer();
+        capture_write(&(capture_cmd){
+            .op = CAPTURE_OP_FRAME,
+            .w = fb.w,
+            .h = fb.h,
+            .scale = fb.scale_x,
+        });
+    }
+}
+
+void render_set_tile_size(uint32_t tile_size)
+{
+    _tiles.adaptive = tile_size == 0;
+    if (tile_size != 0) {
+        _tiles.size = min(max(tile_size, TILE_SIZE_MIN), TILE_SIZE_MAX);
+    }
+    _tiles.adapt_frames = 0;
+    _tiles.adapt_dirty_tiles = 0;
+}
+
+uint32_t render_tile_size(void)
+{
+    return _tiles.size;
+}
+
+void render_set_pipelined(bool pipelined)
+{
+    if (pipelined == _pipeline.enabled) {
+        return;
+    }
+
+    if (pipelined) {
+        _pipeline.enabled = start_render_thread();
+    }
+    else {
+        stop_render_thread();
+        eva_framebuffer fb = eva_get_framebuffer();
+        present_damage(&fb);
+        _pipeline.enabled = false;
+    }
+
+    // The tiles are drawn to a different surface from now on.
+    _tiles.valid = false;
+    eva_request_frame();
+}
+
+void render_set_verify(bool verify, render_verify_fn fn, void *user_data)
+{
+    _verify.enabled = verify;
+    _verify.fn = fn;
+    _verify.user_data = user_data;
+    if (!verify) {
+        free_verify_buffers();
+    }
+}
+
+// Returns the area the command can draw to. Glyph descenders hang below
+// the text bbox since the baseline sits on its bottom edge.
+static bool get_cmd_bounds(const render_cmd *cmd, rect *dst)
+{
+    switch (cmd->type) {
+        case RENDER_COMMAND_RECT:
+            *dst = from_fixed_rect(&((const render_cmd_rect*)cmd)->rect);
+            return true;
+        case RENDER_COMMAND_TEXT: {
+            const render_cmd_text *text_cmd = (const render_cmd_text*)cmd;
+            double width, leading, ascent, descent;
+            text_metrics(text_cmd->t, &width, &leading, &ascent, &descent);
+            rect ink = from_fixed_rect(&text_cmd->bbox);
+            rect clip = from_fixed_rect(&text_cmd->clip);
+            ink.h += ceil(descent);
+            return rect_intersection(&ink, &clip, dst);
         }
     }
+    return false;
+}
 
-    // Swap tile caches.
-    uint32_t *tmp_tile_cache = _tile_cache;
-    _tile_cache = _prev_tile_cache;
-    _prev_tile_cache = tmp_tile_cache;
+// Converts a framebuffer rect to the range of tiles it overlaps.
+static bool get_tile_range(const rect *r, recti *dst)
+{
+    recti ri = rect_round(r);
+    int32_t size = (int32_t)_frame.tile_size;
+    int32_t x1 = max(ri.x, 0) / size;
+    int32_t y1 = max(ri.y, 0) / size;
+    int32_t x2 = min((ri.x + ri.w + size - 1) / size,
+                     (int32_t)_frame.tiles_x);
+    int32_t y2 = min((ri.y + ri.h + size - 1) / size,
+                     (int32_t)_frame.tiles_y);
+    if (x1 >= x2 || y1 >= y2) {
+        return false;
+    }
 
-    // Swap the current render queue.
-    render_cmd *tmp_cmds = _render_cmd_ctx.current;
-    _render_cmd_ctx.current = _render_cmd_ctx.previous;
-    _render_cmd_ctx.previous = tmp_cmds;
+    *dst = (recti){ x1, y1, x2 - x1, y2 - y1 };
+    return true;
+}
+
+static void update_tile_cache(const recti *tiles, uint64_t hash_value,
+                              uint32_t target)
+{
+    uint32_t first = target * _frame.tiles_x * _frame.tiles_y;
+    for (int32_t y = tiles->y; y < tiles->y + tiles->h; y++) {
+        for (int32_t x = tiles->x; x < tiles->x + tiles->w; x++) {
+            uint32_t tile = (uint32_t)x + (uint32_t)y * _frame.tiles_x;
+            uint64_t *v = &_tiles.hashes[first + tile];
+            *v = hash64_combine(*v, hash_value);
+        }
+    }
+}
 
-    int32_t *tmp_index = _render_cmd_ctx.curr_index;
-    _render_cmd_ctx.curr_index = _render_cmd_ctx.prev_index;
-    _render_cmd_ctx.prev_index = tmp_index;
+static uint64_t hash_cmd(const render_cmd *cmd)
+{
+    if (cmd->type == RENDER_COMMAND_TEXT) {
+        const render_cmd_text *text_cmd = (const render_cmd_text*)cmd;
+        // Up to the end of bbox, the padding before t is never written.
+        uint64_t cmd_hash = hash64(cmd, offsetof(render_cmd_text, bbox) +
+                                        sizeof(recti));
+        text_hash(text_cmd->t, &cmd_hash);
+        return cmd_hash;
+    }
+    return hash64(cmd, sizeof(render_cmd_rect));
+}
 
-    // Always reset the current render queue regardless
-    *_render_cmd_ctx.curr_index = 0;
+// Sizes the content tiles to what the region shows at its offset.
+static bool reset_scroll_hashes(render_scroll *s)
+{
+    double size = SCROLL_TILE_SIZE;
+    int32_t x1 = (int32_t)floor(s->offset.x / size);
+    int32_t y1 = (int32_t)floor(s->offset.y / size);
+    int32_t x2 = (int32_t)ceil((s->offset.x + s->region.w) / size);
+    int32_t y2 = (int32_t)ceil((s->offset.y + s->region.h) / size);
+    s->tiles = (recti){ x1, y1, x2 - x1, y2 - y1 };
 
-    profiler_end;
+    uint32_t count = (uint32_t)(s->tiles.w * s->tiles.h);
+    if (count > s->capacity) {
+        uint64_t *hashes = realloc(s->hashes, count * sizeof(uint64_t));
+        if (!hashes) {
+            return false;
+        }
+        s->hashes = hashes;
+        s->capacity = count;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        s->hashes[i] = HASH64_INITIAL;
+    }
+    return true;
 }
 
-void render_clear(const color *c)
+// Hashes a command into the content tiles of its scroll region. It is moved
+// into content coordinates and the area it covers is clipped to each tile,
+// so a tile keeps its hash for as long as the part of the command inside it
+// stays the same, wherever the region is scrolled to.
+static void hash_scrolled_cmd(render_scroll *s, const render_cmd *cmd,
+                              const rect *bounds)
 {
-    eva_framebuffer fb = eva_get_framebuffer();
-    rect r = {
-        .x = 0,
-        .y = 0,
-        .w = fb.w,
-        .h = fb.h
+    vec2i move = { s->offset.x - s->region.x, s->offset.y - s->region.y };
+    int32_t move_x = move.x * RENDER_FIXED_ONE;
+    int32_t move_y = move.y * RENDER_FIXED_ONE;
+
+    // Text draws its glyphs clipped to the clip, rects fill their rect.
+    uint64_t base = HASH64_INITIAL;
+    recti area;
+    if (cmd->type == RENDER_COMMAND_TEXT) {
+        const render_cmd_text *text_cmd = (const render_cmd_text*)cmd;
+        recti bbox = text_cmd->bbox;
+        bbox.x += move_x;
+        bbox.y += move_y;
+        base = hash64_combine(base, hash64(&bbox, sizeof(bbox)));
+        text_hash(text_cmd->t, &base);
+        area = text_cmd->clip;
+    }
+    else {
+        const render_cmd_rect *rect_cmd = (const render_cmd_rect*)cmd;
+        base = hash64_combine(base, rect_cmd->color);
+        area = rect_cmd->rect;
+    }
+
+    // Edges cut off by the region are hashed as if the command went on past
+    // them to the end of the content tiles. The region clips the same way
+    // on every frame, and a tile only keeps the pixels that were inside it
+    // on both frames.
+    int32_t tile_fixed = SCROLL_TILE_SIZE * RENDER_FIXED_ONE;
+    recti region = {
+        s->region.x * RENDER_FIXED_ONE, s->region.y * RENDER_FIXED_ONE,
+        s->region.w * RENDER_FIXED_ONE, s->region.h * RENDER_FIXED_ONE,
     };
+    int32_t x1 = area.x + move_x;
+    int32_t y1 = area.y + move_y;
+    int32_t x2 = x1 + area.w;
+    int32_t y2 = y1 + area.h;
+    if (area.x <= region.x) {
+        x1 = s->tiles.x * tile_fixed;
+    }
+    if (area.y <= region.y) {
+        y1 = s->tiles.y * tile_fixed;
+    }
+    if (area.x + area.w >= region.x + region.w) {
+        x2 = (s->tiles.x + s->tiles.w) * tile_fixed;
+    }
+    if (area.y + area.h >= region.y + region.h) {
+        y2 = (s->tiles.y + s->tiles.h) * tile_fixed;
+    }
+    area = (recti){ x1, y1, x2 - x1, y2 - y1 };
+
+    double size = SCROLL_TILE_SIZE;
+    int32_t tx1 = max((int32_t)floor((bounds->x + move.x) / size), s->tiles.x);
+    int32_t ty1 = max((int32_t)floor((bounds->y + move.y) / size), s->tiles.y);
+    int32_t tx2 = min((int32_t)ceil((bounds->x + bounds->w + move.x) / size),
+                      s->tiles.x + s->tiles.w);
+    int32_t ty2 = min((int32_t)ceil((bounds->y + bounds->h + move.y) / size),
+                      s->tiles.y + s->tiles.h);
+
+    for (int32_t y = ty1; y < ty2; y++) {
+        for (int32_t x = tx1; x < tx2; x++) {
+            recti tile_rect = {
+                x * tile_fixed, y * tile_fixed, tile_fixed, tile_fixed
+            };
+            recti piece;
+            if (!recti_intersection(&area, &tile_rect, &piece)) {
+                continue;
+            }
+
+            uint64_t piece_hash = hash64_combine(base,
+                                                 hash64(&piece, sizeof(piece)));
 
-    int32_t index = (*_render_cmd_ctx.curr_index)++;
-    render_cmd *cmd = &_render_cmd_ctx.current[index];
-    cmd->type = RENDER_COMMAND_RECT;
-    cmd->rect_cmd.rect = r;
-    cmd->rect_cmd.color = *c;
+            uint32_t tile = (uint32_t)(x - s->tiles.x) +
+                            (uint32_t)((y - s->tiles.y) * s->tiles.w);
+            s->hashes[tile] = hash64_combine(s->hashes[tile], piece_hash);
+        }
+    }
 }
 
-void render_draw_rect(const rect *r, const color *c)
+// Compares the scroll regions against the last frame. A region that only
+// scrolled gets a blit for the pixels it keeps and its tiles are marked
+// dirty where content was scrolled in or changed. Anything else about it
+// changing redraws the whole region.
+static void update_scroll_damage(uint32_t num_cmds)
 {
-    int32_t index = (*_render_cmd_ctx.curr_index)++;
-    render_cmd *cmd = &_render_cmd_ctx.current[index];
-    cmd->type = RENDER_COMMAND_RECT;
-    cmd->rect_cmd.rect = *r;
-    cmd->rect_cmd.color = *c;
-    clip_to_framebuffer(&cmd->rect_cmd.rect);
+    render_scroll *scrolls = _scroll.frames[_scroll.current];
+    uint32_t num_scrolls = _scroll.counts[_scroll.current];
+    const render_scroll *prev_scrolls = _scroll.frames[!_scroll.current];
+    uint32_t num_prev = _scroll.counts[!_scroll.current];
+
+    _frame.num_blits = 0;
+    _scroll.blit_pixels = 0;
+
+    for (uint32_t i = 0; i < num_scrolls; i++) {
+        render_scroll *s = &scrolls[i];
+        const recti *region = &s->region;
+
+        // Pixels drawn over the region in its target would move along
+        // with it.
+        rect region_rect = { region->x, region->y, region->w, region->h };
+        for (uint32_t c = s->end_cmd; c < num_cmds && !s->covered; c++) {
+            rect overlap;
+            s->covered = _frame.cmd_tiles[c].w > 0 &&
+                         _frame.cmd_targets[c] == s->target &&
+                         rect_intersection(&_frame.cmd_bounds[c],
+                                           &region_rect, &overlap);
+        }
+
+        const render_scroll *p = i < num_prev ? &prev_scrolls[i] : NULL;
+        if (!_tiles.valid || !s->valid || s->covered || !p || !p->valid ||
+            p->covered || p->target != s->target ||
+            memcmp(&p->region, region, sizeof(recti)) != 0) {
+            mark_dirty_rect(s->target, region);
+            continue;
+        }
+
+        // Content moving up by delta moves its pixels up by delta.
+        vec2i delta = { s->offset.x - p->offset.x, s->offset.y - p->offset.y };
+        recti kept = {
+            region->x - delta.x, region->y - delta.y, region->w, region->h
+        };
+        if (!recti_intersection(region, &kept, &kept)) {
+            mark_dirty_rect(s->target, region);
+            continue;
+        }
+
+        if (delta.x != 0 || delta.y != 0) {
+            _frame.blits[_frame.num_blits++] =
+                (render_blit){ s->target, kept, delta };
+            _scroll.blit_pixels += (uint64_t)kept.w * (uint64_t)kept.h;
+            mark_damaged_rect(&kept);
+
+            // The strips around what was kept were scrolled in.
+            int32_t region_x2 = region->x + region->w;
+            int32_t region_y2 = region->y + region->h;
+            int32_t kept_x2 = kept.x + kept.w;
+            int32_t kept_y2 = kept.y + kept.h;
+            recti exposed[] = {
+                { region->x, region->y, region->w, kept.y - region->y },
+                { region->x, kept_y2, region->w, region_y2 - kept_y2 },
+                { region->x, kept.y, kept.x - region->x, kept.h },
+                { kept_x2, kept.y, region_x2 - kept_x2, kept.h },
+            };
+            for (uint32_t e = 0; e < array_size(exposed); e++) {
+                if (exposed[e].w > 0 && exposed[e].h > 0) {
+                    mark_dirty_rect(s->target, &exposed[e]);
+                }
+            }
+        }
+
+        // Content tiles that changed, or weren't shown on the last frame.
+        for (int32_t y = s->tiles.y; y < s->tiles.y + s->tiles.h; y++) {
+            for (int32_t x = s->tiles.x; x < s->tiles.x + s->tiles.w; x++) {
+                uint64_t hash_value = s->hashes[(uint32_t)(x - s->tiles.x) +
+                                                (uint32_t)((y - s->tiles.y) * s->tiles.w)];
+                bool shown = x >= p->tiles.x && x < p->tiles.x + p->tiles.w &&
+                             y >= p->tiles.y && y < p->tiles.y + p->tiles.h;
+                if (shown &&
+                    p->hashes[(uint32_t)(x - p->tiles.x) +
+                              (uint32_t)((y - p->tiles.y) * p->tiles.w)] == hash_value) {
+                    continue;
+                }
+
+                recti changed = {
+                    x * SCROLL_TILE_SIZE - s->offset.x + region->x,
+                    y * SCROLL_TILE_SIZE - s->offset.y + region->y,
+                    SCROLL_TILE_SIZE,
+                    SCROLL_TILE_SIZE,
+                };
+                if (recti_intersection(&changed, region, &changed)) {
+                    mark_dirty_rect(s->target, &changed);
+                }
+            }
+        }
+    }
 }
 
-void render_draw_recti(const recti *r, const color *c)
+static void mark_dirty_rect(uint32_t target, const recti *r)
 {
-    int32_t index = (*_render_cmd_ctx.curr_index)++;
-    render_cmd *cmd = &_render_cmd_ctx.current[index];
-    cmd->type = RENDER_COMMAND_RECT;
-    cmd->rect_cmd.rect.x = r->x;
-    cmd->rect_cmd.rect.y = r->y;
-    cmd->rect_cmd.rect.w = r->w;
-    cmd->rect_cmd.rect.h = r->h;
-    cmd->rect_cmd.color = *c;
-    clip_to_framebuffer(&cmd->rect_cmd.rect);
+    rect area = { r->x, r->y, r->w, r->h };
+    recti tiles;
+    if (!get_tile_range(&area, &tiles)) {
+        return;
+    }
+
+    uint32_t first = target * _frame.tiles_x * _frame.tiles_y;
+    for (int32_t y = tiles.y; y < tiles.y + tiles.h; y++) {
+        for (int32_t x = tiles.x; x < tiles.x + tiles.w; x++) {
+            _frame.dirty[first + (uint32_t)x + (uint32_t)y * _frame.tiles_x] = true;
+        }
+    }
 }
 
-void render_draw_text(text *t, const rect *bbox, const rect *clip)
+// Tiles whose pixels change without being drawn, like those a blit moves,
+// still have to be composited and presented.
+static void mark_damaged_rect(const recti *r)
 {
-    assert(t);
-    assert(bbox);
-    assert(clip);
+    rect area = { r->x, r->y, r->w, r->h };
+    recti tiles;
+    if (!get_tile_range(&area, &tiles)) {
+        return;
+    }
 
-    int32_t index = (*_render_cmd_ctx.curr_index)++;
-    render_cmd *cmd = &_render_cmd_ctx.current[index];
-    cmd->type = RENDER_COMMAND_TEXT;
-    cmd->text_cmd.clip = *clip;
-    cmd->text_cmd.bbox = *bbox;
-    cmd->text_cmd.t = text_ref(t);
+    for (int32_t y = tiles.y; y < tiles.y + tiles.h; y++) {
+        for (int32_t x = tiles.x; x < tiles.x + tiles.w; x++) {
+            _frame.damaged[(uint32_t)x + (uint32_t)y * _frame.tiles_x] = true;
+        }
+    }
 }
 
-static void clip_to_framebuffer(rect *r)
+// Fills the tile bins of all targets from the tile ranges and targets of
+// the commands.
+static bool bin_commands(uint32_t num_cmds)
 {
-    assert(r);
-
-    eva_framebuffer fb = eva_get_framebuffer();
+    uint32_t num_tiles = _frame.tiles_x * _frame.tiles_y;
+    uint32_t num_keys = num_tiles * _frame.num_targets;
+    memset(_frame.bin_offsets, 0, sizeof(uint32_t) * (num_keys + 1));
+
+    // Count the commands in each bin, then turn the counts into offsets.
+    for (uint32_t i = 0; i < num_cmds; i++) {
+        const recti *t = &_frame.cmd_tiles[i];
+        uint32_t first = _frame.cmd_targets[i] * num_tiles;
+        for (int32_t y = t->y; y < t->y + t->h; y++) {
+            for (int32_t x = t->x; x < t->x + t->w; x++) {
+                _frame.bin_offsets[first + (uint32_t)x +
+                                   (uint32_t)y * _frame.tiles_x + 1]++;
+            }
+        }
+    }
+    for (uint32_t i = 0; i < num_keys; i++) {
+        _frame.bin_offsets[i + 1] += _frame.bin_offsets[i];
+    }
+
+    size_t total = _frame.bin_offsets[num_keys];
+    if (total > _frame.bins_cap) {
+        uint32_t *bins = realloc(_frame.bins, total * sizeof(uint32_t));
+        if (!bins) {
+            return false;
+        }
+        _frame.bins = bins;
+        _frame.bins_cap = total;
+    }
+
+    // Use the offsets as write cursors, shifted back down once filled.
+    for (uint32_t i = 0; i < num_cmds; i++) {
+        const recti *t = &_frame.cmd_tiles[i];
+        uint32_t first = _frame.cmd_targets[i] * num_tiles;
+        for (int32_t y = t->y; y < t->y + t->h; y++) {
+            for (int32_t x = t->x; x < t->x + t->w; x++) {
+                uint32_t key = first + (uint32_t)x + (uint32_t)y * _frame.tiles_x;
+                _frame.bins[_frame.bin_offsets[key]++] = i;
+            }
+        }
+    }
+    for (uint32_t i = num_keys; i > 0; i--) {
+        _frame.bin_offsets[i] = _frame.bin_offsets[i - 1];
+    }
+    _frame.bin_offsets[0] = 0;
+
+    return true;
+}
+
+static bool is_opaque_rect(const render_cmd *cmd)
+{
+    return cmd->type == RENDER_COMMAND_RECT &&
+           ((const render_cmd_rect*)cmd)->color >> 24 == 0xff;
+}
+
+// Walks the bin of a tile back to front and drops the commands that are
+// hidden by a later opaque rect within the tile. Only the largest occluder
+// is tracked which catches the usual case of backgrounds drawn over each
+// other. The tile hashes were taken before this so they are unaffected.
+static void cull_tile(uint32_t key)
+{
+    uint32_t first = _frame.bin_offsets[key];
+    uint32_t end = _frame.bin_offsets[key + 1];
+    _frame.bin_starts[key] = end;
+
+    rect tile_rect;
+    if (!get_tile_rect(key % (_frame.tiles_x * _frame.tiles_y), &tile_rect)) {
+        return;
+    }
+
+    rect occluder = {0};
+    uint32_t kept = end;
+    for (uint32_t i = end; i > first; i--) {
+        uint32_t index = _frame.bins[i - 1];
+
+        // Commands binned through rounding might not reach into the tile.
+        rect visible;
+        if (!rect_intersection(&_frame.cmd_bounds[index], &tile_rect,
+                               &visible)) {
+            continue;
+        }
+
+        if (rect_contains(&occluder, &visible)) {
+            _render_cmd_ctx.culled_draws++;
+            _render_cmd_ctx.culled_pixels += (uint64_t)(visible.w * visible.h);
+            continue;
+        }
+        _frame.bins[--kept] = index;
+
+        // Antialiased edges don't cover their pixels so only the whole
+        // pixels inside the rect occlude.
+        if (is_opaque_rect(_frame.cmds[index])) {
+            double x1 = ceil(visible.x);
+            double y1 = ceil(visible.y);
+            double x2 = floor(visible.x + visible.w);
+            double y2 = floor(visible.y + visible.h);
+            rect inner = { x1, y1, x2 - x1, y2 - y1 };
+            if (inner.w > 0 && inner.h > 0 &&
+                inner.w * inner.h > occluder.w * occluder.h) {
+                occluder = inner;
+            }
+        }
+    }
+
+    _frame.bin_starts[key] = kept;
+}
+
+void render_end_frame(void)
+{
+    profiler_begin;
+    assert(!_scroll.active);
+    assert(!_layers.active);
+
+    capture_write(&(capture_cmd){ .op = CAPTURE_OP_END_FRAME });
+
+    uint64_t start = eva_time_now();
+    uint64_t stage = start;
+    render_frame_stats stats = { .frame = _stats.last.frame + 1 };
+
+    render_cmd_list *cmds = _render_cmd_ctx.current;
+    uint32_t num_cmds = cmds->count;
+
+    // The frame state may only be touched once the render thread is done.
+    eva_framebuffer fb = eva_get_framebuffer();
+    if (_pipeline.enabled) {
+        profiler_begin_name("render_wait");
+        wait_for_render_thread();
+        present_damage(&fb);
+        profiler_end;
+
+        // The tiles drawn were those of the last frame.
+        stats.raster_ms = _frame.raster_ms;
+        stats.composite_ms = _frame.composite_ms;
+        stats.sync_flushes = _frame.sync_flushes;
+    }
+    stats.wait_ms = stage_ms(&stage);
+
+    _frame.fb = fb;
+    if (_pipeline.enabled) {
+        if (update_surface(&fb)) {
+            _frame.fb = _pipeline.surface;
+        }
+        else {
+            num_cmds = 0;
+        }
+    }
+
+    if (!update_tile_grid(&_frame.fb)) {
+        num_cmds = 0;
+    }
+    uint32_t num_layers = update_layers() ? _layers.count : 0;
+    _frame.cmds = arena_alloc(cmds->arena,
+                              num_cmds * sizeof(const render_cmd*),
+                              _Alignof(const render_cmd*));
+    _frame.cmd_bounds = arena_alloc(cmds->arena, num_cmds * sizeof(rect),
+                                    _Alignof(rect));
+    _frame.cmd_tiles = arena_alloc(cmds->arena, num_cmds * sizeof(recti),
+                                   _Alignof(recti));
+    _frame.cmd_targets = arena_alloc(cmds->arena, num_cmds * sizeof(uint8_t),
+                                     _Alignof(uint8_t));
+    _frame.text_glyphs = arena_alloc(cmds->arena,
+                                     num_cmds * sizeof(render_glyph_range),
+                                     _Alignof(render_glyph_range));
+    if (!_frame.cmds || !_frame.cmd_bounds || !_frame.cmd_tiles ||
+        !_frame.cmd_targets || !_frame.text_glyphs) {
+        num_cmds = 0;
+    }
+
+    render_scroll *scrolls = _scroll.frames[_scroll.current];
+    uint32_t num_scrolls = _scroll.counts[_scroll.current];
+    for (uint32_t s = 0; s < num_scrolls; s++) {
+        if (scrolls[s].target >= _frame.num_targets) {
+            scrolls[s].target = 0;
+        }
+        scrolls[s].valid = scrolls[s].end_cmd <= num_cmds &&
+                           reset_scroll_hashes(&scrolls[s]);
+    }
+
+    // Process current queue. Commands inside a scroll region are hashed
+    // into its content tiles rather than the tile grid, those inside a
+    // layer into the tiles of its target.
+    render_cmd_iter it;
+    cmd_iter_init(cmds, &it);
+    uint32_t next_scroll = 0;
+    uint32_t next_layer = 0;
+    for (uint32_t i = 0; i < num_cmds; i++)
+    {
+        const render_cmd *cmd = cmd_iter_next(&it);
+        _frame.cmds[i] = cmd;
+
+        while (next_layer < num_layers && _layers.end_cmd[next_layer] <= i) {
+            next_layer++;
+        }
+        uint32_t target = 0;
+        if (next_layer < num_layers && _layers.first_cmd[next_layer] <= i) {
+            target = next_layer + 1;
+        }
+        _frame.cmd_targets[i] = (uint8_t)target;
+
+        while (next_scroll < num_scrolls && scrolls[next_scroll].end_cmd <= i) {
+            next_scroll++;
+        }
+        render_scroll *scroll = NULL;
+        if (next_scroll < num_scrolls && scrolls[next_scroll].first_cmd <= i) {
+            scroll = &scrolls[next_scroll];
+        }
+
+        rect *bounds = &_frame.cmd_bounds[i];
+        recti *tiles = &_frame.cmd_tiles[i];
+        if (!get_cmd_bounds(cmd, bounds) || !get_tile_range(bounds, tiles)) {
+            *tiles = (recti){0};
+        }
+        else if (scroll) {
+            if (scroll->valid) {
+                hash_scrolled_cmd(scroll, cmd, bounds);
+            }
+        }
+        else {
+            update_tile_cache(tiles, hash_cmd(cmd), target);
+        }
+
+        stats.hashed_tiles += (uint32_t)(tiles->w * tiles->h);
+        _frame.text_glyphs[i].prepared = false;
+    }
+
+    stats.hash_ms = stage_ms(&stage);
+
+    // Scroll regions mark the tiles they need redrawn up front.
+    uint32_t num_tiles = _frame.tiles_x * _frame.tiles_y;
+    if (num_tiles > 0) {
+        memset(_frame.dirty, 0, sizeof(bool) * num_tiles * RENDER_MAX_TARGETS);
+        memset(_frame.damaged, 0, sizeof(bool) * num_tiles);
+    }
+    update_scroll_damage(num_cmds);
+
+    // Collect the changed tiles as horizontal spans which the damage list
+    // merges into a few rects. A tile changed if it changed in any target.
+    // The hashes of targets without a layer this frame are reset all the
+    // same so they start out clean if one comes back.
+    damage_list damage;
+    damage_clear(&damage);
+    uint32_t num_changed = 0;
+    bool glyphs_reset = false;
+    uint32_t max_x = _frame.tiles_x;
+    uint32_t max_y = _frame.tiles_y;
+    for (uint32_t y = 0; y < max_y; y++)
+    {
+        int32_t span_start = -1;
+        for (uint32_t x = 0; x <= max_x; x++)
+        {
+            bool changed = false;
+            if (x < max_x) {
+                uint32_t tile_index = x + y * max_x;
+                changed = _frame.damaged[tile_index];
+                for (uint32_t t = 0; t < RENDER_MAX_TARGETS; t++) {
+                    uint32_t key = t * num_tiles + tile_index;
+                    bool dirty = t < _frame.num_targets &&
+                                 (!_tiles.valid || _frame.dirty[key] ||
+                                  _tiles.hashes[key] != _tiles.prev_hashes[key]);
+                    _tiles.prev_hashes[key] = HASH64_INITIAL;
+                    _frame.dirty[key] = dirty;
+                    changed |= dirty;
+                }
+                num_changed += changed;
+            }
+
+            if (changed && span_start < 0) {
+                span_start = (int32_t)x;
+            }
+            else if (!changed && span_start >= 0) {
+                int32_t size = (int32_t)_frame.tile_size;
+                recti span = {
+                    .x = span_start * size,
+                    .y = (int32_t)y * size,
+                    .w = ((int32_t)x - span_start) * size,
+                    .h = size,
+                };
+                damage_add(&damage, &span);
+                span_start = -1;
+            }
+        }
+    }
+    damage_finish(&damage);
+    _tiles.valid = _frame.tiles_x > 0;
+
+    if (damage.count > 0 && bin_commands(num_cmds))
+    {
+        update_workers();
+
+        // Damage rects are tile aligned so mark the tiles they cover, which
+        // are composited. Only the dirty tiles of each target are drawn.
+        uint32_t num_damaged = 0;
+        memset(_frame.damaged, 0, sizeof(bool) * num_tiles);
+        for (uint32_t d = 0; d < damage.count; d++)
+        {
+            const recti *r = &damage.rects[d];
+            uint32_t size = _frame.tile_size;
+            uint32_t x1 = (uint32_t)r->x / size;
+            uint32_t y1 = (uint32_t)r->y / size;
+            uint32_t x2 = min((uint32_t)(r->x + r->w) / size, max_x);
+            uint32_t y2 = min((uint32_t)(r->y + r->h) / size, max_y);
+            for (uint32_t y = y1; y < y2; y++) {
+                for (uint32_t x = x1; x < x2; x++) {
+                    bool *damaged = &_frame.damaged[x + y * _frame.tiles_x];
+                    num_damaged += !*damaged;
+                    *damaged = true;
+                }
+            }
+        }
+        // The tiles that changed, not the ones the merged rects cover, as
+        // merging adds tiles between far apart changes.
+        adapt_tile_size(num_changed, num_tiles);
+        stats.damaged_tiles = num_damaged;
+        stats.damage_ms = stage_ms(&stage);
+
+        // Drop the commands hidden in the dirty tiles, then resolve the
+        // glyphs of the text left over up front.
+        profiler_begin_name("render_prepare_text");
+        glyph_atlas_begin_frame();
+        _frame.num_glyphs = 0;
+        glyphs_reset = true;
+        _render_cmd_ctx.culled_draws = 0;
+        _render_cmd_ctx.culled_pixels = 0;
+        for (uint32_t key = 0; key < num_tiles * _frame.num_targets; key++)
+        {
+            if (!_frame.dirty[key]) {
+                continue;
+            }
+            cull_tile(key);
+
+            rect tile_rect;
+            if (_frame.bin_starts[key] != _frame.bin_offsets[key + 1] &&
+                get_tile_rect(key % num_tiles, &tile_rect)) {
+                stats.drawn_tiles++;
+                stats.raster_pixels += (uint64_t)(tile_rect.w * tile_rect.h);
+            }
+            for (uint32_t i = _frame.bin_starts[key];
+                 i < _frame.bin_offsets[key + 1]; i++) {
+                uint32_t index = _frame.bins[i];
+                const render_cmd *cmd = _frame.cmds[index];
+                if (cmd->type == RENDER_COMMAND_TEXT) {
+                    stats.text_cmds += !_frame.text_glyphs[index].prepared;
+                    prepare_text(index, (const render_cmd_text*)cmd);
+                }
+            }
+        }
+        stats.culled_cmds = _render_cmd_ctx.culled_draws;
+        stats.prepare_ms = stage_ms(&stage);
+        profiler_end;
+
+        if (_pipeline.enabled) {
+            // Present the frame once it's done, even if nothing else
+            // requests another frame.
+            _pipeline.damage = damage;
+            _pipeline.present = true;
+            mutex_lock(&_pipeline.lock);
+            _pipeline.busy = true;
+            cond_signal(&_pipeline.wake);
+            mutex_unlock(&_pipeline.lock);
+            eva_request_frame();
+        }
+        else {
+            profiler_begin_name("render_tiles");
+            draw_tiles();
+            profiler_end;
+
+            stats.raster_ms = _frame.raster_ms;
+            stats.composite_ms = _frame.composite_ms;
+            stats.sync_flushes = _frame.sync_flushes;
+        }
+    }
+
+    // Stale pixels left by the incremental redraw show up as tiles that
+    // differ from drawing everything again, which needs the frame finished.
+    if (_verify.enabled) {
+        profiler_begin_name("render_verify");
+        if (_pipeline.enabled) {
+            wait_for_render_thread();
+        }
+        stats.mismatched_tiles = verify_frame(stats.frame, num_cmds,
+                                              glyphs_reset);
+        profiler_end;
+    }
+
+    // Release the reference we took when adding the render text commands.
+    cmd_iter_init(cmds, &it);
+    for (const render_cmd *cmd = cmd_iter_next(&it); cmd;
+         cmd = cmd_iter_next(&it))
+    {
+        if (cmd->type == RENDER_COMMAND_TEXT) {
+            text_destroy(((const render_cmd_text*)cmd)->t);
+        }
+    }
+
+    // The regions of this frame are compared against on the next one.
+    _scroll.current = !_scroll.current;
+    _scroll.counts[_scroll.current] = 0;
+    _layers.count = 0;
+
+    // Swap tile caches.
+    uint64_t *tmp_tile_cache = _tiles.hashes;
+    _tiles.hashes = _tiles.prev_hashes;
+    _tiles.prev_hashes = tmp_tile_cache;
+
+    _render_cmd_ctx.last_cmds = cmds->count;
+    _render_cmd_ctx.max_cmds = max(_render_cmd_ctx.max_cmds, cmds->count);
+
+    text_cache_stats text_stats;
+    text_cache_stats_get(&text_stats);
+    stats.num_cmds = cmds->count;
+    stats.tile_size = _frame.tile_size;
+    stats.num_tiles = num_tiles;
+    stats.shape_hits = text_stats.layout_hits - _stats.text.layout_hits;
+    stats.shape_misses = text_stats.layout_misses - _stats.text.layout_misses;
+    stats.shape_edits = text_stats.layout_edits - _stats.text.layout_edits;
+    stats.total_ms = eva_time_elapsed_ms(start, eva_time_now());
+    _stats.last = stats;
+    _stats.text = text_stats;
+    _render_cmd_ctx.last_bytes = cmds->bytes;
+
+    // Swap the current render queue.
+    render_cmd_list *tmp_cmds = _render_cmd_ctx.current;
+    _render_cmd_ctx.current = _render_cmd_ctx.previous;
+    _render_cmd_ctx.previous = tmp_cmds;
+
+    // Always reset the current render queue regardless
+    reset_cmds(_render_cmd_ctx.current);
+
+    profiler_end;
+}
+
+void render_clear(const color *c)
+{
+    eva_framebuffer fb = eva_get_framebuffer();
+    rect r = {
+        .x = 0,
+        .y = 0,
+        .w = fb.w,
+        .h = fb.h
+    };
+
+    capture_write(&(capture_cmd){ .op = CAPTURE_OP_RECT, .r = r, .c = *c });
+    push_rect(&r, c);
+}
+
+void render_draw_rect(const rect *r, const color *c)
+{
+    capture_write(&(capture_cmd){ .op = CAPTURE_OP_RECT, .r = *r, .c = *c });
+
+    rect clipped = *r;
+    clip_to_framebuffer(&clipped);
+    push_rect(&clipped, c);
+}
+
+void render_draw_recti(const recti *r, const color *c)
+{
+    rect clipped = {
+        .x = r->x,
+        .y = r->y,
+        .w = r->w,
+        .h = r->h
+    };
+    capture_write(&(capture_cmd){ .op = CAPTURE_OP_RECT, .r = clipped,
+                                  .c = *c });
+
+    clip_to_framebuffer(&clipped);
+    push_rect(&clipped, c);
+}
+
+void render_draw_text(text *t, const rect *bbox, const rect *clip)
+{
+    assert(t);
+    assert(bbox);
+    assert(clip);
+
+    capture_write(&(capture_cmd){ .op = CAPTURE_OP_TEXT, .r = *bbox,
+                                  .clip = *clip, .t = t });
+
+    rect clipped = *clip;
+    if (!clip_to_scroll(&clipped)) {
+        return;
+    }
+
+    render_cmd_text *cmd = push_cmd(_render_cmd_ctx.current,
+                                    RENDER_COMMAND_TEXT,
+                                    sizeof(render_cmd_text));
+    if (!cmd) {
+        return;
+    }
+    cmd->clip = to_fixed_rect(&clipped);
+    cmd->bbox = to_fixed_rect(bbox);
+    cmd->t = text_ref(t);
+}
+
+void render_begin_scroll(const recti *region, const vec2i *offset,
+                         const color *background)
+{
+    assert(region);
+    assert(offset);
+    assert(background);
+    assert(!_scroll.active);
+    assert(to_prgb32(background) >> 24 == 0xff);
+
+    capture_write(&(capture_cmd){ .op = CAPTURE_OP_BEGIN_SCROLL,
+                                  .region = *region, .offset = *offset,
+                                  .c = *background });
+
+    eva_framebuffer fb = eva_get_framebuffer();
+    recti fb_rect = { 0, 0, (int32_t)fb.w, (int32_t)fb.h };
+    recti clipped;
+    if (!recti_intersection(region, &fb_rect, &clipped)) {
+        _scroll.active = true;
+        _scroll.clip = (recti){0};
+        _scroll.recording = NULL;
+        return;
+    }
+
+    rect r = { clipped.x, clipped.y, clipped.w, clipped.h };
+    push_rect(&r, background);
+
+    _scroll.active = true;
+    _scroll.clip = clipped;
+    _scroll.recording = NULL;
+
+    // Past the limit the region is still clipped but redrawn like the rest.
+    uint32_t *count = &_scroll.counts[_scroll.current];
+    if (*count < RENDER_MAX_SCROLLS) {
+        render_scroll *s = &_scroll.frames[_scroll.current][(*count)++];
+        s->target = _layers.active && _layers.recording ? _layers.count + 1 : 0;
+        s->region = clipped;
+        s->offset = *offset;
+        s->first_cmd = _render_cmd_ctx.current->count;
+        s->end_cmd = s->first_cmd;
+        s->covered = false;
+        s->valid = false;
+        _scroll.recording = s;
+    }
+}
+
+void render_end_scroll(void)
+{
+    assert(_scroll.active);
+
+    capture_write(&(capture_cmd){ .op = CAPTURE_OP_END_SCROLL });
+
+    if (_scroll.recording) {
+        _scroll.recording->end_cmd = _render_cmd_ctx.current->count;
+    }
+    _scroll.active = false;
+    _scroll.recording = NULL;
+}
+
+void render_begin_layer(void)
+{
+    assert(!_layers.active);
+    assert(!_scroll.active);
+
+    capture_write(&(capture_cmd){ .op = CAPTURE_OP_BEGIN_LAYER });
+
+    // Past the limit the layer is drawn along with the rest.
+    _layers.active = true;
+    _layers.recording = _layers.count < RENDER_MAX_LAYERS;
+    if (_layers.recording) {
+        _layers.first_cmd[_layers.count] = _render_cmd_ctx.current->count;
+    }
+}
+
+void render_end_layer(void)
+{
+    assert(_layers.active);
+    assert(!_scroll.active);
+
+    capture_write(&(capture_cmd){ .op = CAPTURE_OP_END_LAYER });
+
+    if (_layers.recording) {
+        _layers.end_cmd[_layers.count++] = _render_cmd_ctx.current->count;
+    }
+    _layers.active = false;
+    _layers.recording = false;
+}
+
+// Everything recorded inside a scroll region is clipped to it. Returns
+// false if nothing is left.
+static bool clip_to_scroll(rect *r)
+{
+    if (!_scroll.active) {
+        return true;
+    }
+
+    rect clip = { _scroll.clip.x, _scroll.clip.y, _scroll.clip.w, _scroll.clip.h };
+    return rect_intersection(r, &clip, r);
+}
+
+static void clip_to_framebuffer(rect *r)
+{
+    assert(r);
+
+    eva_framebuffer fb = eva_get_framebuffer();
 
     r->x = max(0, r->x);
     r->y = max(0, r->y);
     r->w = min(fb.w, r->w);
     r->h = min(fb.h, r->h);
 }
+
+static int32_t to_fixed(double v)
+{
+    double f = round(v * RENDER_FIXED_ONE);
+    return (int32_t)max(min(f, (double)INT32_MAX), (double)INT32_MIN);
+}
+
+static recti to_fixed_rect(const rect *r)
+{
+    return (recti){
+        to_fixed(r->x), to_fixed(r->y), to_fixed(r->w), to_fixed(r->h)
+    };
+}
+
+static rect from_fixed_rect(const recti *r)
+{
+    return (rect){
+        (double)r->x / RENDER_FIXED_ONE,
+        (double)r->y / RENDER_FIXED_ONE,
+        (double)r->w / RENDER_FIXED_ONE,
+        (double)r->h / RENDER_FIXED_ONE,
+    };
+}
+
+static uint32_t to_prgb32(const color *c)
+{
+    float a = min(max(c->a, 0.0f), 1.0f);
+    uint32_t a8 = (uint32_t)lroundf(a * 255.0f);
+    uint32_t r8 = (uint32_t)lroundf(min(max(c->r, 0.0f), 1.0f) * a * 255.0f);
+    uint32_t g8 = (uint32_t)lroundf(min(max(c->g, 0.0f), 1.0f) * a * 255.0f);
+    uint32_t b8 = (uint32_t)lroundf(min(max(c->b, 0.0f), 1.0f) * a * 255.0f);
+    return a8 << 24 | r8 << 16 | g8 << 8 | b8;
+}
+
+// blend2d takes straight alpha colors and premultiplies them again, which
+// gives back the exact premultiplied values.
+static BLRgba from_prgb32(uint32_t c)
+{
+    float a = (float)(c >> 24);
+    if (a == 0.0f) {
+        return (BLRgba){0};
+    }
+    return (BLRgba){
+        (float)((c >> 16) & 0xff) / a,
+        (float)((c >> 8) & 0xff) / a,
+        (float)(c & 0xff) / a,
+        a / 255.0f,
+    };
+}
+
+// Returns a record of size bytes with its header filled in.
+static void* push_cmd(render_cmd_list *list, render_cmd_type type,
+                      size_t size)
+{
+    uint32_t record_size = (uint32_t)(size + RENDER_CMD_ALIGN - 1) &
+                           ~(uint32_t)(RENDER_CMD_ALIGN - 1);
+    assert(record_size <= RENDER_CMD_PAGE_SIZE);
+
+    render_cmd_page *page = list->last;
+    if (!page || page->used + record_size > RENDER_CMD_PAGE_SIZE) {
+        page = arena_alloc(list->arena,
+                           sizeof(render_cmd_page) + RENDER_CMD_PAGE_SIZE,
+                           RENDER_CMD_ALIGN);
+        if (!page) {
+            console_log("Dropping render command, out of memory");
+            return NULL;
+        }
+        page->next = NULL;
+        page->used = 0;
+
+        if (list->last) {
+            list->last->next = page;
+        }
+        else {
+            list->first = page;
+        }
+        list->last = page;
+    }
+
+    render_cmd *cmd = (render_cmd*)((uint8_t*)(page + 1) + page->used);
+    cmd->type = (uint16_t)type;
+    cmd->size = (uint16_t)record_size;
+    page->used += record_size;
+    list->count++;
+    list->bytes += record_size;
+
+    return cmd;
+}
+
+static void reset_cmds(render_cmd_list *list)
+{
+    list->first = NULL;
+    list->last = NULL;
+    list->count = 0;
+    list->bytes = 0;
+    arena_reset(list->arena);
+}
+
+static void cmd_iter_init(const render_cmd_list *list, render_cmd_iter *it)
+{
+    it->page = list->first;
+    it->offset = 0;
+}
+
+// Returns the next record or NULL once the list is exhausted.
+static const render_cmd* cmd_iter_next(render_cmd_iter *it)
+{
+    while (it->page && it->offset == it->page->used) {
+        it->page = it->page->next;
+        it->offset = 0;
+    }
+    if (!it->page) {
+        return NULL;
+    }
+
+    const render_cmd *cmd =
+        (const render_cmd*)((const uint8_t*)(it->page + 1) + it->offset);
+    it->offset += cmd->size;
+    return cmd;
+}
+
+// Fully transparent rects draw nothing so they aren't recorded.
+static void push_rect(const rect *r, const color *c)
+{
+    uint32_t prgb = to_prgb32(c);
+    rect clipped = *r;
+    if (prgb == 0 || !clip_to_scroll(&clipped)) {
+        return;
+    }
+
+    render_cmd_rect *cmd = push_cmd(_render_cmd_ctx.current,
+                                    RENDER_COMMAND_RECT,
+                                    sizeof(render_cmd_rect));
+    if (!cmd) {
+        return;
+    }
+    cmd->rect = to_fixed_rect(&clipped);
+    cmd->color = prgb;
+}
+
+// The worker contexts wrap the pixels of the targets directly so they are
+// dropped whenever a target is resized or moved.
+static void update_workers(void)
+{
+    for (uint32_t t = 0; t < RENDER_MAX_TARGETS; t++) {
+        eva_framebuffer target = {0};
+        if (t < _frame.num_targets) {
+            target = _frame.targets[t];
+        }
+
+        const eva_framebuffer *old = &_worker_targets[t];
+        if (target.pixels == old->pixels && target.w == old->w &&
+            target.h == old->h && target.pitch == old->pitch) {
+            continue;
+        }
+
+        destroy_workers(t);
+        _worker_targets[t] = target;
+    }
+}
+
+static void destroy_workers(uint32_t target)
+{
+    for (uint32_t i = 0; i < MAX_JOB_WORKERS; i++) {
+        destroy_worker_target(&_workers[i].targets[target]);
+    }
+}
+
+static void destroy_worker_target(render_worker_target *wt)
+{
+    if (wt->created) {
+        blContextEnd(&wt->ctx);
+        blContextDestroy(&wt->ctx);
+        blImageDestroy(&wt->img);
+        wt->created = false;
+    }
+}
+
+// Picks the targets of the frame. Layers draw to buffers of their own and
+// the rest to the framebuffer, or to a buffer of its own too while there
+// are layers to composite over it. A change in the number of layers
+// redraws everything since the buffers don't hold the last frame then.
+// Returns false if the buffers couldn't be allocated, the layers are drawn
+// straight to the framebuffer then.
+static bool update_layers(void)
+{
+    uint32_t num_targets = _layers.count > 0 ? _layers.count + 1 : 1;
+    bool ok = true;
+    for (uint32_t t = 0; t < RENDER_MAX_TARGETS && ok; t++) {
+        if (t < num_targets && num_targets > 1) {
+            ok = update_target(&_layers.buffers[t], &_frame.fb);
+        }
+        else {
+            free(_layers.buffers[t].pixels);
+            memset(&_layers.buffers[t], 0, sizeof(eva_framebuffer));
+        }
+    }
+
+    if (!ok) {
+        console_log("Failed to allocate %u render layers", _layers.count);
+        for (uint32_t t = 0; t < RENDER_MAX_TARGETS; t++) {
+            free(_layers.buffers[t].pixels);
+            memset(&_layers.buffers[t], 0, sizeof(eva_framebuffer));
+        }
+        num_targets = 1;
+    }
+
+    _frame.num_targets = num_targets;
+    _frame.composite = num_targets > 1;
+    for (uint32_t t = 0; t < num_targets; t++) {
+        _frame.targets[t] = _frame.composite ? _layers.buffers[t] : _frame.fb;
+    }
+
+    if (num_targets != _layers.num_targets) {
+        _tiles.valid = false;
+    }
+    _layers.num_targets = num_targets;
+    return ok;
+}
+
+// Sizes a target buffer like the framebuffer. Pages that are never drawn
+// to stay untouched.
+static bool update_target(eva_framebuffer *buffer, const eva_framebuffer *fb)
+{
+    if (buffer->pixels && buffer->w == fb->w && buffer->h == fb->h) {
+        return true;
+    }
+
+    free(buffer->pixels);
+    memset(buffer, 0, sizeof(eva_framebuffer));
+    if (fb->w == 0 || fb->h == 0) {
+        return true;
+    }
+
+    buffer->pixels = calloc((size_t)fb->w * fb->h, sizeof(eva_pixel));
+    if (!buffer->pixels) {
+        return false;
+    }
+    buffer->w = fb->w;
+    buffer->h = fb->h;
+    buffer->pitch = fb->w;
+    return true;
+}
+
+// Resizes the tile grid to cover the framebuffer with tiles of the current
+// size. A new grid has no valid hashes so the next frame redraws it all.
+static bool update_tile_grid(const eva_framebuffer *fb)
+{
+    if (fb->w == _tiles.fb_w && fb->h == _tiles.fb_h &&
+        _tiles.size == _tiles.grid_size && _frame.tiles_x > 0) {
+        return true;
+    }
+
+    uint32_t size = _tiles.size;
+    uint32_t tiles_x = (fb->w + size - 1) / size;
+    uint32_t tiles_y = (fb->h + size - 1) / size;
+    uint32_t num_tiles = tiles_x * tiles_y;
+
+    _frame.tiles_x = 0;
+    _frame.tiles_y = 0;
+    _tiles.valid = false;
+
+    // Every target has its own tiles.
+    uint32_t num_keys = num_tiles * RENDER_MAX_TARGETS;
+    if (num_tiles > _tiles.capacity) {
+        uint64_t *hashes = realloc(_tiles.hashes, num_keys * sizeof(uint64_t));
+        if (hashes) {
+            _tiles.hashes = hashes;
+        }
+        uint64_t *prev_hashes = realloc(_tiles.prev_hashes,
+                                        num_keys * sizeof(uint64_t));
+        if (prev_hashes) {
+            _tiles.prev_hashes = prev_hashes;
+        }
+        uint32_t *bin_offsets = realloc(_frame.bin_offsets,
+                                        (num_keys + 1) * sizeof(uint32_t));
+        if (bin_offsets) {
+            _frame.bin_offsets = bin_offsets;
+        }
+        uint32_t *bin_starts = realloc(_frame.bin_starts,
+                                       num_keys * sizeof(uint32_t));
+        if (bin_starts) {
+            _frame.bin_starts = bin_starts;
+        }
+        bool *dirty = realloc(_frame.dirty, num_keys * sizeof(bool));
+        if (dirty) {
+            _frame.dirty = dirty;
+        }
+        bool *damaged = realloc(_frame.damaged, num_tiles * sizeof(bool));
+        if (damaged) {
+            _frame.damaged = damaged;
+        }
+
+        if (!hashes || !prev_hashes || !bin_offsets || !bin_starts || !dirty ||
+            !damaged) {
+            console_log("Failed to allocate %u render tiles", num_tiles);
+            return false;
+        }
+        _tiles.capacity = num_tiles;
+    }
+
+    for (uint32_t i = 0; i < num_keys; i++) {
+        _tiles.hashes[i] = HASH64_INITIAL;
+        _tiles.prev_hashes[i] = HASH64_INITIAL;
+    }
+
+    _tiles.grid_size = size;
+    _tiles.fb_w = fb->w;
+    _tiles.fb_h = fb->h;
+    _frame.tile_size = size;
+    _frame.tiles_x = tiles_x;
+    _frame.tiles_y = tiles_y;
+
+    return true;
+}
+
+// Small tiles keep the damage tight when only a few of them change, as when
+// typing, while large tiles cut the per tile overhead when most of the
+// framebuffer changes. The size is only reconsidered every so often since
+// changing it redraws everything.
+static void adapt_tile_size(uint32_t num_dirty, uint32_t num_tiles)
+{
+    if (!_tiles.adaptive || num_tiles == 0) {
+        return;
+    }
+
+    _tiles.adapt_frames++;
+    _tiles.adapt_dirty_tiles += num_dirty;
+    if (_tiles.adapt_frames < TILE_ADAPT_FRAMES) {
+        return;
+    }
+
+    double avg_dirty = (double)_tiles.adapt_dirty_tiles / _tiles.adapt_frames;
+    if (avg_dirty <= TILE_ADAPT_SHRINK_TILES &&
+        _tiles.size / 2 >= TILE_SIZE_MIN) {
+        _tiles.size /= 2;
+    }
+    else if (avg_dirty > num_tiles / 2.0 && _tiles.size * 2 <= TILE_SIZE_MAX) {
+        _tiles.size *= 2;
+    }
+
+    _tiles.adapt_frames = 0;
+    _tiles.adapt_dirty_tiles = 0;
+}
+
+// Moves the pixels the scroll regions keep from the last frame. Rows are
+// copied in the order that doesn't overwrite rows still to be read.
+static void blit_scrolls(void)
+{
+    for (uint32_t i = 0; i < _frame.num_blits; i++) {
+        const render_blit *b = &_frame.blits[i];
+        const eva_framebuffer *fb = &_frame.targets[b->target];
+        size_t row_size = (size_t)b->dst.w * sizeof(eva_pixel);
+        for (int32_t row = 0; row < b->dst.h; row++) {
+            int32_t y = b->delta.y > 0 ? b->dst.y + row
+                                       : b->dst.y + b->dst.h - 1 - row;
+            eva_pixel *dst = &fb->pixels[(uint32_t)y * fb->pitch +
+                                         (uint32_t)b->dst.x];
+            const eva_pixel *src =
+                &fb->pixels[(uint32_t)(y + b->delta.y) * fb->pitch +
+                            (uint32_t)(b->dst.x + b->delta.x)];
+            memmove(dst, src, row_size);
+        }
+    }
+}
+
+// Renders the dirty tiles of _frame, composites the damaged ones if there
+// are layers and waits for them. Runs on the render thread in pipelined
+// mode so it must not use the profiler.
+static void draw_tiles(void)
+{
+    uint64_t stage = eva_time_now();
+    _frame.sync_flushes = 0;
+    _frame.composite_ms = 0.0;
+
+    blit_scrolls();
+
+    uint32_t num_tiles = _frame.tiles_x * _frame.tiles_y;
+    for (uint32_t key = 0; key < num_tiles * _frame.num_targets; key++)
+    {
+        if (_frame.dirty[key] &&
+            _frame.bin_starts[key] != _frame.bin_offsets[key + 1]) {
+            job_submit(render_tile, (void*)(uintptr_t)key);
+        }
+    }
+    job_wait_all();
+
+    for (uint32_t i = 0; i < job_worker_count(); i++)
+    {
+        for (uint32_t t = 0; t < RENDER_MAX_TARGETS; t++) {
+            render_worker_target *wt = &_workers[i].targets[t];
+            if (wt->used) {
+                blContextFlush(&wt->ctx, BL_CONTEXT_FLUSH_SYNC);
+                wt->used = false;
+                _frame.sync_flushes++;
+            }
+        }
+    }
+    _frame.raster_ms = stage_ms(&stage);
+
+    if (!_frame.composite) {
+        return;
+    }
+
+    for (uint32_t tile = 0; tile < num_tiles; tile++)
+    {
+        if (_frame.damaged[tile]) {
+            job_submit(composite_tile, (void*)(uintptr_t)tile);
+        }
+    }
+    job_wait_all();
+    _frame.composite_ms = stage_ms(&stage);
+}
+
+// Passes a line of the verify report to the report function.
+static void verify_report(const char *fmt, ...)
+{
+    char line[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+
+    if (_verify.fn) {
+        _verify.fn(line, _verify.user_data);
+    }
+    else {
+        console_log("%s", line);
+    }
+}
+
+static void report_cmd(uint32_t target, uint32_t index)
+{
+    const render_cmd *cmd = _frame.cmds[index];
+    switch (cmd->type) {
+        case RENDER_COMMAND_RECT: {
+            const render_cmd_rect *rect_cmd = (const render_cmd_rect*)cmd;
+            rect r = from_fixed_rect(&rect_cmd->rect);
+            verify_report("  target %u cmd %u: rect %.2f,%.2f %.2fx%.2f "
+                          "color %08x hash %016llx", target, index, r.x, r.y,
+                          r.w, r.h, rect_cmd->color,
+                          (unsigned long long)hash_cmd(cmd));
+            break;
+        }
+        case RENDER_COMMAND_TEXT: {
+            const render_cmd_text *text_cmd = (const render_cmd_text*)cmd;
+            rect bbox = from_fixed_rect(&text_cmd->bbox);
+            rect clip = from_fixed_rect(&text_cmd->clip);
+            verify_report("  target %u cmd %u: text bbox %.2f,%.2f %.2fx%.2f "
+                          "clip %.2f,%.2f %.2fx%.2f length %zu hash %016llx",
+                          target, index, bbox.x, bbox.y, bbox.w, bbox.h,
+                          clip.x, clip.y, clip.w, clip.h,
+                          ustr_len(text_ustr(text_cmd->t)),
+                          (unsigned long long)hash_cmd(cmd));
+            break;
+        }
+    }
+}
+
+// Reports a tile that differs along with the commands binned into it in
+// every target, in the order they are drawn.
+static void report_tile(uint64_t frame, uint32_t tile, const recti *r,
+                        uint32_t num_pixels, vec2i first, uint32_t actual,
+                        uint32_t expected)
+{
+    verify_report("Frame %llu: tile %u,%u at %d,%d %dx%d differs in %u "
+                  "pixels, first at %d,%d is %08x instead of %08x",
+                  (unsigned long long)frame, tile % _frame.tiles_x,
+                  tile / _frame.tiles_x, r->x, r->y, r->w, r->h, num_pixels,
+                  first.x, first.y, actual, expected);
+
+    uint32_t num_tiles = _frame.tiles_x * _frame.tiles_y;
+    for (uint32_t t = 0; t < _frame.num_targets; t++) {
+        uint32_t key = t * num_tiles + tile;
+        uint32_t begin = _frame.bin_offsets[key];
+        uint32_t end = _frame.bin_offsets[key + 1];
+        for (uint32_t i = begin; i < end; i++) {
+            if (i - begin == RENDER_VERIFY_MAX_CMDS) {
+                verify_report("  target %u: %u more commands", t, end - i);
+                break;
+            }
+            report_cmd(t, _frame.bins[i]);
+        }
+    }
+}
+
+// Sizes a verify buffer like the framebuffer, dropping the context that
+// wraps it when it moves.
+static bool update_verify_target(eva_framebuffer *buffer,
+                                 render_worker_target *wt)
+{
+    eva_pixel *pixels = buffer->pixels;
+    if (!update_target(buffer, &_frame.fb)) {
+        return false;
+    }
+    if (wt && buffer->pixels != pixels) {
+        destroy_worker_target(wt);
+    }
+    return true;
+}
+
+// Draws every tile of the frame from scratch into the verify buffers and
+// compares the result with _frame.fb, which has to be finished. Returns the
+// number of tiles that differ. Tiles that differ are reported and the next
+// frame redraws everything so the same stale pixels aren't reported again.
+static uint32_t verify_frame(uint64_t frame, uint32_t num_cmds,
+                             bool glyphs_reset)
+{
+    uint32_t num_tiles = _frame.tiles_x * _frame.tiles_y;
+    if (num_tiles == 0 || !bin_commands(num_cmds)) {
+        return 0;
+    }
+
+    bool ok = true;
+    for (uint32_t t = 0; t < _frame.num_targets && ok; t++) {
+        ok = update_verify_target(&_verify.targets[t], &_verify.contexts[t]);
+    }
+    if (ok && _frame.composite) {
+        ok = update_verify_target(&_verify.composite, NULL);
+    }
+    if (!ok) {
+        console_log("Failed to allocate the render verify buffers");
+        free_verify_buffers();
+        return 0;
+    }
+
+    // Text left out of the redraw still needs its glyphs.
+    if (!glyphs_reset) {
+        glyph_atlas_begin_frame();
+        _frame.num_glyphs = 0;
+    }
+    for (uint32_t i = 0; i < num_cmds; i++) {
+        const render_cmd *cmd = _frame.cmds[i];
+        if (cmd->type == RENDER_COMMAND_TEXT && _frame.cmd_tiles[i].w > 0) {
+            prepare_text(i, (const render_cmd_text*)cmd);
+        }
+    }
+
+    for (uint32_t t = 0; t < _frame.num_targets; t++) {
+        const eva_framebuffer *target = &_verify.targets[t];
+        memset(target->pixels, 0,
+               (size_t)target->pitch * target->h * sizeof(eva_pixel));
+        for (uint32_t tile = 0; tile < num_tiles; tile++) {
+            uint32_t key = t * num_tiles + tile;
+            if (_frame.bin_offsets[key] != _frame.bin_offsets[key + 1]) {
+                draw_tile(target, &_verify.contexts[t], &_verify.batch, key,
+                          _frame.bin_offsets[key]);
+            }
+        }
+
+        render_worker_target *wt = &_verify.contexts[t];
+        if (wt->used) {
+            blContextFlush(&wt->ctx, BL_CONTEXT_FLUSH_SYNC);
+            wt->used = false;
+        }
+    }
+
+    const eva_framebuffer *expected = &_verify.targets[0];
+    if (_frame.composite) {
+        expected = &_verify.composite;
+        for (uint32_t tile = 0; tile < num_tiles; tile++) {
+            composite_to(expected, _verify.targets, tile);
+        }
+    }
+
+    const eva_framebuffer *fb = &_frame.fb;
+    uint32_t mismatched = 0;
+    for (uint32_t tile = 0; tile < num_tiles; tile++) {
+        rect tile_rect;
+        if (!get_tile_rect(tile, &tile_rect)) {
+            continue;
+        }
+
+        recti r = rect_round(&tile_rect);
+        uint32_t num_pixels = 0;
+        vec2i first = {0};
+        uint32_t actual_pixel = 0;
+        uint32_t expected_pixel = 0;
+        for (int32_t y = r.y; y < r.y + r.h; y++) {
+            const uint32_t *actual = (const uint32_t*)
+                &fb->pixels[(uint32_t)y * fb->pitch + (uint32_t)r.x];
+            const uint32_t *want = (const uint32_t*)
+                &expected->pixels[(uint32_t)y * expected->pitch + (uint32_t)r.x];
+            if (memcmp(actual, want, (size_t)r.w * sizeof(uint32_t)) == 0) {
+                continue;
+            }
+            for (int32_t x = 0; x < r.w; x++) {
+                if (actual[x] == want[x]) {
+                    continue;
+                }
+                if (num_pixels++ == 0) {
+                    first = (vec2i){ r.x + x, y };
+                    actual_pixel = actual[x];
+                    expected_pixel = want[x];
+                }
+            }
+        }
+
+        if (num_pixels == 0) {
+            continue;
+        }
+        if (mismatched++ < RENDER_VERIFY_MAX_TILES) {
+            report_tile(frame, tile, &r, num_pixels, first, actual_pixel,
+                        expected_pixel);
+        }
+    }
+
+    if (mismatched > 0) {
+        verify_report("Frame %llu: %u of %u tiles differ from a full redraw",
+                      (unsigned long long)frame, mismatched, num_tiles);
+        _tiles.valid = false;
+    }
+    return mismatched;
+}
+
+static void free_verify_buffers(void)
+{
+    for (uint32_t t = 0; t < RENDER_MAX_TARGETS; t++) {
+        destroy_worker_target(&_verify.contexts[t]);
+        free(_verify.targets[t].pixels);
+        memset(&_verify.targets[t], 0, sizeof(eva_framebuffer));
+    }
+    free(_verify.composite.pixels);
+    memset(&_verify.composite, 0, sizeof(eva_framebuffer));
+}
+
+static bool start_render_thread(void)
+{
+    mutex_init(&_pipeline.lock);
+    cond_init(&_pipeline.wake);
+    cond_init(&_pipeline.done);
+    _pipeline.busy = false;
+    _pipeline.quit = false;
+    _pipeline.present = false;
+
+    if (!thread_start(&_pipeline.thread, render_thread_main, NULL)) {
+        console_log("Failed to start the render thread");
+        cond_destroy(&_pipeline.done);
+        cond_destroy(&_pipeline.wake);
+        mutex_destroy(&_pipeline.lock);
+        return false;
+    }
+    return true;
+}
+
+// Finishes the frame in flight before stopping the thread.
+static void stop_render_thread(void)
+{
+    mutex_lock(&_pipeline.lock);
+    _pipeline.quit = true;
+    cond_signal(&_pipeline.wake);
+    mutex_unlock(&_pipeline.lock);
+    thread_join(_pipeline.thread);
+
+    cond_destroy(&_pipeline.done);
+    cond_destroy(&_pipeline.wake);
+    mutex_destroy(&_pipeline.lock);
+}
+
+static void wait_for_render_thread(void)
+{
+    mutex_lock(&_pipeline.lock);
+    while (_pipeline.busy) {
+        cond_wait(&_pipeline.done, &_pipeline.lock);
+    }
+    mutex_unlock(&_pipeline.lock);
+}
+
+static void render_thread_main(void *data)
+{
+    (void)data;
+
+    mutex_lock(&_pipeline.lock);
+    for (;;) {
+        while (!_pipeline.busy && !_pipeline.quit) {
+            cond_wait(&_pipeline.wake, &_pipeline.lock);
+        }
+        if (!_pipeline.busy) {
+            break;
+        }
+        mutex_unlock(&_pipeline.lock);
+
+        draw_tiles();
+
+        mutex_lock(&_pipeline.lock);
+        _pipeline.busy = false;
+        cond_broadcast(&_pipeline.done);
+    }
+    mutex_unlock(&_pipeline.lock);
+}
+
+// Matches the size of the render thread's surface to the framebuffer. The
+// tile grid is rebuilt along with it so every tile is drawn again.
+static bool update_surface(const eva_framebuffer *fb)
+{
+    eva_framebuffer *s = &_pipeline.surface;
+    if (s->pixels && s->w == fb->w && s->h == fb->h) {
+        return true;
+    }
+
+    free(s->pixels);
+    *s = *fb;
+    s->pitch = fb->w;
+    s->pixels = calloc((size_t)fb->w * fb->h, sizeof(eva_pixel));
+    if (!s->pixels) {
+        console_log("Failed to allocate a %ux%u render surface", fb->w, fb->h);
+        memset(s, 0, sizeof(*s));
+        return false;
+    }
+    return true;
+}
+
+// Copies the damage of the last finished frame to the framebuffer.
+static void present_damage(const eva_framebuffer *fb)
+{
+    const eva_framebuffer *s = &_pipeline.surface;
+    if (!_pipeline.present) {
+        return;
+    }
+    _pipeline.present = false;
+
+    // The framebuffer was resized since, the surface follows on this frame.
+    if (s->w != fb->w || s->h != fb->h) {
+        return;
+    }
+
+    recti fb_rect = { 0, 0, (int32_t)fb->w, (int32_t)fb->h };
+    for (uint32_t i = 0; i < _pipeline.damage.count; i++) {
+        recti r;
+        if (!recti_intersection(&_pipeline.damage.rects[i], &fb_rect, &r)) {
+            continue;
+        }
+        for (int32_t y = r.y; y < r.y + r.h; y++) {
+            memcpy(&fb->pixels[(uint32_t)y * fb->pitch + (uint32_t)r.x],
+                   &s->pixels[(uint32_t)y * s->pitch + (uint32_t)r.x],
+                   (size_t)r.w * sizeof(eva_pixel));
+        }
+    }
+}
@@ -14,13 +14,116 @@ typedef enum font {
     FONT_COUNT
 } font;
 
+typedef struct render_cmd_stats {
+    uint32_t num_cmds; // Commands recorded for the last frame.
+    uint32_t max_cmds; // Most commands recorded for a single frame.
+    size_t cmd_bytes;  // Bytes of command records for the last frame.
+
+    // Commands skipped in the tiles of the last redraw because a later
+    // opaque rect covers them, counted once per tile.
+    uint32_t culled_draws;
+    uint64_t culled_pixels;
+
+    // Pixels moved by scroll regions on the last frame instead of drawn.
+    uint64_t scrolled_pixels;
+
+    size_t arena_high_water;
+    size_t arena_capacity;
+} render_cmd_stats;
+
+// What render_end_frame did for the last frame. In pipelined mode the
+// tiles of a frame are drawn while the next one records, so the raster
+// and composite numbers are those of the frame before.
+typedef struct render_frame_stats {
+    uint64_t frame; // Frames ended so far.
+
+    uint32_t num_cmds;    // Commands recorded.
+    uint32_t text_cmds;   // Text commands drawn to at least one tile.
+    uint32_t culled_cmds; // Commands hidden by opaque rects, once per tile.
+
+    // The tile grid, the tiles the commands were hashed into, the tiles
+    // drawn to any target and the tiles presented. A tile drawn on a layer
+    // and beneath it counts twice as drawn.
+    uint32_t tile_size;
+    uint32_t num_tiles;
+    uint32_t hashed_tiles;
+    uint32_t drawn_tiles;
+    uint32_t damaged_tiles;
+    uint64_t raster_pixels; // Pixels of the drawn tiles.
+
+    // Lines shaped for the frame, those whose shaping was reused and those
+    // reshaped only around an edit.
+    uint64_t shape_hits;
+    uint64_t shape_misses;
+    uint64_t shape_edits;
+
+    uint32_t sync_flushes; // Worker contexts flushed.
+
+    // Tiles that differ from drawing the frame from scratch, only checked
+    // in verify mode.
+    uint32_t mismatched_tiles;
+
+    // Milliseconds spent waiting for the render thread and presenting,
+    // bounding and hashing the commands, finding the damage and binning,
+    // culling and resolving glyphs, drawing the tiles and compositing them.
+    double wait_ms;
+    double hash_ms;
+    double damage_ms;
+    double prepare_ms;
+    double raster_ms;
+    double composite_ms;
+    double total_ms; // Of render_end_frame.
+} render_frame_stats;
+
 bool render_init(void);
 void render_shutdown(void);
 
 void render_begin_frame(void);
 void render_end_frame(void);
 
+// Sets the size in pixels of the tiles that damage is tracked in, clamped to
+// [32, 256]. 0 adapts the size to the damage seen over the last frames.
+void render_set_tile_size(uint32_t tile_size);
+uint32_t render_tile_size(void);
+
+// Renders the tiles of a frame on a render thread while the next frame is
+// recorded. Frames are presented one frame later, on the next
+// render_end_frame.
+void render_set_pipelined(bool pipelined);
+
+// Called with one line of the verify report at a time.
+typedef void (*render_verify_fn)(const char *line, void *user_data);
+
+// Draws every frame a second time from scratch and compares it pixel by
+// pixel with the incrementally updated framebuffer. Tiles that differ are
+// reported along with the commands drawn to them through fn, or to the
+// console if it's NULL, counted in render_frame_stats and redrawn on the
+// next frame. This is slow and makes pipelined mode wait for each frame.
+void render_set_verify(bool verify, render_verify_fn fn, void *user_data);
+
 void render_clear(const color *c);
 void render_draw_rect(const rect *r, const color *c);
 void render_draw_recti(const recti *r, const color *c);
 void render_draw_text(text *t, const rect *bbox, const rect *clip);
+
+// Everything drawn up to render_end_scroll is clipped to region, which is
+// filled with the opaque background first. offset is the position of the
+// content shown at the top left of the region and the commands are still
+// drawn where they land on screen. When only the offset changed since the
+// last frame the pixels already drawn are moved and just the content that
+// scrolled into view is drawn. Regions are matched with those of the last
+// frame in the order they are begun and can't be nested.
+void render_begin_scroll(const recti *region, const vec2i *offset,
+                         const color *background);
+void render_end_scroll(void);
+
+// Everything drawn up to render_end_layer goes to a buffer of the layer's
+// own which is composited over what is drawn outside of it. Changes to a
+// layer then only redraw the layer and the other way around. Layers are
+// matched with those of the last frame in the order they are begun, can't
+// be nested and may hold scroll regions but not be begun inside one.
+void render_begin_layer(void);
+void render_end_layer(void);
+
+void render_cmd_stats_get(render_cmd_stats *dst);
+void render_frame_stats_get(render_frame_stats *dst);
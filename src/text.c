@@ -1,80 +1,164 @@
 #include "text.h"
 
 #include <assert.h>
+#include <math.h>
 #include <stdio.h>
-
-#include <CoreFoundation/CFNumber.h>
-#include <CoreText/CoreText.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "eva/eva.h"
 
 #include "common.h"
 #include "color.h"
+#include "console.h"
+#include "font_native.h"
 #include "hash.h"
 #include "profiler.h"
 #include "rect.h"
 #include "ustr.h"
 #include "vec2.h"
 
-#define MAX_TEXT_ATTRS 2048
+// The end of an attribute run that goes on to the end of the text,
+// whatever its length.
+#define TEXT_ATTR_END INT32_MAX
 
+// A run of UTF-16 indices [start, end) with the same attributes.
 typedef struct text_attr {
     int32_t start;
-    int32_t len;
+    int32_t end;
 
     font_family_id font_family;
     double font_size;
     color color;
-
-    text_attr *next;
 } text_attr;
 
-typedef struct text {
-    ustr *str;
-    text_attr *attrs; // Linked list of text attributes
-    int32_t ref;
-
-    bool cached_extents;
-    vec2 extents;
+typedef struct text_glyph {
+    uint32_t id;
+    uint32_t cluster; // UTF-16 index of the first code unit of the glyph.
+    double x;         // Pen position relative to the start of the line.
+    double offset_x;
+    double offset_y;
+    double advance;
+    size_t run;
+    bool unsafe_to_break; // Shaping can't restart in front of the glyph.
+} text_glyph;
+
+typedef struct text_run {
+    font_face *face; // Reference held until the layout is invalidated.
+    color color;
+} text_run;
+
+// The shaped line of a text object. Built lazily on the first query and
+// kept until the attributes change, or reshaped around an edit of the
+// string.
+//
+// The glyphs and the carets are gap buffers so that an edit only writes the
+// ones it reshapes. Those in front of the gap are stored as they are and
+// those after it at the end of the storage, counted back from the end of the
+// line: the cluster from len and x or the caret offset from width. An edit
+// in front of them leaves them alone however it changes the length of the
+// line. Moving the gap flips the ones it passes, which for typing are the
+// few since the last edit.
+typedef struct text_layout {
+    bool valid;
+    bool reversed; // Clusters of some run decrease, as in right to left text.
+    size_t len;    // UTF-16 length of the string the layout is for.
+
+    text_glyph *glyphs;
+    size_t num_glyphs;
+    size_t glyphs_cap;
+    size_t glyphs_gap; // The glyphs from here on are stored at the end.
+
+    text_run *runs;
+    size_t num_runs;
+    size_t runs_cap;
+
+    // The caret offset in front of every UTF-16 index up to the length, so
+    // text_index_offset is a lookup.
+    double *carets;
+    size_t num_carets;
+    size_t carets_cap;
+    size_t carets_gap;
 
-    bool cached_metrics;
     double width;
-    double leading;
     double ascent;
     double descent;
+    double leading;
+} text_layout;
+
+typedef struct text {
+    ustr *str;
+    text_attr *attrs; // Sorted by start, never overlapping.
+    size_t num_attrs;
+    size_t attrs_cap;
+    uint64_t attrs_hash; // Of the runs, valid while attrs_hashed is set.
+    bool attrs_hashed;
+    int32_t ref;
+
+    text_layout layout;
 } text;
 
 typedef struct text_ctx {
-    // Text attribute storage.
-    text_attr attrs[MAX_TEXT_ATTRS];
+    // Layout lookups that found a shaped line and those that shaped one.
+    uint64_t layout_hits;
+    uint64_t layout_misses;
 
-    // Text attribute free list.
-    text_attr *free_list;
+    // Edits that only reshaped the glyphs around the change.
+    uint64_t layout_edits;
 
     bool initialized;
 } text_ctx;
 
 static text_ctx _ctx;
 
-static text_attr* get_next_attr();
-static void free_attr(text_attr *);
-static const char * get_font_family(font_family_id f);
-static void text_extents_macos(const text *t, vec2 *dst);
-static void text_metrics_macos(const text *t, double *width, double *leading,
-                               double *ascent, double *descent);
-static double text_index_offset_macos(const text *t, size_t index);
-static void text_draw_macos(const text *t, const rect *bbox, const rect *clip);
-static void text_draw_macos2(const text *t, const rect *bbox, const rect *clip);
+static bool paint_attr(text *t, const text_attr *a);
+static size_t first_attr_ending_after(const text *t, int32_t index);
+static bool edit_span(const text *t, size_t len, size_t start, size_t end,
+                      size_t *span_start, size_t *span_end);
+static void move_attrs(text *t, size_t start, size_t end, size_t len);
+static uint64_t attrs_hash(const text *t);
+static void init_text(text *t);
+static const text_layout* get_layout(const text *t);
+static void invalidate_layout(text *t);
+static const text_attr* attr_at(const text *t, size_t index, size_t *end);
+static text_run* push_run(text_layout *layout);
+static void flip_glyph(const text_layout *layout, text_glyph *g);
+static text_glyph get_glyph(const text_layout *layout, size_t i);
+static bool reserve_glyphs(text_layout *layout, size_t count);
+static void move_glyph_gap(text_layout *layout, size_t i);
+static bool push_glyph(text_layout *layout, const text_glyph *g);
+static double get_caret(const text_layout *layout, size_t index);
+static bool reserve_carets(text_layout *layout, size_t count);
+static void move_caret_gap(text_layout *layout, size_t index);
+static void push_carets(text_layout *layout, size_t index, size_t end,
+                        size_t first_glyph, size_t last_glyph, double x);
+static void update_text(text *t, size_t start, size_t old_end,
+                        size_t new_end);
+#ifdef BG_MACOS
+static void layout_build_macos(const text *t, text_layout *layout);
 static CFMutableAttributedStringRef create_attr_str(const text *t);
-static CTLineRef create_trunc_token(CFMutableAttributedStringRef attr_str);
+#else
+static void layout_build_ft(const text *t, text_layout *layout);
+static bool layout_edit_ft(text *t, size_t start, size_t old_end,
+                           size_t new_end, size_t span_start,
+                           size_t span_end);
+#endif
 
 void text_system_init()
 {
-    // Setup the free list.
-    for (int32_t i = 0; i < MAX_TEXT_ATTRS - 1; i++) {
-        _ctx.attrs[i].next = &_ctx.attrs[i + 1];
+    if (!font_system_init()) {
+        console_log("Failed to init the font system");
+        assert(false);
     }
-    _ctx.free_list = _ctx.attrs;
+
+    _ctx.initialized = true;
+}
+
+// Shuts the font system down, so every text has to be destroyed before.
+void text_system_shutdown(void)
+{
+    font_system_shutdown();
+    _ctx.initialized = false;
 }
 
 text* text_create(void)
@@ -87,11 +171,7 @@ text* text_create(void)
 
     t->str = ustr_create();
     assert(t->str);
-    t->attrs = NULL;
-    t->ref = 1;
-    t->cached_extents = false;
-    t->extents.x = 0;
-    t->extents.y = 0;
+    init_text(t);
 
     return t;
 }
@@ -107,11 +187,7 @@ text* text_create_ustr(ustr *str)
     }
 
     t->str = ustr_ref(str);
-    t->attrs = NULL;
-    t->ref = 1;
-    t->cached_extents = false;
-    t->extents.x = 0;
-    t->extents.y = 0;
+    init_text(t);
 
     return t;
 }
@@ -133,11 +209,7 @@ text* text_create_cstr(const char *cstr)
         return NULL;
     }
 
-    t->attrs = NULL;
-    t->ref = 1;
-    t->cached_extents = false;
-    t->extents.x = 0;
-    t->extents.y = 0;
+    init_text(t);
 
     return t;
 }
@@ -149,12 +221,11 @@ void text_destroy(text *t)
     ustr_destroy(t->str);
     t->ref--;
     if (t->ref == 0) {
-        text_attr *attr = t->attrs;
-        while (attr) {
-            text_attr *tmp = attr;
-            attr = attr->next;
-            free_attr(tmp);
-        }
+        invalidate_layout(t);
+        free(t->attrs);
+        free(t->layout.glyphs);
+        free(t->layout.runs);
+        free(t->layout.carets);
         free(t);
     }
 }
@@ -181,53 +252,49 @@ void text_add_attr(text *t,
 {
     assert(t);
     assert(c);
+    assert(start >= 0);
+    assert(len >= 0);
 
-    text_attr *a = get_next_attr();
-    assert(a);
-
-    a->start = start;
-    a->len = len;
-    a->font_family = font_family;
-    a->font_size = font_size;
-    a->color = c ? *c : COLOR_WHITE;
+    if (len == 0 || len >= TEXT_ATTR_END - start) {
+        len = TEXT_ATTR_END - start;
+    }
 
-    if (t->attrs) {
-        text_attr *attr = t->attrs;
-        while (attr->next)
-        {
-            attr = attr->next;
-        }
-        attr->next = a;
-    } 
-    else {
-        t->attrs = a;
+    text_attr a = {
+        .start = start,
+        .end = start + len,
+        .font_family = font_family,
+        .font_size = font_size,
+        .color = c ? *c : COLOR_WHITE,
+    };
+    if (a.start == a.end || !paint_attr(t, &a)) {
+        return;
     }
+    t->attrs_hashed = false;
 
     // Invalidate the cache since text attributes have changed.
-    t->cached_extents = false;
+    invalidate_layout(t);
 }
 
-void text_extents(const text *t, vec2 *dst)
+void text_attrs(const text *t, text_attr_fn fn, void *user_data)
 {
     assert(t);
-    assert(dst);
+    assert(fn);
 
-    if (t->cached_extents) {
-        *dst = t->extents;
+    for (size_t i = 0; i < t->num_attrs; i++) {
+        const text_attr *a = &t->attrs[i];
+        int32_t len = a->end == TEXT_ATTR_END ? 0 : a->end - a->start;
+        fn(a->start, len, a->font_family, a->font_size, &a->color, user_data);
     }
-    else {
+}
 
-#ifdef BG_MACOS
-        text_extents_macos(t, dst);
-#elif BG_WINDOWS
-        assert(false);
-#endif
+void text_extents(const text *t, vec2 *dst)
+{
+    assert(t);
+    assert(dst);
 
-        // Const gets in the way of opaque caching systems.
-        text *txt = (text*)t;
-        txt->cached_extents = true;
-        txt->extents = *dst;
-    }
+    const text_layout *layout = get_layout(t);
+    dst->x = layout->width;
+    dst->y = ceil(layout->ascent + layout->descent + layout->leading);
 }
 
 void text_metrics(const text *t, double *width, double *leading,
@@ -239,28 +306,11 @@ void text_metrics(const text *t, double *width, double *leading,
     assert(ascent);
     assert(descent);
 
-    if (t->cached_metrics) {
-        *width = t->width;
-        *leading = t->leading;
-        *ascent = t->ascent;
-        *descent = t->descent;
-    }
-    else {
-
-#ifdef BG_MACOS
-        text_metrics_macos(t, width, leading, ascent, descent);
-#elif BG_WINDOWS
-        assert(false);
-#endif
-
-        // Const gets in the way of opaque caching systems.
-        text *txt = (text*)t;
-        txt->cached_metrics = true;
-        txt->width = *width;
-        txt->leading = *leading;
-        txt->ascent = *ascent;
-        txt->descent = *descent;
-    }
+    const text_layout *layout = get_layout(t);
+    *width = layout->width;
+    *leading = layout->leading;
+    *ascent = layout->ascent;
+    *descent = layout->descent;
 }
 
 double text_index_offset(const text *t, size_t index)
@@ -270,57 +320,99 @@ double text_index_offset(const text *t, size_t index)
     assert(index >= 0);
     assert(index <= ustr_len(t->str));
 
+    const text_layout *layout = get_layout(t);
+    if (index < layout->num_carets) {
+        return get_caret(layout, index);
+    }
 
-#ifdef BG_MACOS
-    return text_index_offset_macos(t, index);
-#elif BG_WINDOWS
-    assert(false);
-#endif
+    return layout->width;
 }
 
-void text_draw(const text *t, const rect *bbox, const rect *clip)
+void text_glyphs(const text *t, const rect *bbox,
+                 text_glyph_fn fn, void *user_data)
 {
     assert(t);
     assert(bbox);
+    assert(fn);
 
-#ifdef BG_MACOS
-    text_draw_macos2(t, bbox, clip);
-#elif BG_WINDOWS
-    assert(false);
-#endif
+    const text_layout *line = get_layout(t);
+    if (line->num_glyphs == 0) {
+        return;
+    }
+
+    // Match CoreText which positions the baseline at the bottom of the
+    // bounding box.
+    double baseline = bbox->y + bbox->h;
+
+    // Truncate with an ellipsis when the line doesn't fit the bbox.
+    size_t num_glyphs = line->num_glyphs;
+    const text_run *ellipsis_run = &line->runs[get_glyph(line, 0).run];
+    uint32_t ellipsis_id = 0;
+    double ellipsis_x = -1.0;
+    if (line->width > bbox->w) {
+        ellipsis_id = font_face_glyph(ellipsis_run->face, 0x2026);
+        double ellipsis_w = font_face_glyph_advance(ellipsis_run->face,
+                                                    ellipsis_id);
+
+        ellipsis_x = 0.0;
+        while (num_glyphs > 0) {
+            text_glyph g = get_glyph(line, num_glyphs - 1);
+            if (g.x + g.advance + ellipsis_w <= bbox->w) {
+                ellipsis_x = g.x + g.advance;
+                break;
+            }
+            num_glyphs--;
+        }
+    }
+
+    for (size_t i = 0; i < num_glyphs; i++) {
+        text_glyph g = get_glyph(line, i);
+        const text_run *run = &line->runs[g.run];
+        fn(run->face, &run->color, g.id,
+           bbox->x + g.x + g.offset_x, baseline - g.offset_y,
+           user_data);
+    }
+
+    if (ellipsis_x >= 0.0) {
+        fn(ellipsis_run->face, &ellipsis_run->color, ellipsis_id,
+           bbox->x + ellipsis_x, baseline, user_data);
+    }
 }
 
-void text_hash(const text *t, uint32_t *v)
+void text_hash(const text *t, uint64_t *v)
 {
+    assert(t);
+    assert(v);
+
     ustr_hash(t->str, v);
-    text_attr *a = t->attrs;
-    while (a) {
-        hash(v, (uint8_t*)a, sizeof(*a));
-        a = a->next;
-    }
+    *v = hash64_combine(*v, attrs_hash(t));
 }
 
 bool text_hit(const text *t, const vec2 *pos, size_t *index)
 {
     assert(t);
     assert(pos);
-
-    CFMutableAttributedStringRef attr_str = create_attr_str(t);
-    CTTypesetterRef ts = CTTypesetterCreateWithAttributedString(attr_str);
-    CTLineRef line = CTTypesetterCreateLine(ts, CFRangeMake(0, 0));
-    CGPoint ct_pos = CGPointMake(pos->x, pos->y);
-
-    CFIndex ct_index = CTLineGetStringIndexForPosition(line, ct_pos);
-
-    CFRelease(line);
-    CFRelease(ts);
-    CFRelease(attr_str);
-
-    if (ct_index == kCFNotFound) {
-        return false;
+    assert(index);
+
+    // Snap to the closest caret position, in front of the first glyph whose
+    // middle is right of the position. Glyphs are laid out left to right so
+    // their middles are sorted and can be binary searched.
+    const text_layout *layout = get_layout(t);
+    size_t lo = 0;
+    size_t hi = layout->num_glyphs;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        text_glyph g = get_glyph(layout, mid);
+        if (pos->x < g.x + g.advance / 2.0) {
+            hi = mid;
+        }
+        else {
+            lo = mid + 1;
+        }
     }
+    *index = lo < layout->num_glyphs ? get_glyph(layout, lo).cluster
+                                     : ustr_len(t->str);
 
-    *index = (size_t)ct_index;
     return true;
 }
 
@@ -330,17 +422,7 @@ double text_index_pos(const text *t, size_t index)
     assert(t->str);
     assert(index < ustr_len(t->str));
 
-    CFMutableAttributedStringRef attr_str = create_attr_str(t);
-    CTTypesetterRef ts = CTTypesetterCreateWithAttributedString(attr_str);
-    CTLineRef line = CTTypesetterCreateLine(ts, CFRangeMake(0, 0));
-
-    double offset = CTLineGetOffsetForStringIndex(line, (long)index, NULL);
-
-    CFRelease(line);
-    CFRelease(ts);
-    CFRelease(attr_str);
-
-    return offset;
+    return text_index_offset(t, index);
 }
 
 void text_append(text *t, const uint16_t *data, size_t len)
@@ -348,9 +430,9 @@ void text_append(text *t, const uint16_t *data, size_t len)
     assert(t);
     assert(data);
 
+    size_t start = ustr_len(t->str);
     ustr_append(t->str, data, len);
-    t->cached_extents = false;
-    t->cached_metrics = false;
+    update_text(t, start, start, start + len);
 }
 
 void text_insert(text *t, size_t index, const uint16_t *data, size_t len)
@@ -359,8 +441,7 @@ void text_insert(text *t, size_t index, const uint16_t *data, size_t len)
     assert(data);
 
     ustr_insert(t->str, index, data, len);
-    t->cached_extents = false;
-    t->cached_metrics = false;
+    update_text(t, index, index, index + len);
 }
 
 void text_remove(text *t, size_t start, size_t end)
@@ -370,219 +451,548 @@ void text_remove(text *t, size_t start, size_t end)
     assert(start <= end);
 
     ustr_remove(t->str, start, end);
+    update_text(t, start, end, start);
 }
 
-static text_attr* get_next_attr()
+// Lays the attribute over the runs of the text. The runs it covers are
+// replaced and the ones it partly covers are cut down to the rest, so the
+// runs stay sorted and apart. Attributes added in order of start, like the
+// spans of a highlighted line, are appended. Returns false if out of memory.
+static bool paint_attr(text *t, const text_attr *a)
 {
-    text_attr *result = _ctx.free_list;
-    assert(result);
+    // The runs [first, last) overlap the attribute.
+    size_t first = first_attr_ending_after(t, a->start);
+    size_t last = first;
+    while (last < t->num_attrs && t->attrs[last].start < a->end) {
+        last++;
+    }
 
-    if (_ctx.free_list) {
-        _ctx.free_list = _ctx.free_list->next;
+    text_attr pieces[3];
+    size_t num_pieces = 0;
+    if (first < last && t->attrs[first].start < a->start) {
+        pieces[num_pieces] = t->attrs[first];
+        pieces[num_pieces++].end = a->start;
+    }
+    pieces[num_pieces++] = *a;
+    if (first < last && t->attrs[last - 1].end > a->end) {
+        pieces[num_pieces] = t->attrs[last - 1];
+        pieces[num_pieces++].start = a->end;
     }
 
-    // No longer point into the free list.
-    result->next = NULL;
-    return result;
+    size_t num_attrs = t->num_attrs - (last - first) + num_pieces;
+    if (num_attrs > t->attrs_cap) {
+        size_t new_cap = max(t->attrs_cap * 2, 4);
+        text_attr *attrs = realloc(t->attrs, new_cap * sizeof(text_attr));
+        if (!attrs) {
+            console_log("Failed to grow the attributes of a text");
+            return false;
+        }
+        t->attrs = attrs;
+        t->attrs_cap = new_cap;
+    }
+
+    memmove(t->attrs + first + num_pieces, t->attrs + last,
+            (t->num_attrs - last) * sizeof(text_attr));
+    memcpy(t->attrs + first, pieces, num_pieces * sizeof(text_attr));
+    t->num_attrs = num_attrs;
+    return true;
 }
 
-static void free_attr(text_attr *ta)
+// Binary searches for the first run that ends after index, which is the run
+// at index if any run contains it. Returns num_attrs if none does.
+static size_t first_attr_ending_after(const text *t, int32_t index)
 {
-    assert(ta);
+    size_t lo = 0;
+    size_t hi = t->num_attrs;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (t->attrs[mid].end <= index) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
 
-    ta->next = _ctx.free_list;
-    ta->color = COLOR_ZERO;
-    ta->start = 0;
-    ta->len = 0;
+// Finds the code units [span_start, span_end) of a string of len that share
+// the attributes of those that replace [start, end): the run, or the gap
+// between runs, that the edit lands in. Inserted code units take the
+// attributes of the one in front of them, or of the first one at the start
+// of the text, as they do when typing. Returns false if the edit crosses the
+// edge of the span or removes all of it, as then the spans of the string
+// themselves change.
+static bool edit_span(const text *t, size_t len, size_t start, size_t end,
+                      size_t *span_start, size_t *span_end)
+{
+    size_t index = end > start || start == 0 ? start : start - 1;
+    if (index >= TEXT_ATTR_END) {
+        return false;
+    }
 
-    _ctx.free_list = ta;
+    size_t i = first_attr_ending_after(t, (int32_t)index);
+    if (i < t->num_attrs && (size_t)t->attrs[i].start <= index) {
+        *span_start = (size_t)t->attrs[i].start;
+        *span_end = (size_t)t->attrs[i].end;
+    }
+    else {
+        *span_start = i > 0 ? (size_t)t->attrs[i - 1].end : 0;
+        *span_end = i < t->num_attrs ? (size_t)t->attrs[i].start
+                                     : TEXT_ATTR_END;
+    }
+    *span_end = min(*span_end, len);
+
+    return *span_start <= start && end <= *span_end &&
+           (start == end || *span_start < start || end < *span_end);
 }
 
-static const char * get_font_family(font_family_id f)
+// Moves the runs along with an edit that replaced the code units
+// [start, end) by len new ones, which take the attributes edit_span gives
+// them. Runs that were removed with the code units are dropped.
+static void move_attrs(text *t, size_t start, size_t end, size_t len)
 {
-    switch (f) {
-        case FONT_FAMILY_MENLO:
-            return "Menlo";
-        case FONT_FAMILY_MONACO:
-            return "Monaco";
-        case FONT_FAMILY_COURIER_NEW:
-            return "Courier New";
-    };
+    size_t removed = end - start;
+    size_t first = start > 0 ? first_attr_ending_after(t, (int32_t)start - 1)
+                             : 0;
+    size_t num_attrs = first;
+    for (size_t i = first; i < t->num_attrs; i++) {
+        text_attr a = t->attrs[i];
+        size_t bounds[2] = { (size_t)a.start, (size_t)a.end };
+        for (size_t j = 0; j < 2; j++) {
+            size_t b = bounds[j];
+            if (b == TEXT_ATTR_END) {
+                continue;
+            }
+            if (b > start) {
+                b = b < end ? start : b - removed;
+            }
+
+            // An end at the edit takes the new code units in and so does a
+            // start at the start of the text. Any other start follows them.
+            if (b > start || (b == start && (j == 1 || start > 0))) {
+                b = min(b + len, (size_t)TEXT_ATTR_END);
+            }
+            bounds[j] = b;
+        }
+        a.start = (int32_t)bounds[0];
+        a.end = (int32_t)bounds[1];
+        if (a.start != t->attrs[i].start || a.end != t->attrs[i].end) {
+            t->attrs_hashed = false;
+        }
+        if (a.start < a.end) {
+            t->attrs[num_attrs++] = a;
+        }
+    }
+    if (num_attrs != t->num_attrs) {
+        t->num_attrs = num_attrs;
+        t->attrs_hashed = false;
+    }
 }
 
-static void text_extents_macos(const text *t, vec2 *dst)
+// Returns the hash of the runs, hashing them again only after they changed.
+static uint64_t attrs_hash(const text *t)
+{
+    if (!t->attrs_hashed) {
+        // Field by field to leave out the padding.
+        uint64_t h = HASH64_INITIAL;
+        for (size_t i = 0; i < t->num_attrs; i++) {
+            const text_attr *a = &t->attrs[i];
+            hash64_state s;
+            hash64_begin(&s);
+            hash64_update(&s, &a->start, sizeof(a->start));
+            hash64_update(&s, &a->end, sizeof(a->end));
+            hash64_update(&s, &a->font_family, sizeof(a->font_family));
+            hash64_update(&s, &a->font_size, sizeof(a->font_size));
+            hash64_update(&s, &a->color, sizeof(a->color));
+            h = hash64_combine(h, hash64_digest(&s));
+        }
+
+        // Const gets in the way of opaque caching systems.
+        text *txt = (text*)t;
+        txt->attrs_hash = h;
+        txt->attrs_hashed = true;
+    }
+
+    return t->attrs_hash;
+}
+
+static void init_text(text *t)
+{
+    t->attrs = NULL;
+    t->num_attrs = 0;
+    t->attrs_cap = 0;
+    t->attrs_hash = HASH64_INITIAL;
+    t->attrs_hashed = true;
+    t->ref = 1;
+    memset(&t->layout, 0, sizeof(t->layout));
+}
+
+static const text_layout* get_layout(const text *t)
+{
+    if (t->layout.valid) {
+        _ctx.layout_hits++;
+    }
+    else {
+        _ctx.layout_misses++;
+
+        // Const gets in the way of opaque caching systems.
+        text *txt = (text*)t;
+        text_layout *layout = &txt->layout;
+
+        profiler_begin_name("text_layout_build");
+#ifdef BG_MACOS
+        layout_build_macos(t, layout);
+#else
+        layout_build_ft(t, layout);
+#endif
+        layout->len = ustr_len(t->str);
+        if (reserve_carets(layout, layout->len + 1)) {
+            push_carets(layout, 0, layout->len + 1,
+                        0, layout->num_glyphs, layout->width);
+        }
+        else {
+            console_log("Failed to allocate the carets of a text");
+        }
+        profiler_end;
+
+        layout->valid = true;
+    }
+
+    return &t->layout;
+}
+
+void text_cache_stats_get(text_cache_stats *dst)
 {
-    assert(t);
     assert(dst);
 
-    // TODO: Don't throw these results away. Cache them so they don't have to
-    // be recalculated at draw time.
-    CFMutableAttributedStringRef attr_str = create_attr_str(t);
+    dst->layout_hits = _ctx.layout_hits;
+    dst->layout_misses = _ctx.layout_misses;
+    dst->layout_edits = _ctx.layout_edits;
+}
 
-    // Create the framesetter with the attributed string.
-    CTFramesetterRef framesetter =
-             CTFramesetterCreateWithAttributedString(attr_str);
-    CFRelease(attr_str);
+// Drops the shaped line but keeps the glyph and run storage around for
+// the next build.
+static void invalidate_layout(text *t)
+{
+    text_layout *layout = &t->layout;
+    if (!layout->valid) {
+        return;
+    }
 
-    // Find a frame that will fit the string.
-    CFRange string_range = {0};
-    CGSize frame_constraints = { CGFLOAT_MAX, CGFLOAT_MAX };
-    CFRange fit_range = {0};
-    CGSize frame_size =  CTFramesetterSuggestFrameSizeWithConstraints(
-            framesetter,
-            string_range,
-            NULL,
-            frame_constraints,
-            &fit_range);
+    for (size_t i = 0; i < layout->num_runs; i++) {
+        font_face_release(layout->runs[i].face);
+    }
 
-    dst->x = frame_size.width;
-    dst->y = frame_size.height;
+    layout->valid = false;
+    layout->reversed = false;
+    layout->len = 0;
+    layout->num_glyphs = 0;
+    layout->glyphs_gap = 0;
+    layout->num_runs = 0;
+    layout->num_carets = 0;
+    layout->carets_gap = 0;
+    layout->width = 0.0;
+    layout->ascent = 0.0;
+    layout->descent = 0.0;
+    layout->leading = 0.0;
+}
 
-    CFRelease(framesetter);
+// Called once the code units [start, old_end) of the string were replaced
+// by [start, new_end). Moves the attributes along, then reshapes around the
+// edit when the backend can and drops the layout otherwise.
+static void update_text(text *t, size_t start, size_t old_end,
+                        size_t new_end)
+{
+    size_t old_len = ustr_len(t->str) - new_end + old_end;
+    size_t span_start, span_end;
+    bool in_span = edit_span(t, old_len, start, old_end,
+                             &span_start, &span_end);
+    move_attrs(t, start, old_end, new_end - start);
+
+#ifdef BG_MACOS
+    (void)in_span;
+#else
+    if (in_span && layout_edit_ft(t, start, old_end, new_end,
+                                  span_start, span_end)) {
+        _ctx.layout_edits++;
+        return;
+    }
+#endif
+    invalidate_layout(t);
 }
 
-static void text_metrics_macos(const text *t, double *width, double *leading,
-                               double *ascent, double *descent)
+// Returns the attribute that applies to the UTF-16 index, or NULL if none
+// does, and sets end to the index where that stops being the case.
+// Attributes added later took precedence over earlier ones when they were
+// painted, as they do with CoreText.
+static const text_attr* attr_at(const text *t, size_t index, size_t *end)
 {
-    CFMutableAttributedStringRef attr_str = create_attr_str(t);
-    CTTypesetterRef ts = CTTypesetterCreateWithAttributedString(attr_str);
-    CTLineRef line = CTTypesetterCreateLine(ts, CFRangeMake(0, 0));
+    assert(index < TEXT_ATTR_END);
 
-    *width = CTLineGetTypographicBounds(line, ascent, descent, leading);
+    size_t i = first_attr_ending_after(t, (int32_t)index);
+    if (i == t->num_attrs) {
+        *end = SIZE_MAX;
+        return NULL;
+    }
 
-    CFRelease(line);
-    CFRelease(ts);
-    CFRelease(attr_str);
+    const text_attr *a = &t->attrs[i];
+    if ((size_t)a->start > index) {
+        *end = (size_t)a->start;
+        return NULL;
+    }
+    *end = (size_t)a->end;
+    return a;
 }
 
-static double text_index_offset_macos(const text *t, size_t index)
+static text_run* push_run(text_layout *layout)
 {
-    CFMutableAttributedStringRef attr_str = create_attr_str(t);
-    CTTypesetterRef ts = CTTypesetterCreateWithAttributedString(attr_str);
-    CTLineRef line = CTTypesetterCreateLine(ts, CFRangeMake(0, 0));
-    double offset = CTLineGetOffsetForStringIndex(line, (CFIndex)index,
-                                                        NULL);
+    if (layout->num_runs == layout->runs_cap) {
+        size_t new_cap = max(layout->runs_cap * 2, 4);
+        text_run *runs = realloc(layout->runs, new_cap * sizeof(text_run));
+        if (!runs) {
+            return NULL;
+        }
+        layout->runs = runs;
+        layout->runs_cap = new_cap;
+    }
 
-    CFRelease(line);
-    CFRelease(ts);
-    CFRelease(attr_str);
+    text_run *run = &layout->runs[layout->num_runs++];
+    memset(run, 0, sizeof(*run));
+    return run;
+}
 
-    return offset;
+// Flips the cluster and x of a glyph between counting from the start and
+// from the end of the line, which is the same sum both ways.
+static void flip_glyph(const text_layout *layout, text_glyph *g)
+{
+    g->cluster = (uint32_t)(layout->len - g->cluster);
+    g->x = layout->width - g->x;
 }
 
-static void text_draw_macos(const text *t, const rect *bbox,
-                            const rect *clip)
+// Returns the glyph at i with its cluster and x from the start of the line.
+static text_glyph get_glyph(const text_layout *layout, size_t i)
 {
-    eva_framebuffer fb = eva_get_framebuffer();
-    int32_t fb_height = (int32_t)fb.h;
-    uint32_t bitmap_info = kCGImageAlphaPremultipliedFirst |
-                           kCGBitmapByteOrder32Little;
-
-    CGColorSpaceRef rgbColorSpace = CGColorSpaceCreateDeviceRGB();
-    size_t bytes_per_row = fb.pitch * 4;
-    CGContextRef context = CGBitmapContextCreate(fb.pixels,
-                                                 fb.w, fb.h,
-                                                 8,
-                                                 bytes_per_row, 
-                                                 rgbColorSpace,
-                                                 bitmap_info);
-
-    // Core text uses bottom-up coords but we use top down so we have to
-    // invert our clip rect here.
-    double inverted_clip_y = fb_height - clip->y - clip->h;
-    CGRect cg_clip = CGRectMake(clip->x, inverted_clip_y, clip->w, clip->h);
-    CGContextClipToRect(context, cg_clip); 
+    if (i < layout->glyphs_gap) {
+        return layout->glyphs[i];
+    }
 
-    CFMutableAttributedStringRef attr_str = create_attr_str(t);
+    text_glyph g = layout->glyphs[layout->glyphs_cap - layout->num_glyphs + i];
+    flip_glyph(layout, &g);
+    return g;
+}
 
-    // Create the framesetter with the attributed string.
-    CTFramesetterRef framesetter =
-             CTFramesetterCreateWithAttributedString(attr_str);
-    CFRelease(attr_str);
+// Makes room for count glyphs in total.
+static bool reserve_glyphs(text_layout *layout, size_t count)
+{
+    if (count > layout->glyphs_cap) {
+        size_t new_cap = max(max(layout->glyphs_cap * 2, 16), count);
+        text_glyph *glyphs = realloc(layout->glyphs,
+                                     new_cap * sizeof(text_glyph));
+        if (!glyphs) {
+            return false;
+        }
+
+        size_t after = layout->num_glyphs - layout->glyphs_gap;
+        memmove(glyphs + new_cap - after,
+                glyphs + layout->glyphs_cap - after,
+                after * sizeof(text_glyph));
+        layout->glyphs = glyphs;
+        layout->glyphs_cap = new_cap;
+    }
+    return true;
+}
+
+// Moves the gap in front of the glyph at i, flipping the glyphs it passes.
+static void move_glyph_gap(text_layout *layout, size_t i)
+{
+    text_glyph *after = layout->glyphs + layout->glyphs_cap -
+                        layout->num_glyphs;
+    while (layout->glyphs_gap > i) {
+        size_t j = --layout->glyphs_gap;
+        after[j] = layout->glyphs[j];
+        flip_glyph(layout, &after[j]);
+    }
+    while (layout->glyphs_gap < i) {
+        size_t j = layout->glyphs_gap++;
+        layout->glyphs[j] = after[j];
+        flip_glyph(layout, &layout->glyphs[j]);
+    }
+}
 
-    // Create a path which bounds the area where you will be drawing text.
-    // The path need not be rectangular.
-    CGMutablePathRef path = CGPathCreateMutable();
+// Adds the glyph in front of the gap.
+static bool push_glyph(text_layout *layout, const text_glyph *g)
+{
+    if (!reserve_glyphs(layout, layout->num_glyphs + 1)) {
+        return false;
+    }
 
-    CGRect bounds = CGRectMake(bbox->x, 
-                               fb_height - bbox->y - bbox->h,
-                               bbox->w, bbox->h);
-    CGPathAddRect(path, NULL, bounds);
+    layout->glyphs[layout->glyphs_gap++] = *g;
+    layout->num_glyphs++;
+    return true;
+}
 
-    // Create a frame.
-    CTFrameRef frame = CTFramesetterCreateFrame(framesetter,
-              CFRangeMake(0, 0), path, NULL);
-     
-    profiler_begin_name("CTFrameDraw");
-    // Draw the specified frame in the given context.
-    CTFrameDraw(frame, context);
-    profiler_end;
-     
-    // Release the objects we used.
-    CFRelease(frame);
-    CFRelease(path);
-    CFRelease(framesetter);
+static double get_caret(const text_layout *layout, size_t index)
+{
+    if (index < layout->carets_gap) {
+        return layout->carets[index];
+    }
+    return layout->width - layout->carets[layout->carets_cap -
+                                          layout->num_carets + index];
+}
+
+// Makes room for count carets in total.
+static bool reserve_carets(text_layout *layout, size_t count)
+{
+    if (count > layout->carets_cap) {
+        size_t new_cap = max(layout->carets_cap * 2, count);
+        double *carets = realloc(layout->carets, new_cap * sizeof(double));
+        if (!carets) {
+            return false;
+        }
 
-    CGContextRelease(context);
-    CGColorSpaceRelease(rgbColorSpace);
+        size_t after = layout->num_carets - layout->carets_gap;
+        memmove(carets + new_cap - after,
+                carets + layout->carets_cap - after,
+                after * sizeof(double));
+        layout->carets = carets;
+        layout->carets_cap = new_cap;
+    }
+    return true;
 }
 
-static void text_draw_macos2(const text *t, const rect *bbox,
-                             const rect *clip)
+// Moves the gap in front of the caret of index, like move_glyph_gap.
+static void move_caret_gap(text_layout *layout, size_t index)
 {
-    eva_framebuffer fb = eva_get_framebuffer();
-    int32_t fb_height = (int32_t)fb.h;
-    uint32_t bitmap_info = kCGImageAlphaPremultipliedFirst |
-                           kCGBitmapByteOrder32Little;
-
-    CGColorSpaceRef rgbColorSpace = CGColorSpaceCreateDeviceRGB();
-    size_t bytes_per_row = fb.pitch * 4;
-    CGContextRef context = CGBitmapContextCreate(fb.pixels,
-                                                 fb.w, fb.h,
-                                                 8,
-                                                 bytes_per_row, 
-                                                 rgbColorSpace,
-                                                 bitmap_info);
-
-    // Core text uses bottom-up coords but we use top down so we have to
-    // invert our clip rect here.
-    double inverted_clip_y = fb_height - clip->y - clip->h;
-    CGRect cg_clip = CGRectMake(clip->x, inverted_clip_y, clip->w, clip->h);
-    CGContextClipToRect(context, cg_clip); 
+    double *after = layout->carets + layout->carets_cap - layout->num_carets;
+    while (layout->carets_gap > index) {
+        size_t j = --layout->carets_gap;
+        after[j] = layout->width - layout->carets[j];
+    }
+    while (layout->carets_gap < index) {
+        size_t j = layout->carets_gap++;
+        layout->carets[j] = layout->width - after[j];
+    }
+}
 
-    CFMutableAttributedStringRef attr_str = create_attr_str(t);
+// Adds the carets of the indices [index, end) in front of the gap, which
+// has to have room for them. The caret in front of an index sits in front
+// of the first glyph of the cluster that contains it, which is the first
+// glyph whose cluster is at or past the index. The glyphs
+// [first_glyph, last_glyph) cover the indices and those past their clusters
+// sit at x.
+static void push_carets(text_layout *layout, size_t index, size_t end,
+                        size_t first_glyph, size_t last_glyph, double x)
+{
+    // Every glyph covers the indices past the furthest cluster of the
+    // glyphs before it, up to its own.
+    for (size_t i = first_glyph; i < last_glyph && index < end; i++) {
+        text_glyph g = get_glyph(layout, i);
+        for (size_t last = min((size_t)g.cluster + 1, end); index < last;
+             index++) {
+            layout->carets[layout->carets_gap++] = g.x;
+            layout->num_carets++;
+        }
+    }
+    for (; index < end; index++) {
+        layout->carets[layout->carets_gap++] = x;
+        layout->num_carets++;
+    }
+}
 
-    // Create the framesetter with the attributed string.
+#ifdef BG_MACOS
+static void layout_build_macos(const text *t, text_layout *layout)
+{
+    eva_framebuffer fb = eva_get_framebuffer();
+    CFMutableAttributedStringRef attr_str = create_attr_str(t);
     CTTypesetterRef ts = CTTypesetterCreateWithAttributedString(attr_str);
-
-    // Create a line.
     CTLineRef line = CTTypesetterCreateLine(ts, CFRangeMake(0, 0));
+    CFRelease(ts);
+    CFRelease(attr_str);
+
+    CGFloat ascent, descent, leading;
+    layout->width = CTLineGetTypographicBounds(line,
+                                               &ascent, &descent, &leading);
+    layout->ascent = ascent;
+    layout->descent = descent;
+    layout->leading = leading;
+
+    CFArrayRef runs = CTLineGetGlyphRuns(line);
+    CFIndex num_runs = CFArrayGetCount(runs);
+    for (CFIndex r = 0; r < num_runs; r++) {
+        CTRunRef ct_run = (CTRunRef)CFArrayGetValueAtIndex(runs, r);
+        CFIndex count = CTRunGetGlyphCount(ct_run);
+        if (count == 0) {
+            continue;
+        }
+
+        CGGlyph *glyphs = malloc((size_t)count * sizeof(CGGlyph));
+        CGPoint *positions = malloc((size_t)count * sizeof(CGPoint));
+        CGSize *advances = malloc((size_t)count * sizeof(CGSize));
+        CFIndex *indices = malloc((size_t)count * sizeof(CFIndex));
+        text_run *run = glyphs && positions && advances && indices
+                      ? push_run(layout) : NULL;
+        if (!run) {
+            free(glyphs);
+            free(positions);
+            free(advances);
+            free(indices);
+            break;
+        }
 
-    CGRect line_bounds = CTLineGetImageBounds(line, context);
-    if (line_bounds.size.width > bbox->w) {
-        CTLineRef truncation_token = create_trunc_token(attr_str);
+        CFRange all = CFRangeMake(0, 0);
+        CTRunGetGlyphs(ct_run, all, glyphs);
+        CTRunGetPositions(ct_run, all, positions);
+        CTRunGetAdvances(ct_run, all, advances);
+        CTRunGetStringIndices(ct_run, all, indices);
+
+        CFDictionaryRef attrs = CTRunGetAttributes(ct_run);
+        CTFontRef font = CFDictionaryGetValue(attrs, kCTFontAttributeName);
+        size_t attr_end;
+        const text_attr *attr = attr_at(t, (size_t)indices[0], &attr_end);
+        run->face = NULL;
+        if (attr) {
+            run->face = font_get(attr->font_family, attr->font_size,
+                                 fb.scale_x);
+            if (run->face && !CFEqual(font_face_ct(run->face), font)) {
+                font_face_release(run->face);
+                run->face = NULL;
+            }
+        }
+        if (!run->face) {
+            // CoreText fell back to a font we didn't ask for.
+            run->face = font_face_create_ct(font);
+        }
+        if (!run->face) {
+            layout->num_runs--;
+            free(glyphs);
+            free(positions);
+            free(advances);
+            free(indices);
+            break;
+        }
+        run->color = attr ? attr->color : COLOR_BLACK;
+
+        for (CFIndex i = 0; i < count; i++) {
+            text_glyph g = {
+                .id = glyphs[i],
+                .cluster = (uint32_t)indices[i],
+                .x = positions[i].x,
+                .offset_x = 0.0,
+                .offset_y = positions[i].y,
+                .advance = advances[i].width,
+                .run = layout->num_runs - 1,
+            };
+            push_glyph(layout, &g);
+        }
 
-        CTLineRef trunc_line = CTLineCreateTruncatedLine(
-                line, bbox->w, kCTLineTruncationEnd, truncation_token);
-        CFRelease(truncation_token);
-        CFRelease(line);
-        line = trunc_line;
+        free(glyphs);
+        free(positions);
+        free(advances);
+        free(indices);
     }
-    CFRelease(attr_str);
 
-    CGContextSetTextPosition(context, bbox->x, fb_height - bbox->y - bbox->h);
-     
-    profiler_begin_name("CTLineDraw");
-    // Draw the specified frame in the given context.
-    CTLineDraw(line, context);
-    profiler_end;
-     
-    // Release the objects we used.
     CFRelease(line);
-    CFRelease(ts);
-
-    CGContextRelease(context);
-    CGColorSpaceRelease(rgbColorSpace);
 }
 
 static CFMutableAttributedStringRef create_attr_str(const text *t)
@@ -612,57 +1022,24 @@ static CFMutableAttributedStringRef create_attr_str(const text *t)
    // CFAttributedStringSetAttribute(attr_str, CFRangeMake(0, len),
    //                                kCTForegroundColorAttributeName, white);
 
-    text_attr *attr = t->attrs;
-    while (attr) {
-        size_t len = attr->len == 0 ? ustr_len(t->str) : (size_t)attr->len;
-        CFRange r = CFRangeMake(attr->start, (int32_t)len);
+    for (size_t i = 0; i < t->num_attrs; i++) {
+        const text_attr *attr = &t->attrs[i];
+        if (attr->start >= len) {
+            break;
+        }
+        long end = min((long)attr->end, len);
+        CFRange r = CFRangeMake(attr->start, end - attr->start);
 
         // Font
-        const char *font_family = get_font_family(attr->font_family);
-        const void *keys[] = {kCTFontFamilyNameAttribute, kCTFontSizeAttribute};
-        CFStringRef font_family_value = CFStringCreateWithBytesNoCopy(
-                NULL, 
-                (uint8_t*)font_family, (long)strlen(font_family), 
-                kCFStringEncodingUTF8, 
-                false, 
-                kCFAllocatorNull);
-        double scaled_font_size = attr->font_size * fb.scale_x;
-        CFNumberRef font_size_value = CFNumberCreate(
-                NULL,
-                kCFNumberFloat32Type,
-                &scaled_font_size);
-        const void *values[] = { font_family_value, font_size_value };
-        CFDictionaryRef font_attrs = CFDictionaryCreate(
-                kCFAllocatorDefault, 
-                keys,
-                values,
-                2,
-                &kCFTypeDictionaryKeyCallBacks,
-                &kCFTypeDictionaryValueCallBacks);
-
-        CTFontDescriptorRef font_desc = 
-            CTFontDescriptorCreateWithAttributes(font_attrs);
-        CTFontRef font = CTFontCreateWithFontDescriptor(
-                font_desc,
-                scaled_font_size,
-                NULL);
-        CFAttributedStringSetAttribute(attr_str,
-                                       r,
-                                       kCTFontAttributeName,
-                                       font);
-       // CFStringRef x = CTFontCopyFullName(font);
-       // CFStringRef y = CTFontCopyFamilyName(font);
-
-       // printf("Font name %s\n", CFStringGetCStringPtr(x, kCFStringEncodingUTF8));
-       // printf("Family name %s\n", CFStringGetCStringPtr(y, kCFStringEncodingUTF8));
-
-       // CFRelease(x);
-       // CFRelease(y);
-
-        CFRelease(font);
-        CFRelease(font_desc);
-        CFRelease(font_attrs);
-        CFRelease(font_size_value);
+        font_face *face = font_get(attr->font_family, attr->font_size,
+                                   fb.scale_x);
+        if (face) {
+            CFAttributedStringSetAttribute(attr_str,
+                                           r,
+                                           kCTFontAttributeName,
+                                           font_face_ct(face));
+            font_face_release(face);
+        }
 
         // Color
         if (attr->color.r != 0.0f ||
@@ -678,25 +1055,267 @@ static CFMutableAttributedStringRef create_attr_str(const text *t)
                                            color);
             CFRelease(color);
         }
-
-        attr = attr->next;
     }
 
     profiler_end;
     return attr_str;
 }
 
-static CTLineRef create_trunc_token(CFMutableAttributedStringRef attr_str)
+#else
+
+static text_run* add_run(text_layout *layout, const text_attr *attr)
+{
+    eva_framebuffer fb = eva_get_framebuffer();
+
+    text_run *run = push_run(layout);
+    if (!run) {
+        return NULL;
+    }
+
+    font_family_id family = attr ? attr->font_family : FONT_FAMILY_DEFAULT;
+    double font_size = attr ? attr->font_size : 12.0;
+    run->face = font_get(family, font_size, fb.scale_x);
+    run->color = attr ? attr->color : COLOR_BLACK;
+    if (!run->face) {
+        layout->num_runs--;
+        return NULL;
+    }
+
+    double ascent, descent, leading;
+    font_face_metrics(run->face, &ascent, &descent, &leading);
+    layout->ascent = max(layout->ascent, ascent);
+    layout->descent = max(layout->descent, descent);
+    layout->leading = max(layout->leading, leading);
+
+    return run;
+}
+
+// Shapes the code units [start, end) of the string, with the rest of it as
+// context, into buf and returns the number of glyphs.
+static unsigned int shape(hb_buffer_t *buf, font_face *face,
+                          const uint16_t *data, size_t len,
+                          size_t start, size_t end)
+{
+    hb_buffer_clear_contents(buf);
+    hb_buffer_add_utf16(buf, data, (int)len,
+                        (unsigned int)start, (int)(end - start));
+    hb_buffer_guess_segment_properties(buf);
+    hb_shape(font_face_hb(face), buf, NULL, 0);
+
+    unsigned int num_glyphs = 0;
+    hb_buffer_get_glyph_infos(buf, &num_glyphs);
+    return num_glyphs;
+}
+
+static text_glyph make_glyph(const hb_glyph_info_t *info,
+                             const hb_glyph_position_t *pos,
+                             double pen, size_t run)
+{
+    hb_glyph_flags_t flags = hb_glyph_info_get_glyph_flags(info);
+    return (text_glyph){
+        .id = info->codepoint,
+        .cluster = info->cluster,
+        .x = pen,
+        .offset_x = pos->x_offset / 64.0,
+        .offset_y = pos->y_offset / 64.0,
+        .advance = pos->x_advance / 64.0,
+        .run = run,
+        .unsafe_to_break = (flags & HB_GLYPH_FLAG_UNSAFE_TO_BREAK) != 0,
+    };
+}
+
+static void layout_build_ft(const text *t, text_layout *layout)
+{
+    const uint16_t *data = ustr_data(t->str);
+    size_t len = ustr_len(t->str);
+
+    if (len == 0) {
+        // Empty text still has a height so that carets and text fields
+        // can be laid out before anything is typed.
+        add_run(layout, t->num_attrs > 0 ? &t->attrs[0] : NULL);
+        return;
+    }
+
+    hb_buffer_t *buf = hb_buffer_create();
+    double pen = 0.0;
+    size_t start = 0;
+    while (start < len) {
+        size_t end;
+        const text_attr *attr = attr_at(t, start, &end);
+        end = min(end, len);
+
+        text_run *run = add_run(layout, attr);
+        if (!run) {
+            start = end;
+            continue;
+        }
+        size_t run_index = layout->num_runs - 1;
+
+        unsigned int num_glyphs = shape(buf, run->face, data, len,
+                                        start, end);
+        hb_glyph_info_t *info = hb_buffer_get_glyph_infos(buf, NULL);
+        hb_glyph_position_t *pos = hb_buffer_get_glyph_positions(buf, NULL);
+        for (unsigned int i = 0; i < num_glyphs; i++) {
+            text_glyph g = make_glyph(&info[i], &pos[i], pen, run_index);
+            push_glyph(layout, &g);
+            pen += g.advance;
+        }
+        if (num_glyphs > 1 && info[0].cluster > info[num_glyphs - 1].cluster) {
+            layout->reversed = true;
+        }
+
+        start = end;
+    }
+    hb_buffer_destroy(buf);
+
+    layout->width = pen;
+}
+
+// Returns the first glyph in [first, last) whose cluster is at or past
+// index, or last if there is none. Clusters never decrease unless the
+// layout is reversed.
+static size_t find_cluster(const text_layout *layout, size_t first,
+                           size_t last, size_t index)
+{
+    while (first < last) {
+        size_t mid = first + (last - first) / 2;
+        if (get_glyph(layout, mid).cluster < index) {
+            first = mid + 1;
+        }
+        else {
+            last = mid;
+        }
+    }
+    return first;
+}
+
+// Returns the glyph after the cluster of the glyph at i, staying before
+// last.
+static size_t next_cluster(const text_layout *layout, size_t i, size_t last)
 {
-    CFRange range;
-    CFDictionaryRef existing_attrs =
-        CFAttributedStringGetAttributes(attr_str, 0, &range);
+    uint32_t cluster = get_glyph(layout, i).cluster;
+    while (i < last && get_glyph(layout, i).cluster == cluster) {
+        i++;
+    }
+    return i;
+}
 
-    CFAttributedStringRef trunc_str =
-        CFAttributedStringCreate(NULL, CFSTR("\u2026"), existing_attrs);
-    CTLineRef token = CTLineCreateWithAttributedString(trunc_str);
+// Returns the first glyph of the cluster before the glyph at i, staying at
+// or after first.
+static size_t prev_cluster(const text_layout *layout, size_t first, size_t i)
+{
+    if (i > first) {
+        i--;
+    }
+    while (i > first &&
+           get_glyph(layout, i - 1).cluster == get_glyph(layout, i).cluster) {
+        i--;
+    }
+    return i;
+}
 
-    CFRelease(trunc_str);
+// Reshapes the layout after the code units [start, old_end) of the string
+// were replaced by [start, new_end), so typing into a long line costs the
+// same as into a short one. The edit lands in the attribute span
+// [span_start, span_end) from before it, whose run of the layout keeps its
+// face. Only the glyphs of that run between the closest breaks that
+// HarfBuzz marks as safe on either side of the edit are shaped again, at
+// least one cluster further than the edit as its neighbours can kern with
+// or join the new code units. The glyph and caret gaps are moved to them so
+// the rest of the line is left where it is stored. Returns false if the
+// layout has to be built from scratch.
+static bool layout_edit_ft(text *t, size_t start, size_t old_end,
+                           size_t new_end, size_t span_start,
+                           size_t span_end)
+{
+    text_layout *layout = &t->layout;
+    size_t len = ustr_len(t->str);
+    size_t old_len = layout->len;
+    if (!layout->valid || layout->reversed ||
+        layout->num_carets != old_len + 1) {
+        return false;
+    }
+    assert(old_len == len - new_end + old_end);
 
-    return token;
+    // The glyphs [first, last) of the run the span was laid out in.
+    size_t num_glyphs = layout->num_glyphs;
+    size_t first = find_cluster(layout, 0, num_glyphs, span_start);
+    if (first == num_glyphs || get_glyph(layout, first).cluster >= span_end) {
+        return false;
+    }
+    size_t run_index = get_glyph(layout, first).run;
+    size_t last = num_glyphs;
+    for (size_t lo = first; lo < last;) {
+        size_t mid = lo + (last - lo) / 2;
+        if (get_glyph(layout, mid).run <= run_index) {
+            lo = mid + 1;
+        }
+        else {
+            last = mid;
+        }
+    }
+    const text_run *run = &layout->runs[run_index];
+
+    // Widen the edit to the glyphs [a, b) between safe breaks.
+    size_t a = prev_cluster(layout, first,
+                            find_cluster(layout, first, last, start));
+    while (a > first && get_glyph(layout, a).unsafe_to_break) {
+        a = prev_cluster(layout, first, a);
+    }
+    size_t b = find_cluster(layout, a, last, old_end);
+    if (b < last) {
+        b = next_cluster(layout, b, last);
+    }
+    while (b < last && get_glyph(layout, b).unsafe_to_break) {
+        b = next_cluster(layout, b, last);
+    }
+
+    size_t shape_start = min((size_t)get_glyph(layout, a).cluster, start);
+    size_t old_shape_end = b < last ? get_glyph(layout, b).cluster : span_end;
+    size_t shape_end = old_shape_end - old_end + new_end;
+    double x = get_glyph(layout, a).x;
+    double old_x = b < num_glyphs ? get_glyph(layout, b).x : layout->width;
+
+    const uint16_t *data = ustr_data(t->str);
+    hb_buffer_t *buf = hb_buffer_create();
+    unsigned int count = shape(buf, run->face, data, len,
+                               shape_start, shape_end);
+    hb_glyph_info_t *info = hb_buffer_get_glyph_infos(buf, NULL);
+    hb_glyph_position_t *pos = hb_buffer_get_glyph_positions(buf, NULL);
+
+    // The new glyphs have to join the ones in front of them where they
+    // were shaped apart, and their clusters have to go forward.
+    bool ok = count == 0 || a == first ||
+              (hb_glyph_info_get_glyph_flags(&info[0]) &
+               HB_GLYPH_FLAG_UNSAFE_TO_BREAK) == 0;
+    ok = ok && (count < 2 || info[0].cluster <= info[count - 1].cluster);
+    ok = ok && reserve_glyphs(layout, num_glyphs - (b - a) + count);
+    ok = ok && reserve_carets(layout, len + 1);
+    if (!ok) {
+        hb_buffer_destroy(buf);
+        return false;
+    }
+
+    // The glyphs [a, b) are the first after the gap once it is moved in
+    // front of them and are dropped by shrinking the stored ones at the end.
+    move_glyph_gap(layout, a);
+    layout->num_glyphs -= b - a;
+    for (unsigned int i = 0; i < count; i++) {
+        text_glyph g = make_glyph(&info[i], &pos[i], x, run_index);
+        push_glyph(layout, &g);
+        x += g.advance;
+    }
+    hb_buffer_destroy(buf);
+
+    move_caret_gap(layout, shape_start);
+    layout->num_carets -= old_shape_end - shape_start;
+    push_carets(layout, shape_start, shape_end, a, a + count, x);
+
+    // The glyphs and carets after the gaps count from the end of the line
+    // and so move along with it.
+    layout->width += x - old_x;
+    layout->len = len;
+    return true;
 }
+
+#endif
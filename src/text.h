@@ -1,6 +1,7 @@
 #pragma once
 
 #include "common.h"
+#include "font.h"
 
 typedef struct color color;
 typedef struct rect rect;
@@ -9,14 +10,14 @@ typedef struct text_attr text_attr;
 typedef struct ustr ustr;
 typedef struct vec2 vec2;
 
-typedef enum font_family_id {
-    FONT_FAMILY_MENLO,
-    FONT_FAMILY_MONACO,
-    FONT_FAMILY_COURIER_NEW,
-    FONT_FAMILY_DEFAULT = FONT_FAMILY_MENLO,
-} font_family_id;
+typedef struct text_cache_stats {
+    uint64_t layout_hits;   // Queries that reused the shaped line.
+    uint64_t layout_misses; // Queries that shaped the line.
+    uint64_t layout_edits;  // Edits that reshaped only around the change.
+} text_cache_stats;
 
 void text_system_init();
+void text_system_shutdown(void);
 
 text* text_create(void);
 text* text_create_ustr(ustr *);
@@ -33,23 +34,43 @@ text* text_ref(text *t);
 const ustr* text_ustr(const text *t);
 
 // Sets text attributes. Set start = 0 and len = 0
-// to set the attribute for the entire text length.
+// to set the attribute for the entire text length. Attributes override the
+// ones added before them where they overlap.
 void text_add_attr(text *t,
                    int32_t start, int32_t len,
                    font_family_id font_family, double font_size,
                    const color *c);
 
+// Called by text_attrs for every run of the text with the same attributes
+// in order of start. The runs never overlap and adding them in that order
+// lays out the same text. A len of 0 runs to the end of the text.
+typedef void (*text_attr_fn)(int32_t start, int32_t len,
+                             font_family_id font_family, double font_size,
+                             const color *c, void *user_data);
+
+void text_attrs(const text *t, text_attr_fn fn, void *user_data);
+
 void text_extents(const text *t, vec2 *dst);
 void text_metrics(const text *t, double *width, double *leading,
                   double *ascent, double *descent);
 double text_index_offset(const text *t, size_t index);
 
-void text_draw(const text *t, const rect *bbox, const rect *clip); 
+// Called by text_glyphs for every glyph to draw. x and y are the
+// framebuffer position of the glyph origin on the baseline.
+typedef void (*text_glyph_fn)(const font_face *face, const color *c,
+                              uint32_t glyph, double x, double y,
+                              void *user_data);
 
-// Sets the FNV-1a hash value of the text object using the input
-// hash as the initial value and rights the result bacl to the 
-// same address.
-void text_hash(const text *t, uint32_t *hash);
+// Visits the glyphs of the text laid out inside bbox. Text wider than the
+// bbox is truncated with an ellipsis.
+void text_glyphs(const text *t, const rect *bbox,
+                 text_glyph_fn fn, void *user_data);
+
+// Combines the hash64 of the string and the attributes of the text into
+// hash. The string's is kept up to date as it changes and the attributes
+// are hashed again only after they change, so hashing a text costs the same
+// whatever its length.
+void text_hash(const text *t, uint64_t *hash);
 
 // Sets the utf16 string index of the position relative to the text's origin.
 // Returns false if there is no hit, true otherwise.
@@ -59,6 +80,11 @@ bool text_hit(const text *t, const vec2 *pos, size_t *index);
 // The position is relative to the origin of the text.
 double text_index_pos(const text *t, size_t index);
 
+// Edit the string. The attributes move along with it and inserted code
+// units take those of the one in front of them, or of the first one when
+// inserted at the start.
 void text_append(text *t, const uint16_t *data, size_t len);
 void text_insert(text *t, size_t index, const uint16_t *data, size_t len);
 void text_remove(text *t, size_t start, size_t end);
+
+void text_cache_stats_get(text_cache_stats *dst);
@@ -0,0 +1,132 @@
+#include "thread.h"
+
+#include <stdlib.h>
+
+#ifndef BG_WINDOWS
+#include <unistd.h>
+#endif
+
+typedef struct thread_start_info {
+    thread_fn fn;
+    void *data;
+} thread_start_info;
+
+#ifdef BG_WINDOWS
+
+static DWORD WINAPI thread_main(LPVOID arg)
+{
+    thread_start_info info = *(thread_start_info*)arg;
+    free(arg);
+    info.fn(info.data);
+    return 0;
+}
+
+bool thread_start(thread *t, thread_fn fn, void *data)
+{
+    thread_start_info *info = malloc(sizeof(thread_start_info));
+    if (!info) {
+        return false;
+    }
+    info->fn = fn;
+    info->data = data;
+
+    *t = CreateThread(NULL, 0, thread_main, info, 0, NULL);
+    if (*t == NULL) {
+        free(info);
+        return false;
+    }
+    return true;
+}
+
+void thread_join(thread t)
+{
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+}
+
+void mutex_init(mutex *m) { InitializeCriticalSection(m); }
+void mutex_destroy(mutex *m) { DeleteCriticalSection(m); }
+void mutex_lock(mutex *m) { EnterCriticalSection(m); }
+void mutex_unlock(mutex *m) { LeaveCriticalSection(m); }
+void cond_init(cond_var *c) { InitializeConditionVariable(c); }
+void cond_destroy(cond_var *c) { (void)c; }
+
+void cond_wait(cond_var *c, mutex *m)
+{
+    SleepConditionVariableCS(c, m, INFINITE);
+}
+
+void cond_signal(cond_var *c) { WakeConditionVariable(c); }
+void cond_broadcast(cond_var *c) { WakeAllConditionVariable(c); }
+
+int32_t atomic_add(volatile int32_t *v, int32_t n)
+{
+    return InterlockedAdd((volatile LONG*)v, n);
+}
+
+int32_t atomic_get(volatile int32_t *v)
+{
+    return InterlockedCompareExchange((volatile LONG*)v, 0, 0);
+}
+
+uint32_t get_core_count(void)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return max(info.dwNumberOfProcessors, 1);
+}
+
+#else
+
+static void* thread_main(void *arg)
+{
+    thread_start_info info = *(thread_start_info*)arg;
+    free(arg);
+    info.fn(info.data);
+    return NULL;
+}
+
+bool thread_start(thread *t, thread_fn fn, void *data)
+{
+    thread_start_info *info = malloc(sizeof(thread_start_info));
+    if (!info) {
+        return false;
+    }
+    info->fn = fn;
+    info->data = data;
+
+    if (pthread_create(t, NULL, thread_main, info) != 0) {
+        free(info);
+        return false;
+    }
+    return true;
+}
+
+void thread_join(thread t) { pthread_join(t, NULL); }
+void mutex_init(mutex *m) { pthread_mutex_init(m, NULL); }
+void mutex_destroy(mutex *m) { pthread_mutex_destroy(m); }
+void mutex_lock(mutex *m) { pthread_mutex_lock(m); }
+void mutex_unlock(mutex *m) { pthread_mutex_unlock(m); }
+void cond_init(cond_var *c) { pthread_cond_init(c, NULL); }
+void cond_destroy(cond_var *c) { pthread_cond_destroy(c); }
+void cond_wait(cond_var *c, mutex *m) { pthread_cond_wait(c, m); }
+void cond_signal(cond_var *c) { pthread_cond_signal(c); }
+void cond_broadcast(cond_var *c) { pthread_cond_broadcast(c); }
+
+int32_t atomic_add(volatile int32_t *v, int32_t n)
+{
+    return __atomic_add_fetch(v, n, __ATOMIC_ACQ_REL);
+}
+
+int32_t atomic_get(volatile int32_t *v)
+{
+    return __atomic_load_n(v, __ATOMIC_ACQUIRE);
+}
+
+uint32_t get_core_count(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (uint32_t)count : 1;
+}
+
+#endif
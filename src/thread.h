@@ -0,0 +1,45 @@
+#pragma once
+
+#include "common.h"
+
+#ifdef BG_WINDOWS
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+// Thin wrappers over the platform threads, locks and condition variables.
+
+#ifdef BG_WINDOWS
+typedef HANDLE thread;
+typedef CRITICAL_SECTION mutex;
+typedef CONDITION_VARIABLE cond_var;
+#else
+typedef pthread_t thread;
+typedef pthread_mutex_t mutex;
+typedef pthread_cond_t cond_var;
+#endif
+
+typedef void (*thread_fn)(void *data);
+
+bool thread_start(thread *t, thread_fn fn, void *data);
+void thread_join(thread t);
+
+void mutex_init(mutex *m);
+void mutex_destroy(mutex *m);
+void mutex_lock(mutex *m);
+void mutex_unlock(mutex *m);
+
+void cond_init(cond_var *c);
+void cond_destroy(cond_var *c);
+void cond_wait(cond_var *c, mutex *m);
+void cond_signal(cond_var *c);
+void cond_broadcast(cond_var *c);
+
+// Returns the new value.
+int32_t atomic_add(volatile int32_t *v, int32_t n);
+int32_t atomic_get(volatile int32_t *v);
+
+uint32_t get_core_count(void);
@@ -22,6 +22,11 @@ typedef struct ustr {
     size_t cap; // amount of space available in uint16_t units
     int32_t ref; // number of references to this ustr
     uint16_t *data; // UTF-16 encoded
+
+    // hash64 of the data, computed on demand and dropped whenever the data
+    // changes.
+    uint64_t hash;
+    bool hash_valid;
 } ustr;
 
 ustr* ustr_create()
@@ -42,6 +47,7 @@ ustr* ustr_create()
 
     result->len = 0;
     result->ref = 1;
+    result->hash_valid = false;
 
     return result;
 }
@@ -89,6 +95,7 @@ ustr* ustr_create_utf8(const char *utf8data, size_t len)
 
     result->len = dst_len;
     result->ref = 1;
+    result->hash_valid = false;
 
     return result;
 }
@@ -181,9 +188,18 @@ int32_t ustr_num_graphemes(const ustr* s)
     return count;
 }
 
-void ustr_hash(const ustr *s, uint32_t *v)
+void ustr_hash(const ustr *s, uint64_t *v)
 {
-    hash(v, (uint8_t*)s->data, (size_t)ustr_byte_len(s));
+    assert(s);
+    assert(v);
+
+    // Const gets in the way of caching the hash.
+    ustr *str = (ustr*)s;
+    if (!str->hash_valid) {
+        str->hash = hash64(str->data, ustr_byte_len(str));
+        str->hash_valid = true;
+    }
+    *v = hash64_combine(*v, str->hash);
 }
 
 void ustr_append(ustr *s, const uint16_t *data, size_t len)
@@ -208,6 +224,7 @@ void ustr_append(ustr *s, const uint16_t *data, size_t len)
 
     memcpy(s->data + s->len, data, len * sizeof(uint16_t));
     s->len += len;
+    s->hash_valid = false;
 }
 
 void ustr_insert(ustr *s, size_t index, const uint16_t *data, size_t len)
@@ -216,24 +233,25 @@ void ustr_insert(ustr *s, size_t index, const uint16_t *data, size_t len)
     assert(data);
     assert(index <= s->len);
 
+    // Grow like ustr_append so typing doesn't reallocate every keystroke.
     size_t new_len = s->len + len;
-    size_t new_cap = new_len;
-    uint16_t *new_data = malloc(new_cap * sizeof(uint16_t));
-    if (!new_data) {
-        console_log("Failed to alloc when inserting into ustr");
-        assert(false);
-        return;
+    if (new_len > s->cap) {
+        size_t new_cap = max(new_len, s->cap * 2);
+        uint16_t *new_data = realloc(s->data, new_cap * sizeof(uint16_t));
+        if (!new_data) {
+            console_log("Failed to alloc when inserting into ustr");
+            assert(false);
+            return;
+        }
+        s->data = new_data;
+        s->cap = new_cap;
     }
 
-    memcpy(new_data, s->data, index * sizeof(uint16_t));
-    memcpy(new_data + index, data, len * sizeof(uint16_t));
-    memcpy(new_data + index + len, s->data + index, 
-           (s->len - index) * sizeof(uint16_t));
-
-    free(s->data);
-    s->data = new_data;
+    memmove(s->data + index + len, s->data + index,
+            (s->len - index) * sizeof(uint16_t));
+    memcpy(s->data + index, data, len * sizeof(uint16_t));
     s->len = new_len;
-    s->cap = new_cap;
+    s->hash_valid = false;
 }
 
 void ustr_remove(ustr *s, size_t start, size_t end)
@@ -246,7 +264,8 @@ void ustr_remove(ustr *s, size_t start, size_t end)
 
     if (end < s->len) {
         size_t byte_len = (s->len - end) * sizeof(uint16_t);
-        memcpy(s->data + start, s->data + end, byte_len);
+        memmove(s->data + start, s->data + end, byte_len);
     }
     s->len -= end - start;
+    s->hash_valid = false;
 }
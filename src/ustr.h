@@ -32,9 +32,9 @@ int32_t ustr_num_codepoints(const ustr *);
 // Returns the number of graphemes in the string.
 int32_t ustr_num_graphemes(const ustr *);
 
-// Returns the FNV-1a hash of the ustr using the input as the initial hash 
-// value.
-void ustr_hash(const ustr *s, uint32_t *hash);
+// Combines the hash64 of the string into hash. The hash of the string is
+// cached until it is modified so hashing unchanged strings is cheap.
+void ustr_hash(const ustr *s, uint64_t *hash);
 
 // Append data to the string.
 void ustr_append(ustr *s, const uint16_t *data, size_t len);
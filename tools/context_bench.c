@@ -0,0 +1,124 @@
+// Measures what the renderer pays per frame for a blend2d context that is
+// created and destroyed every frame compared to one that is kept alive and
+// only flushed, which is what render_end_frame does.
+//
+//   briskgit_bench [frames] [width] [height]
+
+#include <blend2d.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_FRAMES 1000
+#define BENCH_DEFAULT_WIDTH 1920
+#define BENCH_DEFAULT_HEIGHT 1080
+
+typedef struct bench_surface {
+    uint32_t *pixels;
+    int32_t w;
+    int32_t h;
+} bench_surface;
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+}
+
+static void create_context(const bench_surface *s, uint32_t threads,
+                           BLImageCore *img, BLContextCore *ctx)
+{
+    blImageInit(img);
+    blImageCreateFromData(img, s->w, s->h, BL_FORMAT_PRGB32, s->pixels,
+                          (intptr_t)s->w * 4, BL_DATA_ACCESS_RW, NULL, NULL);
+
+    BLContextCreateInfo create_info = {0};
+    create_info.threadCount = threads;
+    blContextInitAs(ctx, img, &create_info);
+}
+
+static void destroy_context(BLImageCore *img, BLContextCore *ctx)
+{
+    blContextEnd(ctx);
+    blContextDestroy(ctx);
+    blImageDestroy(img);
+}
+
+// The typing workload only redraws a couple of tiles per frame.
+static void draw_frame(BLContextCore *ctx, uint32_t frame)
+{
+    BLRgba c = { 1.0f, 1.0f, 1.0f, (float)(frame % 2) * 0.5f + 0.5f };
+    BLRect r = { 96.0, 96.0, 192.0, 96.0 };
+    blContextSetCompOp(ctx, BL_COMP_OP_SRC_OVER);
+    blContextSetFillStyleRgba(ctx, &c);
+    blContextFillRectD(ctx, &r);
+}
+
+static double bench_recreate(const bench_surface *s, uint32_t threads,
+                             uint32_t frames)
+{
+    double start = now_ms();
+    for (uint32_t i = 0; i < frames; i++) {
+        BLImageCore img;
+        BLContextCore ctx;
+        create_context(s, threads, &img, &ctx);
+        draw_frame(&ctx, i);
+        destroy_context(&img, &ctx);
+    }
+    return (now_ms() - start) / frames;
+}
+
+static double bench_persistent(const bench_surface *s, uint32_t threads,
+                               uint32_t frames)
+{
+    BLImageCore img;
+    BLContextCore ctx;
+    create_context(s, threads, &img, &ctx);
+
+    double start = now_ms();
+    for (uint32_t i = 0; i < frames; i++) {
+        draw_frame(&ctx, i);
+        blContextFlush(&ctx, BL_CONTEXT_FLUSH_SYNC);
+    }
+    double result = (now_ms() - start) / frames;
+
+    destroy_context(&img, &ctx);
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t frames = argc > 1 ? (uint32_t)atoi(argv[1]) : BENCH_DEFAULT_FRAMES;
+    bench_surface s = {
+        .w = argc > 2 ? atoi(argv[2]) : BENCH_DEFAULT_WIDTH,
+        .h = argc > 3 ? atoi(argv[3]) : BENCH_DEFAULT_HEIGHT,
+    };
+    if (frames == 0 || s.w <= 0 || s.h <= 0) {
+        fprintf(stderr, "usage: %s [frames] [width] [height]\n", argv[0]);
+        return 1;
+    }
+
+    s.pixels = calloc((size_t)s.w * (size_t)s.h, sizeof(uint32_t));
+    if (!s.pixels) {
+        fprintf(stderr, "Failed to allocate a %dx%d surface\n", s.w, s.h);
+        return 1;
+    }
+
+    printf("%u frames at %dx%d, ms per frame\n", frames, s.w, s.h);
+    printf("%-8s %12s %12s\n", "threads", "recreate", "persistent");
+
+    // The renderer uses synchronous contexts, threaded ones are listed to
+    // show what blend2d's own worker startup costs.
+    uint32_t thread_counts[] = { 0, 2, 4 };
+    for (size_t i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); i++) {
+        uint32_t threads = thread_counts[i];
+        double recreate = bench_recreate(&s, threads, frames);
+        double persistent = bench_persistent(&s, threads, frames);
+        printf("%-8u %12.4f %12.4f\n", threads, recreate, persistent);
+    }
+
+    free(s.pixels);
+    return 0;
+}
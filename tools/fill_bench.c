@@ -0,0 +1,146 @@
+// Measures the pixel aligned rect fills in src/fill.c against filling the
+// same rects through a synchronous blend2d context, which is what the
+// renderer used for them before. Every kernel the CPU supports is listed.
+//
+//   briskgit_fill_bench [iterations] [width] [height]
+
+#include <blend2d.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "fill.h"
+#include "rect.h"
+
+#define BENCH_DEFAULT_ITERATIONS 200
+#define BENCH_DEFAULT_WIDTH 1920
+#define BENCH_DEFAULT_HEIGHT 1080
+#define BENCH_NUM_RECTS 256
+
+typedef struct bench_surface {
+    uint32_t *pixels;
+    int32_t w;
+    int32_t h;
+} bench_surface;
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+}
+
+// A mix of line highlights, selections and small boxes like the ones a text
+// field draws. Always the same sequence so every run fills the same pixels.
+static void make_rects(const bench_surface *s, recti *rects, uint32_t count)
+{
+    srand(1);
+    for (uint32_t i = 0; i < count; i++) {
+        recti *r = &rects[i];
+        r->w = 8 + rand() % (s->w / 2);
+        r->h = 8 + rand() % 48;
+        r->x = rand() % (s->w - r->w);
+        r->y = rand() % (s->h - r->h);
+    }
+}
+
+static double bench_fill(const bench_surface *s, const recti *rects,
+                         uint32_t count, uint32_t color, uint32_t iterations)
+{
+    double start = now_ms();
+    for (uint32_t i = 0; i < iterations; i++) {
+        for (uint32_t j = 0; j < count; j++) {
+            fill_rect(s->pixels, (uint32_t)s->w, &rects[j], color);
+        }
+    }
+    return (now_ms() - start) / iterations;
+}
+
+static double bench_blend2d(const bench_surface *s, const recti *rects,
+                            uint32_t count, uint32_t color,
+                            uint32_t iterations)
+{
+    BLImageCore img;
+    blImageInit(&img);
+    blImageCreateFromData(&img, s->w, s->h, BL_FORMAT_PRGB32, s->pixels,
+                          (intptr_t)s->w * 4, BL_DATA_ACCESS_RW, NULL, NULL);
+
+    BLContextCreateInfo create_info = {0};
+    BLContextCore ctx;
+    blContextInitAs(&ctx, &img, &create_info);
+    blContextSetCompOp(&ctx, BL_COMP_OP_SRC_OVER);
+    blContextSetFillStyleRgba32(&ctx, color);
+
+    double start = now_ms();
+    for (uint32_t i = 0; i < iterations; i++) {
+        for (uint32_t j = 0; j < count; j++) {
+            const recti *r = &rects[j];
+            BLRectI bl_rect = { r->x, r->y, r->w, r->h };
+            blContextFillRectI(&ctx, &bl_rect);
+        }
+        blContextFlush(&ctx, BL_CONTEXT_FLUSH_SYNC);
+    }
+    double result = (now_ms() - start) / iterations;
+
+    blContextEnd(&ctx);
+    blContextDestroy(&ctx);
+    blImageDestroy(&img);
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t iterations = argc > 1 ? (uint32_t)atoi(argv[1])
+                                   : BENCH_DEFAULT_ITERATIONS;
+    bench_surface s = {
+        .w = argc > 2 ? atoi(argv[2]) : BENCH_DEFAULT_WIDTH,
+        .h = argc > 3 ? atoi(argv[3]) : BENCH_DEFAULT_HEIGHT,
+    };
+    if (iterations == 0 || s.w < 64 || s.h < 64) {
+        fprintf(stderr, "usage: %s [iterations] [width >= 64] [height >= 64]\n",
+                argv[0]);
+        return 1;
+    }
+
+    s.pixels = calloc((size_t)s.w * (size_t)s.h, sizeof(uint32_t));
+    if (!s.pixels) {
+        fprintf(stderr, "Failed to allocate a %dx%d surface\n", s.w, s.h);
+        return 1;
+    }
+
+    recti rects[BENCH_NUM_RECTS];
+    make_rects(&s, rects, BENCH_NUM_RECTS);
+    fill_init();
+
+    // blend2d takes straight colors for Rgba32, both are white so the
+    // premultiplied value only differs in alpha.
+    uint32_t opaque = 0xffffffff;
+    uint32_t translucent = 0x80808080;
+    uint32_t translucent_straight = 0x80ffffff;
+
+    printf("%u rects, %u iterations at %dx%d, ms per iteration\n",
+           BENCH_NUM_RECTS, iterations, s.w, s.h);
+    printf("%-8s %12s %12s\n", "path", "opaque", "translucent");
+
+    double bl_opaque = bench_blend2d(&s, rects, BENCH_NUM_RECTS, opaque,
+                                     iterations);
+    double bl_translucent = bench_blend2d(&s, rects, BENCH_NUM_RECTS,
+                                          translucent_straight, iterations);
+    printf("%-8s %12.4f %12.4f\n", "blend2d", bl_opaque, bl_translucent);
+
+    for (uint32_t k = 0; k < FILL_KERNEL_COUNT; k++) {
+        if (!fill_set_kernel((fill_kernel)k)) {
+            continue;
+        }
+        double fill_opaque = bench_fill(&s, rects, BENCH_NUM_RECTS, opaque,
+                                        iterations);
+        double fill_translucent = bench_fill(&s, rects, BENCH_NUM_RECTS,
+                                             translucent, iterations);
+        printf("%-8s %12.4f %12.4f\n", fill_kernel_name((fill_kernel)k),
+               fill_opaque, fill_translucent);
+    }
+
+    free(s.pixels);
+    return 0;
+}
@@ -0,0 +1,181 @@
+// Measures the throughput of hash64 in src/hash.c against the byte wise
+// FNV-1a hash it replaces in the tile cache, for inputs from the size of a
+// command record up to long strings. Every kernel the CPU supports is
+// listed. The kernels are first checked to produce the same digests, in
+// one go and in uneven updates, and to tell apart inputs whose stripes only
+// come in another order.
+//
+//   briskgit_hash_bench [megabytes]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+
+#define BENCH_DEFAULT_MEGABYTES 256
+#define BENCH_BUFFER_SIZE (1024 * 1024)
+#define BENCH_CHECK_SIZE 1024
+#define BENCH_PERMUTE_STRIPES 40
+
+static const size_t BENCH_SIZES[] = { 8, 24, 64, 256, 4096, 65536 };
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+}
+
+// Keeps the compiler from dropping the hashes.
+static volatile uint64_t _sink;
+
+static double bench_fnv(const uint8_t *buf, size_t size, size_t total)
+{
+    size_t count = total / size;
+    uint32_t v = HASH_INITIAL;
+    double start = now_ms();
+    for (size_t i = 0; i < count; i++) {
+        size_t offset = (i * size) % (BENCH_BUFFER_SIZE - size + 1);
+        hash(&v, (uint8_t*)buf + offset, size);
+    }
+    double ms = now_ms() - start;
+    _sink = v;
+    return (double)(count * size) / (ms * 1000000.0);
+}
+
+static double bench_hash64(const uint8_t *buf, size_t size, size_t total)
+{
+    size_t count = total / size;
+    uint64_t v = HASH64_INITIAL;
+    double start = now_ms();
+    for (size_t i = 0; i < count; i++) {
+        size_t offset = (i * size) % (BENCH_BUFFER_SIZE - size + 1);
+        v = hash64_combine(v, hash64(buf + offset, size));
+    }
+    double ms = now_ms() - start;
+    _sink = v;
+    return (double)(count * size) / (ms * 1000000.0);
+}
+
+// Hashes every length up to BENCH_CHECK_SIZE in one go and in updates of
+// uneven sizes, which have to agree with the scalar kernel.
+static bool check_kernel(const uint8_t *buf, hash_kernel kernel)
+{
+    for (size_t len = 0; len <= BENCH_CHECK_SIZE; len++) {
+        hash_set_kernel(HASH_KERNEL_SCALAR);
+        uint64_t expected = hash64(buf, len);
+
+        hash_set_kernel(kernel);
+        uint64_t whole = hash64(buf, len);
+
+        hash64_state s;
+        hash64_begin(&s);
+        size_t offset = 0;
+        for (size_t step = 1; offset < len; step = step * 3 % 97 + 1) {
+            size_t count = min(step, len - offset);
+            hash64_update(&s, buf + offset, count);
+            offset += count;
+        }
+        uint64_t pieces = hash64_digest(&s);
+
+        if (whole != expected || pieces != expected) {
+            fprintf(stderr, "%s: %zu bytes hash to %016llx and %016llx "
+                    "in pieces instead of %016llx\n", hash_kernel_name(kernel),
+                    len, (unsigned long long)whole, (unsigned long long)pieces,
+                    (unsigned long long)expected);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Swaps two stripes of inputs from 2 to BENCH_PERMUTE_STRIPES stripes long,
+// within and across the blocks between scrambles, which has to change the
+// digest.
+static bool check_permutations(const uint8_t *buf)
+{
+    uint8_t permuted[BENCH_PERMUTE_STRIPES * HASH64_STRIPE_SIZE];
+    for (size_t n = 2; n <= BENCH_PERMUTE_STRIPES; n++) {
+        size_t len = n * HASH64_STRIPE_SIZE;
+        uint64_t expected = hash64(buf, len);
+        for (size_t a = 0; a < n; a++) {
+            for (size_t b = a + 1; b < n; b++) {
+                memcpy(permuted, buf, len);
+                memcpy(permuted + a * HASH64_STRIPE_SIZE,
+                       buf + b * HASH64_STRIPE_SIZE, HASH64_STRIPE_SIZE);
+                memcpy(permuted + b * HASH64_STRIPE_SIZE,
+                       buf + a * HASH64_STRIPE_SIZE, HASH64_STRIPE_SIZE);
+                if (hash64(permuted, len) == expected) {
+                    fprintf(stderr, "%s: swapping stripes %zu and %zu of "
+                            "%zu hashes to the same %016llx\n",
+                            hash_kernel_name(hash_get_kernel()), a, b, n,
+                            (unsigned long long)expected);
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    size_t megabytes = argc > 1 ? (size_t)atoi(argv[1])
+                                : BENCH_DEFAULT_MEGABYTES;
+    if (megabytes == 0) {
+        fprintf(stderr, "usage: %s [megabytes]\n", argv[0]);
+        return 1;
+    }
+    size_t total = megabytes * 1024 * 1024;
+
+    uint8_t *buf = malloc(BENCH_BUFFER_SIZE);
+    if (!buf) {
+        fprintf(stderr, "Failed to allocate the input\n");
+        return 1;
+    }
+    srand(1);
+    for (size_t i = 0; i < BENCH_BUFFER_SIZE; i++) {
+        buf[i] = (uint8_t)rand();
+    }
+
+    hash_init();
+    hash_kernel best = hash_get_kernel();
+    for (uint32_t k = 0; k < HASH_KERNEL_COUNT; k++) {
+        if (hash_set_kernel((hash_kernel)k) &&
+            (!check_kernel(buf, (hash_kernel)k) || !check_permutations(buf))) {
+            free(buf);
+            return 1;
+        }
+    }
+    hash_set_kernel(best);
+
+    printf("%zu MB per size, GB/s\n", megabytes);
+    printf("%-14s", "hash");
+    for (size_t i = 0; i < array_size(BENCH_SIZES); i++) {
+        printf(" %9zu", BENCH_SIZES[i]);
+    }
+    printf("\n");
+
+    printf("%-14s", "fnv1a");
+    for (size_t i = 0; i < array_size(BENCH_SIZES); i++) {
+        printf(" %9.3f", bench_fnv(buf, BENCH_SIZES[i], total));
+    }
+    printf("\n");
+
+    for (uint32_t k = 0; k < HASH_KERNEL_COUNT; k++) {
+        if (!hash_set_kernel((hash_kernel)k)) {
+            continue;
+        }
+        printf("hash64 %-7s", hash_kernel_name((hash_kernel)k));
+        for (size_t i = 0; i < array_size(BENCH_SIZES); i++) {
+            printf(" %9.3f", bench_hash64(buf, BENCH_SIZES[i], total));
+        }
+        printf("\n");
+    }
+
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,287 @@
+// Replays a capture through the renderer on the headless backend and reports
+// how long render_end_frame took for every frame along with the frame
+// statistics of the renderer. Captures are written by the app when
+// BRISKGIT_CAPTURE is set to a path, see src/capture.h.
+//
+//   briskgit_replay [-p] [-t tile_size] [-r repeat] [-d dir] [-q] [-v]
+//                   <capture>
+//
+//   -p  Render pipelined. Frames are timed while the last one renders and
+//       presented, and dumped, one frame late.
+//   -t  Fixed tile size, 0 adapts it (default).
+//   -r  Replay the capture this many times, the first pass warms the caches.
+//   -d  Write every frame to dir as frame_NNNNN.ppm.
+//   -q  Only print the summary.
+//   -v  Check every frame against a full redraw and fail if any differ.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "eva/eva.h"
+
+#include "capture.h"
+#include "console.h"
+#include "eva_headless.h"
+#include "render.h"
+#include "text.h"
+
+typedef struct replay_options {
+    const char *path;
+    const char *dump_dir;
+    bool pipelined;
+    bool quiet;
+    bool verify;
+    uint32_t tile_size;
+    uint32_t repeat;
+} replay_options;
+
+typedef struct replay_timings {
+    double *ms;
+    uint32_t count;
+    uint32_t cap;
+} replay_timings;
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+}
+
+static bool parse_options(int argc, char **argv, replay_options *dst)
+{
+    *dst = (replay_options){ .repeat = 1 };
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (strcmp(arg, "-p") == 0) {
+            dst->pipelined = true;
+        }
+        else if (strcmp(arg, "-q") == 0) {
+            dst->quiet = true;
+        }
+        else if (strcmp(arg, "-v") == 0) {
+            dst->verify = true;
+        }
+        else if (strcmp(arg, "-t") == 0 && has_value) {
+            dst->tile_size = (uint32_t)atoi(argv[++i]);
+        }
+        else if (strcmp(arg, "-r") == 0 && has_value) {
+            dst->repeat = (uint32_t)atoi(argv[++i]);
+        }
+        else if (strcmp(arg, "-d") == 0 && has_value) {
+            dst->dump_dir = argv[++i];
+        }
+        else if (arg[0] != '-' && !dst->path) {
+            dst->path = arg;
+        }
+        else {
+            return false;
+        }
+    }
+    return dst->path && dst->repeat > 0;
+}
+
+static void print_verify(const char *line, void *user_data)
+{
+    (void)user_data;
+    printf("%s\n", line);
+}
+
+static bool push_timing(replay_timings *t, double ms)
+{
+    if (t->count == t->cap) {
+        uint32_t cap = t->cap ? t->cap * 2 : 1024;
+        double *values = realloc(t->ms, cap * sizeof(double));
+        if (!values) {
+            return false;
+        }
+        t->ms = values;
+        t->cap = cap;
+    }
+    t->ms[t->count++] = ms;
+    return true;
+}
+
+static int compare_ms(const void *a, const void *b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void print_summary(replay_timings *t)
+{
+    if (t->count == 0) {
+        printf("no frames\n");
+        return;
+    }
+
+    double total = 0.0;
+    for (uint32_t i = 0; i < t->count; i++) {
+        total += t->ms[i];
+    }
+    qsort(t->ms, t->count, sizeof(double), compare_ms);
+
+    printf("%u frames, %.3f ms total, mean %.3f, p50 %.3f, p95 %.3f, "
+           "max %.3f ms\n",
+           t->count, total, total / t->count, t->ms[t->count / 2],
+           t->ms[(uint32_t)((t->count - 1) * 0.95)], t->ms[t->count - 1]);
+}
+
+// Issues the commands of the capture, timing render_end_frame. Returns
+// false if the capture is malformed.
+static bool replay(const replay_options *opts, uint32_t pass,
+                   replay_timings *timings, uint64_t *mismatched_tiles)
+{
+    capture_reader *r = capture_open(opts->path);
+    if (!r) {
+        fprintf(stderr, "Failed to open capture %s\n", opts->path);
+        return false;
+    }
+
+    uint32_t frame = 0;
+    bool in_frame = false;
+    bool ok = true;
+    capture_cmd cmd;
+    while (ok && capture_read(r, &cmd)) {
+        switch (cmd.op) {
+            case CAPTURE_OP_FRAME: {
+                // Every frame has to be ended before the next one begins.
+                if (in_frame) {
+                    ok = false;
+                    break;
+                }
+                eva_framebuffer fb = eva_get_framebuffer();
+                if (cmd.w == 0 || cmd.h == 0) {
+                    capture_close(r);
+                    fprintf(stderr, "Frame %u has an empty framebuffer\n",
+                            frame);
+                    return false;
+                }
+                if (cmd.w != fb.w || cmd.h != fb.h || cmd.scale != fb.scale_x) {
+                    eva_headless_set_size(cmd.w, cmd.h, cmd.scale);
+                }
+                render_begin_frame();
+                in_frame = true;
+                break;
+            }
+            case CAPTURE_OP_END_FRAME: {
+                if (!in_frame) {
+                    ok = false;
+                    break;
+                }
+                in_frame = false;
+
+                double start = now_ms();
+                render_end_frame();
+                double ms = now_ms() - start;
+                push_timing(timings, ms);
+
+                render_frame_stats stats;
+                render_frame_stats_get(&stats);
+                *mismatched_tiles += stats.mismatched_tiles;
+                if (!opts->quiet) {
+                    printf("%u %5u %8.3f %6u %4u %6u/%-6u %6u %10llu "
+                           "%6.3f %6.3f %6.3f %6.3f %6.3f %6.3f\n",
+                           pass, frame, ms, stats.num_cmds, stats.tile_size,
+                           stats.damaged_tiles, stats.num_tiles,
+                           stats.drawn_tiles,
+                           (unsigned long long)stats.raster_pixels,
+                           stats.wait_ms, stats.hash_ms, stats.damage_ms,
+                           stats.prepare_ms, stats.raster_ms,
+                           stats.composite_ms);
+                }
+
+                if (opts->dump_dir) {
+                    char path[1024];
+                    snprintf(path, sizeof(path), "%s/frame_%05u.ppm",
+                             opts->dump_dir, frame);
+                    if (!eva_headless_dump(path)) {
+                        fprintf(stderr, "Failed to write %s\n", path);
+                    }
+                }
+                frame++;
+                break;
+            }
+            case CAPTURE_OP_RECT:
+                render_draw_rect(&cmd.r, &cmd.c);
+                break;
+            case CAPTURE_OP_TEXT:
+                render_draw_text(cmd.t, &cmd.r, &cmd.clip);
+                break;
+            case CAPTURE_OP_BEGIN_SCROLL:
+                render_begin_scroll(&cmd.region, &cmd.offset, &cmd.c);
+                break;
+            case CAPTURE_OP_END_SCROLL:
+                render_end_scroll();
+                break;
+            case CAPTURE_OP_BEGIN_LAYER:
+                render_begin_layer();
+                break;
+            case CAPTURE_OP_END_LAYER:
+                render_end_layer();
+                break;
+            case CAPTURE_OP_COUNT:
+                break;
+        }
+    }
+
+    ok = ok && !capture_failed(r);
+    if (!ok) {
+        fprintf(stderr, "Capture %s is malformed after frame %u\n",
+                opts->path, frame);
+    }
+    capture_close(r);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    replay_options opts;
+    if (!parse_options(argc, argv, &opts)) {
+        fprintf(stderr, "usage: %s [-p] [-t tile_size] [-r repeat] [-d dir] "
+                "[-q] [-v] <capture>\n", argv[0]);
+        return 1;
+    }
+
+    text_system_init();
+    console_init();
+    eva_headless_set_size(1, 1, 1.0f);
+    if (!render_init()) {
+        fprintf(stderr, "Failed to init the renderer\n");
+        return 1;
+    }
+    render_set_tile_size(opts.tile_size);
+    render_set_pipelined(opts.pipelined);
+    render_set_verify(opts.verify, print_verify, NULL);
+
+    if (!opts.quiet) {
+        printf("pass frame ms cmds tile_size damaged/tiles drawn raster_px "
+               "wait hash damage prepare raster composite\n");
+    }
+
+    replay_timings timings = {0};
+    uint64_t mismatched_tiles = 0;
+    bool ok = true;
+    for (uint32_t pass = 0; pass < opts.repeat && ok; pass++) {
+        ok = replay(&opts, pass, &timings, &mismatched_tiles);
+    }
+
+    render_set_pipelined(false);
+    render_shutdown();
+    console_shutdown();
+    text_system_shutdown();
+
+    print_summary(&timings);
+    free(timings.ms);
+    if (opts.verify) {
+        printf("%llu tiles differed from a full redraw\n",
+               (unsigned long long)mismatched_tiles);
+        ok = ok && mismatched_tiles == 0;
+    }
+    return ok ? 0 : 1;
+}
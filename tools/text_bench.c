@@ -0,0 +1,165 @@
+// Measures caret and hit test queries on texts from 10 to 1,000,000 UTF-16
+// code units, along with the layout they are answered from and typing into
+// the middle of the text. Every index of a text is first checked to hit back
+// to itself from its caret offset.
+//
+//   briskgit_text_bench [queries]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "eva/eva.h"
+
+#include "color.h"
+#include "console.h"
+#include "eva_headless.h"
+#include "text.h"
+#include "ustr.h"
+#include "vec2.h"
+
+#define BENCH_DEFAULT_QUERIES 1000000
+#define BENCH_CHECK_LEN 10000
+#define BENCH_EDITS 1000
+
+static const size_t BENCH_LENS[] = { 10, 100, 1000, 10000, 100000, 1000000 };
+
+static const char BENCH_LINE[] =
+    "diff --git a/src/text.c b/src/text.c index 3f69f7d..c31659a 100644 ";
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+}
+
+// Keeps the compiler from dropping the queries.
+static volatile double _sink;
+
+static text* create_text(size_t len)
+{
+    uint16_t *data = malloc(len * sizeof(uint16_t));
+    if (!data) {
+        return NULL;
+    }
+    for (size_t i = 0; i < len; i++) {
+        data[i] = (uint16_t)BENCH_LINE[i % (sizeof(BENCH_LINE) - 1)];
+    }
+
+    text *t = text_create();
+    if (t) {
+        text_append(t, data, len);
+        text_add_attr(t, 0, 0, FONT_FAMILY_COURIER_NEW, 12.0, &COLOR_WHITE);
+    }
+    free(data);
+    return t;
+}
+
+// Every code unit of the text is a cluster of its own, so hitting the caret
+// offset of an index has to give the index back.
+static bool check_text(const text *t, size_t len)
+{
+    for (size_t i = 0; i < min(len, (size_t)BENCH_CHECK_LEN); i++) {
+        vec2 pos = { .x = text_index_offset(t, i), .y = 0.0 };
+        size_t index;
+        if (!text_hit(t, &pos, &index) || index != i) {
+            fprintf(stderr, "%zu code units: the caret of %zu hits %zu\n",
+                    len, i, index);
+            return false;
+        }
+    }
+    return true;
+}
+
+static double bench_offset(const text *t, size_t len, size_t queries)
+{
+    double v = 0.0;
+    double start = now_ms();
+    for (size_t i = 0; i < queries; i++) {
+        v += text_index_offset(t, (i * 7919) % (len + 1));
+    }
+    double ms = now_ms() - start;
+    _sink = v;
+    return ms * 1000000.0 / (double)queries;
+}
+
+static double bench_hit(const text *t, size_t queries)
+{
+    double width = text_index_offset(t, ustr_len(text_ustr(t)));
+    size_t v = 0;
+    double start = now_ms();
+    for (size_t i = 0; i < queries; i++) {
+        vec2 pos = { .x = width * (double)((i * 7919) % 10007) / 10007.0 };
+        size_t index;
+        text_hit(t, &pos, &index);
+        v += index;
+    }
+    double ms = now_ms() - start;
+    _sink = (double)v;
+    return ms * 1000000.0 / (double)queries;
+}
+
+// Inserts a code unit in the middle of the text and removes it again, laying
+// the text out after each like a text field does, and returns the mean time
+// of an edit.
+static double bench_edit(text *t, size_t len)
+{
+    uint16_t c = 'x';
+    vec2 extents;
+    double start = now_ms();
+    for (size_t i = 0; i < BENCH_EDITS; i++) {
+        text_insert(t, len / 2, &c, 1);
+        text_extents(t, &extents);
+        text_remove(t, len / 2, len / 2 + 1);
+        text_extents(t, &extents);
+    }
+    double ms = now_ms() - start;
+    return ms * 1000.0 / (BENCH_EDITS * 2);
+}
+
+int main(int argc, char **argv)
+{
+    size_t queries = argc > 1 ? (size_t)atoi(argv[1]) : BENCH_DEFAULT_QUERIES;
+    if (queries == 0) {
+        fprintf(stderr, "usage: %s [queries]\n", argv[0]);
+        return 1;
+    }
+
+    text_system_init();
+    console_init();
+    eva_headless_set_size(1, 1, 1.0f);
+
+    printf("%zu queries per length\n", queries);
+    printf("%9s %12s %12s %12s %12s\n",
+           "length", "layout ms", "offset ns", "hit ns", "edit us");
+    for (size_t i = 0; i < array_size(BENCH_LENS); i++) {
+        size_t len = BENCH_LENS[i];
+        text *t = create_text(len);
+        if (!t) {
+            fprintf(stderr, "Failed to create a text of %zu code units\n",
+                    len);
+            return 1;
+        }
+
+        double start = now_ms();
+        vec2 extents;
+        text_extents(t, &extents);
+        double layout_ms = now_ms() - start;
+
+        if (!check_text(t, len)) {
+            text_destroy(t);
+            return 1;
+        }
+
+        printf("%9zu %12.3f %12.2f %12.2f %12.2f\n", len, layout_ms,
+               bench_offset(t, len, queries), bench_hit(t, queries),
+               bench_edit(t, len));
+        text_destroy(t);
+    }
+
+    console_shutdown();
+    text_system_shutdown();
+    return 0;
+}